@@ -11,7 +11,7 @@ struct Bin {
   u32 tri_count = 0;
 };
 
-static f32 find_best_split_plane(BVHNode &node, std::span<TriangleGeom> tris,
+static f32 find_best_split_plane(BVHNode &node, const TriangleMesh &mesh,
                                  std::span<glm::vec3> centroids,
                                  std::span<u32> tri_ids, i32 &axis,
                                  f32 &split_pos) {
@@ -31,7 +31,7 @@ static f32 find_best_split_plane(BVHNode &node, std::span<TriangleGeom> tris,
     Bin bins[BIN_COUNT];
     f32 scale = BIN_COUNT / (bounds_max - bounds_min);
     for (u32 i = 0; i < node.tri_count; ++i) {
-      TriangleGeom &triangle = tris[tri_ids[node.local_left_first + i]];
+      TriangleGeom triangle = mesh.triangle(tri_ids[node.local_left_first + i]);
       f32 &centroid_pos = centroids[tri_ids[node.local_left_first + i]][a];
 
       u32 bin_idx =
@@ -74,7 +74,7 @@ static f32 find_best_split_plane(BVHNode &node, std::span<TriangleGeom> tris,
 }
 
 void BLAS::build(std::span<BVHNode> bvh_nodes, u32 bvh_nodes_offset,
-                 std::span<TriangleGeom> tris, std::span<glm::vec3> centroids,
+                 const TriangleMesh &mesh, std::span<glm::vec3> centroids,
                  std::span<u32> tri_ids, u32 tri_count, u32 tri_id_offset) {
   this->bvh_nodes_offset = bvh_nodes_offset;
   this->nodes_count = 1;
@@ -82,29 +82,29 @@ void BLAS::build(std::span<BVHNode> bvh_nodes, u32 bvh_nodes_offset,
   BVHNode &root = bvh_nodes[0];
   root.local_left_first = tri_id_offset;
   root.tri_count = tri_count;
-  update_node_bounds(bvh_nodes, tris, tri_ids, 0);
-  subdivide(bvh_nodes, tris, centroids, tri_ids, 0);
+  update_node_bounds(bvh_nodes, mesh, tri_ids, 0);
+  subdivide(bvh_nodes, mesh, centroids, tri_ids, 0);
 }
 
 void BLAS::update_node_bounds(std::span<BVHNode> bvh_nodes,
-                              std::span<TriangleGeom> tris,
+                              const TriangleMesh &mesh,
                               std::span<u32> tri_ids, u32 node_idx) {
   BVHNode &node = bvh_nodes[node_idx];
   node.aabb_min = glm::vec3(infinity);
   node.aabb_max = glm::vec3(-infinity);
   for (u32 i = 0; i < node.tri_count; ++i) {
-    u32 tri_id = tri_ids[node.local_left_first + i];
-    node.aabb_min = glm::min(node.aabb_min, glm::vec3(tris[tri_id].v0));
-    node.aabb_min = glm::min(node.aabb_min, glm::vec3(tris[tri_id].v1));
-    node.aabb_min = glm::min(node.aabb_min, glm::vec3(tris[tri_id].v2));
-
-    node.aabb_max = glm::max(node.aabb_max, glm::vec3(tris[tri_id].v0));
-    node.aabb_max = glm::max(node.aabb_max, glm::vec3(tris[tri_id].v1));
-    node.aabb_max = glm::max(node.aabb_max, glm::vec3(tris[tri_id].v2));
+    TriangleGeom triangle = mesh.triangle(tri_ids[node.local_left_first + i]);
+    node.aabb_min = glm::min(node.aabb_min, glm::vec3(triangle.v0));
+    node.aabb_min = glm::min(node.aabb_min, glm::vec3(triangle.v1));
+    node.aabb_min = glm::min(node.aabb_min, glm::vec3(triangle.v2));
+
+    node.aabb_max = glm::max(node.aabb_max, glm::vec3(triangle.v0));
+    node.aabb_max = glm::max(node.aabb_max, glm::vec3(triangle.v1));
+    node.aabb_max = glm::max(node.aabb_max, glm::vec3(triangle.v2));
   }
 }
 
-void BLAS::subdivide(std::span<BVHNode> bvh_nodes, std::span<TriangleGeom> tris,
+void BLAS::subdivide(std::span<BVHNode> bvh_nodes, const TriangleMesh &mesh,
                      std::span<glm::vec3> centroids, std::span<u32> tri_ids,
                      u32 node_idx) {
   BVHNode &node = bvh_nodes[node_idx];
@@ -112,7 +112,7 @@ void BLAS::subdivide(std::span<BVHNode> bvh_nodes, std::span<TriangleGeom> tris,
   // Detemine the split axis using SAH
   i32 best_axis = -1;
   f32 best_pos = 0.f;
-  f32 best_cost = find_best_split_plane(node, tris, centroids, tri_ids,
+  f32 best_cost = find_best_split_plane(node, mesh, centroids, tri_ids,
                                         best_axis, best_pos);
 
   glm::vec3 e = node.aabb_max - node.aabb_min;
@@ -152,21 +152,21 @@ void BLAS::subdivide(std::span<BVHNode> bvh_nodes, std::span<TriangleGeom> tris,
 
   node.local_left_first = left_idx;
   node.tri_count = 0;
-  update_node_bounds(bvh_nodes, tris, tri_ids, left_idx);
-  update_node_bounds(bvh_nodes, tris, tri_ids, right_idx);
+  update_node_bounds(bvh_nodes, mesh, tri_ids, left_idx);
+  update_node_bounds(bvh_nodes, mesh, tri_ids, right_idx);
 
   // Recursively partition nodes
-  subdivide(bvh_nodes, tris, centroids, tri_ids, left_idx);
-  subdivide(bvh_nodes, tris, centroids, tri_ids, right_idx);
+  subdivide(bvh_nodes, mesh, centroids, tri_ids, left_idx);
+  subdivide(bvh_nodes, mesh, centroids, tri_ids, right_idx);
 }
 
-void BLAS::refit(std::span<BVHNode> bvh_nodes, std::span<TriangleGeom> tris,
+void BLAS::refit(std::span<BVHNode> bvh_nodes, const TriangleMesh &mesh,
                  std::span<u32> tri_ids) {
   for (int i = int(nodes_count) - 1; i >= 0; --i) {
     BVHNode &node = bvh_nodes[i];
     // Is leaf?
     if (node.tri_count) {
-      update_node_bounds(bvh_nodes, tris, tri_ids, i);
+      update_node_bounds(bvh_nodes, mesh, tri_ids, i);
     } else {
       BVHNode &left_child = bvh_nodes[node.local_left_first];
       BVHNode &right_child = bvh_nodes[node.local_left_first + 1];
@@ -14,6 +14,11 @@ struct alignas(16) BVHNode {
   u32 tri_count;
 };
 
+enum BLASFlags : u32 {
+  // UVs exceed MAX_PACKED_UV and are stored as fp32, see VertexShading
+  BLAS_WIDE_UVS = 1,
+};
+
 struct alignas(16) BLAS {
 public:
   /**
@@ -25,9 +30,9 @@ public:
    * offset is not used to index into bvh_nodes
    */
   void build(std::span<BVHNode> bvh_nodes, u32 bvh_nodes_offset,
-             std::span<TriangleGeom> tris, std::span<glm::vec3> centroids,
+             const TriangleMesh &mesh, std::span<glm::vec3> centroids,
              std::span<u32> tri_ids, u32 tri_count, u32 tri_id_offset);
-  void refit(std::span<BVHNode> bvh_nodes, std::span<TriangleGeom> tris,
+  void refit(std::span<BVHNode> bvh_nodes, const TriangleMesh &mesh,
              std::span<u32> tri_ids);
 
 public:
@@ -35,13 +40,13 @@ public:
   u32 bvh_nodes_offset = 0;
   u32 nodes_count = 0;
   u32 tri_count_ = 0;
-  u32 padding;
+  u32 flags = 0; // BLASFlags
 
 private:
   void update_node_bounds(std::span<BVHNode> bvh_nodes,
-                          std::span<TriangleGeom> tris, std::span<u32> tri_ids,
+                          const TriangleMesh &mesh, std::span<u32> tri_ids,
                           u32 node_idx);
-  void subdivide(std::span<BVHNode> bvh_nodes, std::span<TriangleGeom> tris,
+  void subdivide(std::span<BVHNode> bvh_nodes, const TriangleMesh &mesh,
                  std::span<glm::vec3> centroids, std::span<u32> tri_ids,
                  u32 node_idx);
 };
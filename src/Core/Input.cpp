@@ -20,6 +20,7 @@ struct InputState {
   KeyboardState keyboard_previous_state;
   MouseState mouse_current_state;
   MouseState mouse_previous_state;
+  bool activity{false};
 };
 
 static bool is_initialized{false};
@@ -50,6 +51,7 @@ void InputSys::process_key(Keys key, bool pressed) {
   // Only handle if state changed
   if (state.keyboard_current_state.keys[key] != pressed) {
     state.keyboard_current_state.keys[key] = pressed;
+    state.activity = true;
 
     EventContext context;
     context.data.u16[0] = key;
@@ -62,6 +64,7 @@ void InputSys::process_mouse_button(Buttons button, bool pressed) {
   HASSERT(is_initialized);
   if (state.mouse_current_state.buttons[button] != pressed) {
     state.mouse_current_state.buttons[button] = pressed;
+    state.activity = true;
 
     EventContext context;
     context.data.u16[0] = button;
@@ -78,6 +81,7 @@ void InputSys::process_mouse_move(i16 x, i16 y) {
     // Update internal state.
     state.mouse_current_state.x = x;
     state.mouse_current_state.y = y;
+    state.activity = true;
 
     // Fire the event.
     EventContext context;
@@ -89,6 +93,7 @@ void InputSys::process_mouse_move(i16 x, i16 y) {
 
 void InputSys::process_mouse_wheel(i8 z_delta) {
   HASSERT(is_initialized);
+  state.activity = true;
   EventContext context;
   context.data.i8[0] = z_delta;
   EventSys::fire_event(SDL_EVENT_MOUSE_WHEEL, 0, context);
@@ -146,4 +151,11 @@ void InputSys::get_previous_frame_mouse_position(i32 *x, i32 *y) {
   *x = state.mouse_previous_state.x;
   *y = state.mouse_previous_state.y;
 }
+
+bool InputSys::consume_activity() {
+  HASSERT(is_initialized);
+  const bool activity = state.activity;
+  state.activity = false;
+  return activity;
+}
 } // namespace hlx
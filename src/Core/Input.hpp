@@ -47,5 +47,8 @@ struct HLX_API InputSys {
   static void process_mouse_button(Buttons button, bool pressed);
   static void process_mouse_move(i16 x, i16 y);
   static void process_mouse_wheel(i8 z_delta);
+  // True if a key, mouse button, mouse move or wheel event arrived since the
+  // last call
+  static bool consume_activity();
 };
 } // namespace hlx
@@ -4,6 +4,11 @@
 #include <bit>
 #include <cstdlib>
 #include <tlsf/tlsf.h>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
 
 #define TLSF_ALLOCATOR_STATS
 
@@ -55,6 +60,35 @@ static void exit_walker(void *ptr, size_t size, int used, void *user) {
     HERROR("Found active allocation {}, {}", ptr, size);
 }
 
+// Commit granularity of the growable allocators
+static constexpr size_t GROW_GRANULARITY = hkilo(64);
+
+static void *reserve_memory(size_t size) {
+#if defined(_WIN32)
+  return VirtualAlloc(nullptr, size, MEM_RESERVE, PAGE_NOACCESS);
+#else
+  void *ptr = mmap(nullptr, size, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  return ptr == MAP_FAILED ? nullptr : ptr;
+#endif
+}
+
+static bool commit_memory(void *ptr, size_t size) {
+#if defined(_WIN32)
+  return VirtualAlloc(ptr, size, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+#else
+  return mprotect(ptr, size, PROT_READ | PROT_WRITE) == 0;
+#endif
+}
+
+static void release_memory(void *ptr, size_t size) {
+#if defined(_WIN32)
+  VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+  munmap(ptr, size);
+#endif
+}
+
 void TlsfAllocator::init(size_t size, size_t alignment) {
   HASSERT(!memory);
   size_t tlsf_overhead =
@@ -85,10 +119,61 @@ void TlsfAllocator::init(size_t size, size_t alignment) {
   HASSERT(tlsf_handle);
 }
 
+void TlsfAllocator::init_growable(size_t size, size_t reserve_size) {
+  HASSERT(!memory);
+  size = align_up(size, GROW_GRANULARITY);
+  reserve_size = align_up(reserve_size, GROW_GRANULARITY);
+  HASSERT(size <= reserve_size);
+  HASSERT_MSGS(size <= tlsf_block_size_max(), "size must not exceed {}",
+               tlsf_block_size_max());
+
+  // The reservation is page aligned, which covers every pool alignment
+  memory = reserve_memory(reserve_size);
+  HASSERT(memory);
+  const bool committed = commit_memory(memory, size);
+  HASSERT(committed);
+  is_aligned = false;
+  is_growable = true;
+  max_size = size;
+  reserved_size = reserve_size;
+  allocated_size = 0;
+
+  tlsf_handle = tlsf_create_with_pool(memory, size);
+  HASSERT(tlsf_handle);
+}
+
+bool TlsfAllocator::grow(size_t new_size) {
+  new_size = align_up(new_size, GROW_GRANULARITY);
+  if (!is_growable || new_size > reserved_size)
+    return false;
+  if (new_size <= max_size)
+    return true;
+
+  char *grow_start = static_cast<char *>(memory) + max_size;
+  if (!commit_memory(grow_start, new_size - max_size))
+    return false;
+
+  // A single tlsf pool cannot exceed tlsf_block_size_max()
+  const size_t max_pool_size = tlsf_block_size_max() & ~(GROW_GRANULARITY - 1);
+  while (max_size < new_size) {
+    const size_t pool_size = std::min(new_size - max_size, max_pool_size);
+    pool_t pool = tlsf_add_pool(tlsf_handle,
+                                static_cast<char *>(memory) + max_size,
+                                pool_size);
+    HASSERT(pool);
+    grown_pools.push_back(pool);
+    max_size += pool_size;
+  }
+  return true;
+}
+
 void TlsfAllocator::shutdown() {
   MemoryStatistics stats{0, max_size};
   pool_t pool = tlsf_get_pool(tlsf_handle);
   tlsf_walk_pool(pool, exit_walker, (void *)&stats);
+  for (void *grown_pool : grown_pools) {
+    tlsf_walk_pool(grown_pool, exit_walker, (void *)&stats);
+  }
 
   if (stats.allocated_bytes) {
     char str[20];
@@ -104,9 +189,12 @@ void TlsfAllocator::shutdown() {
               "Allocations still present. Check your code!");
 
   tlsf_destroy(tlsf_handle);
+  grown_pools.clear();
 
   if (memory) {
-    if (is_aligned) {
+    if (is_growable) {
+      release_memory(memory, reserved_size);
+    } else if (is_aligned) {
 #if defined(_MSC_VER)
       _aligned_free(memory);
 #else
@@ -118,6 +206,8 @@ void TlsfAllocator::shutdown() {
   }
 
   memory = nullptr;
+  is_growable = false;
+  reserved_size = 0;
 }
 
 void *TlsfAllocator::allocate(size_t size, size_t alignment) {
@@ -125,6 +215,8 @@ void *TlsfAllocator::allocate(size_t size, size_t alignment) {
   void *allocated_memory = alignment == 1
                                ? tlsf_malloc(tlsf_handle, size)
                                : tlsf_memalign(tlsf_handle, alignment, size);
+  if (!allocated_memory)
+    return nullptr;
   size_t actual_size = tlsf_block_size(allocated_memory);
   allocated_size += actual_size;
 
@@ -9,18 +9,31 @@ namespace hlx {
 struct TlsfAllocator {
 public:
   void init(size_t size, size_t alignment);
+  // Reserves reserve_size bytes of address space but only commits size bytes.
+  // grow() commits more of the reservation in place, so offsets into memory
+  // stay valid
+  void init_growable(size_t size, size_t reserve_size);
   void shutdown();
 
+  // Returns false if the allocator is not growable or the reservation is
+  // exhausted
+  bool grow(size_t new_size);
+
+  // Returns nullptr if there is no free block large enough
   void *allocate(size_t size, size_t alignment);
   void deallocate(void *pointer);
 
 public:
   size_t allocated_size{0};
   size_t max_size{0};
+  size_t reserved_size{0};
   void *memory{nullptr};
 
 private:
   void *tlsf_handle{nullptr};
   bool is_aligned{false};
+  bool is_growable{false};
+  // Pools added by grow(), the first pool is owned by tlsf_handle
+  std::vector<void *> grown_pools;
 };
 } // namespace hlx
@@ -0,0 +1,275 @@
+#include "LightList.hpp"
+#include "Core/Assert.hpp"
+// Vendor
+#include <algorithm>
+#include <bit>
+#include <glm/common.hpp>
+#include <glm/geometric.hpp>
+#include <glm/gtc/constants.hpp>
+#include <numeric>
+
+// Centroid bins of a split along the widest axis
+static constexpr u32 LIGHT_BVH_BIN_COUNT = 12;
+
+namespace hlx {
+
+void build_alias_table(std::span<LightTriangle> lights,
+                       std::span<const f32> weights) {
+  HASSERT(lights.size() == weights.size());
+  const u32 count = static_cast<u32>(lights.size());
+  f64 weight_sum = 0.0;
+  for (const f32 weight : weights) {
+    weight_sum += weight;
+  }
+  HASSERT(weight_sum > 0.0);
+
+  // Weights scaled so that the mean is 1, split into slots below and above
+  std::vector<f64> scaled(count);
+  std::vector<u32> small;
+  std::vector<u32> large;
+  for (u32 i = 0; i < count; ++i) {
+    lights[i].pdf = static_cast<f32>(weights[i] / weight_sum);
+    scaled[i] = weights[i] / weight_sum * count;
+    (scaled[i] < 1.0 ? small : large).push_back(i);
+  }
+
+  // Each small slot is topped up by a large one, which loses as much
+  while (!small.empty() && !large.empty()) {
+    const u32 s = small.back();
+    small.pop_back();
+    const u32 l = large.back();
+    lights[s].alias_probability = static_cast<f32>(scaled[s]);
+    lights[s].alias = l;
+    scaled[l] -= 1.0 - scaled[s];
+    if (scaled[l] < 1.0) {
+      large.pop_back();
+      small.push_back(l);
+    }
+  }
+  // What is left is 1 up to rounding
+  for (const u32 i : large) {
+    lights[i].alias_probability = 1.f;
+    lights[i].alias = i;
+  }
+  for (const u32 i : small) {
+    lights[i].alias_probability = 1.f;
+    lights[i].alias = i;
+  }
+}
+
+static f32 safe_acos(f32 x) { return std::acos(std::clamp(x, -1.f, 1.f)); }
+
+// Smallest cone holding both cones, see "Importance Sampling of Many Lights
+// with Adaptive Tree Splitting"
+static void union_cones(glm::vec3 &axis, f32 &cos_theta,
+                        const glm::vec3 &axis_b, f32 cos_theta_b) {
+  const f32 pi = glm::pi<f32>();
+  const f32 theta_a = safe_acos(cos_theta);
+  const f32 theta_b = safe_acos(cos_theta_b);
+  const f32 theta_d = safe_acos(glm::dot(axis, axis_b));
+  if (std::min(theta_d + theta_b, pi) <= theta_a)
+    return;
+  if (std::min(theta_d + theta_a, pi) <= theta_b) {
+    axis = axis_b;
+    cos_theta = cos_theta_b;
+    return;
+  }
+
+  const f32 theta_o = 0.5f * (theta_a + theta_d + theta_b);
+  const glm::vec3 rotation_axis = glm::cross(axis, axis_b);
+  const f32 rotation_length = glm::length(rotation_axis);
+  if (theta_o >= pi || rotation_length == 0.f) {
+    cos_theta = -1.f;
+    return;
+  }
+  // Rotate axis towards axis_b, the rotation axis is orthogonal to it
+  const f32 theta_r = theta_o - theta_a;
+  axis = axis * std::cos(theta_r) +
+         glm::cross(rotation_axis / rotation_length, axis) * std::sin(theta_r);
+  axis = glm::normalize(axis);
+  cos_theta = std::cos(theta_o);
+}
+
+// Lights without power are left out of the bounds, they are never sampled
+static LightBVHNode union_light_bounds(const LightBVHNode &a,
+                                       const LightBVHNode &b) {
+  if (a.power == 0.f)
+    return b;
+  if (b.power == 0.f)
+    return a;
+  LightBVHNode bounds = a;
+  bounds.aabb_min = glm::min(a.aabb_min, b.aabb_min);
+  bounds.aabb_max = glm::max(a.aabb_max, b.aabb_max);
+  union_cones(bounds.axis, bounds.cos_theta_o, b.axis, b.cos_theta_o);
+  bounds.cos_theta_e = std::min(a.cos_theta_e, b.cos_theta_e);
+  bounds.power = a.power + b.power;
+  bounds.two_sided = a.two_sided | b.two_sided;
+  return bounds;
+}
+
+// Surface area orientation heuristic, power times the solid angle measure of
+// the emission directions times the surface area
+static f32 get_orientation_cost(const LightBVHNode &bounds) {
+  const f32 pi = glm::pi<f32>();
+  const f32 theta_o = safe_acos(bounds.cos_theta_o);
+  const f32 theta_e = safe_acos(bounds.cos_theta_e);
+  const f32 theta_w = std::min(theta_o + theta_e, pi);
+  const f32 sin_theta_o =
+      std::sqrt(std::max(1.f - bounds.cos_theta_o * bounds.cos_theta_o, 0.f));
+  const f32 m_omega =
+      2.f * pi * (1.f - bounds.cos_theta_o) +
+      0.5f * pi *
+          (2.f * theta_w * sin_theta_o - std::cos(theta_o - 2.f * theta_w) -
+           2.f * theta_o * sin_theta_o + bounds.cos_theta_o);
+  const glm::vec3 e = bounds.aabb_max - bounds.aabb_min;
+  return bounds.power * m_omega * 2.f * (e.x * e.y + e.y * e.z + e.x * e.z);
+}
+
+LightBVHNode get_triangle_light_bounds(const glm::vec3 &v0,
+                                       const glm::vec3 &v1,
+                                       const glm::vec3 &v2, f32 power) {
+  const glm::vec3 normal = glm::cross(v1 - v0, v2 - v0);
+  const f32 normal_length = glm::length(normal);
+  LightBVHNode bounds{};
+  bounds.aabb_min = glm::min(v0, glm::min(v1, v2));
+  bounds.aabb_max = glm::max(v0, glm::max(v1, v2));
+  bounds.axis =
+      normal_length > 0.f ? normal / normal_length : glm::vec3(0.f, 0.f, 1.f);
+  bounds.cos_theta_o = 1.f;
+  // Diffuse emission reaches the whole hemisphere
+  bounds.cos_theta_e = 0.f;
+  bounds.power = power;
+  bounds.two_sided = 1;
+  return bounds;
+}
+
+static void build_light_bvh_node(std::vector<LightBVHNode> &nodes,
+                                 std::span<LightTriangle> lights,
+                                 std::span<const LightBVHNode> light_bounds,
+                                 u32 node_index, std::span<u32> light_ids,
+                                 u32 depth, u32 trail) {
+  const u32 count = static_cast<u32>(light_ids.size());
+  if (count == 1) {
+    const u32 light = light_ids[0];
+    nodes[node_index] = light_bounds[light];
+    nodes[node_index].left_or_light = light;
+    nodes[node_index].is_leaf = 1;
+    lights[light].bvh_trail = trail;
+    return;
+  }
+
+  glm::vec3 centroid_min(infinity);
+  glm::vec3 centroid_max(-infinity);
+  for (const u32 id : light_ids) {
+    const glm::vec3 centroid =
+        0.5f * (light_bounds[id].aabb_min + light_bounds[id].aabb_max);
+    centroid_min = glm::min(centroid_min, centroid);
+    centroid_max = glm::max(centroid_max, centroid);
+  }
+  const glm::vec3 extent = centroid_max - centroid_min;
+  u32 axis = 0;
+  if (extent.y > extent[axis])
+    axis = 1;
+  if (extent.z > extent[axis])
+    axis = 2;
+  const auto get_centroid = [&](u32 id) {
+    return 0.5f * (light_bounds[id].aabb_min[axis] +
+                   light_bounds[id].aabb_max[axis]);
+  };
+
+  // Heuristic splits can be unbalanced, once the trail bits left could run out
+  // the median keeps the depth logarithmic
+  size_t split = 0;
+  if (extent[axis] > 0.f && depth + 1 + std::bit_width(count - 1) <= 32) {
+    const f32 scale = LIGHT_BVH_BIN_COUNT / extent[axis];
+    const auto get_bin = [&](u32 id) {
+      return std::min(
+          static_cast<u32>((get_centroid(id) - centroid_min[axis]) * scale),
+          LIGHT_BVH_BIN_COUNT - 1);
+    };
+    std::array<LightBVHNode, LIGHT_BVH_BIN_COUNT> bins{};
+    std::array<u32, LIGHT_BVH_BIN_COUNT> bin_counts{};
+    for (const u32 id : light_ids) {
+      const u32 bin = get_bin(id);
+      bins[bin] = union_light_bounds(bins[bin], light_bounds[id]);
+      ++bin_counts[bin];
+    }
+
+    // Costs of the left sides, then of the right sides swept backwards
+    std::array<f32, LIGHT_BVH_BIN_COUNT - 1> left_costs{};
+    std::array<u32, LIGHT_BVH_BIN_COUNT - 1> left_counts{};
+    LightBVHNode side{};
+    u32 side_count = 0;
+    for (u32 i = 0; i < LIGHT_BVH_BIN_COUNT - 1; ++i) {
+      side = union_light_bounds(side, bins[i]);
+      side_count += bin_counts[i];
+      left_costs[i] = get_orientation_cost(side);
+      left_counts[i] = side_count;
+    }
+    side = {};
+    side_count = 0;
+    f32 best_cost = infinity;
+    u32 best_bin = UINT32_MAX;
+    for (u32 i = LIGHT_BVH_BIN_COUNT - 1; i > 0; --i) {
+      side = union_light_bounds(side, bins[i]);
+      side_count += bin_counts[i];
+      if (left_counts[i - 1] == 0 || side_count == 0)
+        continue;
+      const f32 cost = left_costs[i - 1] + get_orientation_cost(side);
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_bin = i - 1;
+      }
+    }
+    if (best_bin != UINT32_MAX)
+      split = std::partition(light_ids.begin(), light_ids.end(),
+                             [&](u32 id) { return get_bin(id) <= best_bin; }) -
+              light_ids.begin();
+  }
+  if (split == 0 || split == count) {
+    split = count / 2;
+    std::nth_element(
+        light_ids.begin(), light_ids.begin() + split, light_ids.end(),
+        [&](u32 a, u32 b) { return get_centroid(a) < get_centroid(b); });
+  }
+
+  // Children follow their parent, a reverse sweep visits them first
+  const u32 left = static_cast<u32>(nodes.size());
+  nodes.resize(left + 2);
+  build_light_bvh_node(nodes, lights, light_bounds, left,
+                       light_ids.first(split), depth + 1, trail);
+  build_light_bvh_node(nodes, lights, light_bounds, left + 1,
+                       light_ids.subspan(split), depth + 1,
+                       trail | (1u << depth));
+  nodes[node_index] = union_light_bounds(nodes[left], nodes[left + 1]);
+  nodes[node_index].left_or_light = left;
+  nodes[node_index].is_leaf = 0;
+}
+
+void build_light_bvh(std::vector<LightBVHNode> &nodes,
+                     std::span<LightTriangle> lights,
+                     std::span<const LightBVHNode> light_bounds) {
+  HASSERT(lights.size() == light_bounds.size());
+  nodes.clear();
+  if (lights.empty())
+    return;
+  nodes.reserve(2 * lights.size() - 1);
+  nodes.resize(1);
+  std::vector<u32> light_ids(lights.size());
+  std::iota(light_ids.begin(), light_ids.end(), 0u);
+  build_light_bvh_node(nodes, lights, light_bounds, 0, light_ids, 0, 0);
+}
+
+void refit_light_bvh(std::span<LightBVHNode> nodes,
+                     std::span<const LightBVHNode> light_bounds) {
+  for (size_t i = nodes.size(); i-- > 0;) {
+    const u32 left_or_light = nodes[i].left_or_light;
+    const u32 is_leaf = nodes[i].is_leaf;
+    nodes[i] = is_leaf ? light_bounds[left_or_light]
+                       : union_light_bounds(nodes[left_or_light],
+                                            nodes[left_or_light + 1]);
+    nodes[i].left_or_light = left_or_light;
+    nodes[i].is_leaf = is_leaf;
+  }
+}
+} // namespace hlx
@@ -0,0 +1,62 @@
+#pragma once
+// Vendor
+#include <glm/vec3.hpp>
+
+namespace hlx {
+constexpr u32 INVALID_LIGHT = UINT32_MAX;
+
+// An emissive triangle of a blas instance with its alias table entry, see
+// LightList.slang
+struct LightTriangle {
+  u32 blas_instance_id;
+  u32 triangle_index;
+  // Probability of sampling the triangle
+  f32 pdf;
+  // The sampled slot keeps itself with alias_probability, else takes alias
+  f32 alias_probability;
+  u32 alias;
+  // Path from the light BVH root to the triangle's leaf, bit i is set if the
+  // right child is taken at depth i
+  u32 bvh_trail;
+};
+
+// Bounds of the lights below a node, see "Importance Sampling of Many Lights
+// with Adaptive Tree Splitting", Conty and Kulla 2018. Emission leaves within
+// cos_theta_e of a direction inside the cone of normals around axis. Leaves
+// hold a single light
+struct alignas(16) LightBVHNode {
+  glm::vec3 aabb_min;
+  // Left child of an interior node, the right one follows it. The light of a
+  // leaf
+  u32 left_or_light;
+  glm::vec3 aabb_max;
+  u32 is_leaf;
+  glm::vec3 axis;
+  f32 cos_theta_o;
+  f32 cos_theta_e;
+  f32 power;
+  // Emits on both sides of the cone
+  u32 two_sided;
+  u32 padding;
+};
+
+// Fills the pdf and alias entries so that a slot picked uniformly, then kept
+// or replaced by its alias, samples each light proportionally to its weight.
+// Vose's method, the weights sum must be positive
+void build_alias_table(std::span<LightTriangle> lights,
+                       std::span<const f32> weights);
+
+// Bounds of a two sided emissive triangle in world space
+LightBVHNode get_triangle_light_bounds(const glm::vec3 &v0,
+                                       const glm::vec3 &v1,
+                                       const glm::vec3 &v2, f32 power);
+
+// Binned surface area orientation heuristic splits, median splits where the
+// trail could overflow 32 bits. Sets the lights' bvh_trail
+void build_light_bvh(std::vector<LightBVHNode> &nodes,
+                     std::span<LightTriangle> lights,
+                     std::span<const LightBVHNode> light_bounds);
+// Refits the nodes of a tree built over the same lights to their new bounds
+void refit_light_bvh(std::span<LightBVHNode> nodes,
+                     std::span<const LightBVHNode> light_bounds);
+} // namespace hlx
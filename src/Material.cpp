@@ -1,13 +1,34 @@
 #include "Material.hpp"
+#include "Core/Assert.hpp"
+#include "Core/Clock.hpp"
+#include "Core/MurmurHash.h"
+#include "TextureAtlas.hpp"
 #include "Vulkan/VkDeviceManager.h"
 #include "Vulkan/VkResourceManager.hpp"
 #include "Vulkan/VkStagingBuffer.h"
 // Vendor
 #include <algorithm>
+#include <cstring>
 #include <glm/vec3.hpp>
 
+// Textures are loaded up to the first level no larger than this, and are never
+// evicted below it
+static constexpr u32 RESIDENT_MIN_TEXTURE_SIZE = 64;
+// Residency changes uploading at once
+static constexpr u32 MAX_RESIDENCY_UPLOADS = 4;
+// Frames a texture goes unsampled before its levels are evicted to make room
+// for textures that are sampled
+static constexpr u64 RESIDENCY_STALE_FRAMES = 120;
+
 namespace hlx {
 
+// Device memory of a texture's image holding the levels from level on
+static size_t get_level_bytes(const EncodedTexture &encoded, u32 level) {
+  if (level >= encoded.level_count)
+    return 0;
+  return encoded.data.size() - encoded.level_offsets[level];
+}
+
 void MaterialManager::init(u32 max_material_count, u32 sizeof_material,
                            std::string_view buffer_name,
                            VkResourceManager *p_rm) {
@@ -22,7 +43,7 @@ void MaterialManager::init(u32 max_material_count, u32 sizeof_material,
   buffer_info.usage = VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |
                       VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
                       VK_BUFFER_USAGE_TRANSFER_DST_BIT;
-  buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  p_rm->p_device->set_upload_sharing(buffer_info);
   buffer_info.size = max_material_count * sizeof_material;
   buffer = p_rm->create_buffer(buffer_name, buffer_info, vma_alloc_info);
 }
@@ -46,19 +67,51 @@ bool MaterialManager::remove_material(const MaterialHandle &material_handle) {
 
 //
 // LambertManager //////////////////////////////////////////////////////////
-void LambertManager::init(u32 max_material_count, VkResourceManager *p_rm) {
+void LambertManager::init(u32 max_material_count, u32 max_texture_count,
+                          VkResourceManager *p_rm) {
   VkDeviceManager *p_device = p_rm->p_device;
   MaterialManager::init(max_material_count, sizeof(Lambert),
                         "LambertMaterialsBuffer", p_rm);
   materials.resize(max_material_count);
-  lambert_textures.resize(max_material_count);
-  image_infos.reserve(max_material_count);
-  write_infos.reserve(max_material_count);
+
+  // The binding is as large as the device allows, the set is allocated with
+  // two descriptors per texture, see TextureResidency::descriptor_parity
+  VkPhysicalDeviceVulkan12Properties properties_12{
+      VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_PROPERTIES};
+  VkPhysicalDeviceProperties2 properties2{
+      VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2};
+  properties2.pNext = &properties_12;
+  vkGetPhysicalDeviceProperties2(p_device->vk_physical_device, &properties2);
+  // The renderer's set 0 holds the output and denoised storage images
+  constexpr u32 other_stage_resource_count = 2;
+  const u32 max_descriptor_count = std::min(
+      {properties_12.maxPerStageDescriptorUpdateAfterBindSamplers,
+       properties_12.maxPerStageDescriptorUpdateAfterBindSampledImages,
+       properties_12.maxDescriptorSetUpdateAfterBindSamplers,
+       properties_12.maxDescriptorSetUpdateAfterBindSampledImages,
+       properties_12.maxPerStageUpdateAfterBindResources -
+           other_stage_resource_count});
+  if (max_texture_count * 2 > max_descriptor_count) {
+    HWARN("LambertManager - {} textures requested, the device allows {}",
+          max_texture_count, max_descriptor_count / 2);
+    max_texture_count = max_descriptor_count / 2;
+  }
+  descriptor_count = max_texture_count * 2;
+  lambert_textures.resize(max_texture_count);
+  texture_reference_counts.resize(max_texture_count, 0);
+  texture_index_pool.init(max_texture_count);
+  texture_residency.resize(max_texture_count);
+  image_infos.reserve(max_texture_count);
+  write_infos.reserve(max_texture_count);
+  if (!p_device->texture_compression_bc) {
+    HWARN("LambertManager - BC formats are not supported, textures are RGBA8");
+    texture_encoding = TextureEncoding::RGBA8;
+  }
 
   // Create Descriptor Pool
   const VkDescriptorPoolSize bindless_pool_size = {
       .type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-      .descriptorCount = max_material_count};
+      .descriptorCount = descriptor_count};
   VkDescriptorPoolCreateInfo descriptor_pool_info{
       VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO};
   descriptor_pool_info.maxSets = 1;
@@ -75,12 +128,16 @@ void LambertManager::init(u32 max_material_count, VkResourceManager *p_rm) {
   VkDescriptorSetLayoutBinding bindless_layout_binding = {
       .binding = 0,
       .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-      .descriptorCount = max_material_count,
+      .descriptorCount = descriptor_count,
       .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT};
 
+  // Descriptors are written while frames are in flight, only those the
+  // frames read must be valid
   VkDescriptorBindingFlags layout_flags =
       VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT |
-      VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT;
+      VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT |
+      VK_DESCRIPTOR_BINDING_UPDATE_UNUSED_WHILE_PENDING_BIT |
+      VK_DESCRIPTOR_BINDING_VARIABLE_DESCRIPTOR_COUNT_BIT;
 
   VkDescriptorSetLayoutBindingFlagsCreateInfo flags_info{
       VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO};
@@ -102,8 +159,13 @@ void LambertManager::init(u32 max_material_count, VkResourceManager *p_rm) {
       "LambertMaterialsSetLayout");
 
   // Allocate the bindless set
+  VkDescriptorSetVariableDescriptorCountAllocateInfo variable_count_info{
+      VK_STRUCTURE_TYPE_DESCRIPTOR_SET_VARIABLE_DESCRIPTOR_COUNT_ALLOCATE_INFO};
+  variable_count_info.descriptorSetCount = 1;
+  variable_count_info.pDescriptorCounts = &descriptor_count;
   VkDescriptorSetAllocateInfo bindless_set_alloc_info{
       .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+      .pNext = &variable_count_info,
       .descriptorPool = vk_descriptor_pool,
       .descriptorSetCount = 1,
       .pSetLayouts = &vk_descriptor_set_layout};
@@ -115,8 +177,8 @@ void LambertManager::init(u32 max_material_count, VkResourceManager *p_rm) {
   // Create sampler
   VkSamplerCreateInfo sampler_info{VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO};
   sampler_info.magFilter = VK_FILTER_NEAREST;
-  sampler_info.minFilter = VK_FILTER_NEAREST;
-  sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+  sampler_info.minFilter = VK_FILTER_LINEAR;
+  sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
   sampler_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
   sampler_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
   sampler_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
@@ -127,6 +189,33 @@ void LambertManager::init(u32 max_material_count, VkResourceManager *p_rm) {
   sampler_info.borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE;
   sampler_info.unnormalizedCoordinates = VK_FALSE;
   texture_sampler = p_rm->create_sampler("TextureSampler", sampler_info);
+
+  // Create the texture feedback buffer, written by the shaders and copied
+  // into a per frame readback buffer
+  feedback_data.assign(max_texture_count, TextureFeedback{0, UINT32_MAX});
+  VmaAllocationCreateInfo vma_alloc_info{};
+  vma_alloc_info.requiredFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+  VkBufferCreateInfo buffer_info{VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
+  buffer_info.usage = VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |
+                      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                      VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+                      VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+  buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  buffer_info.size = max_texture_count * sizeof(TextureFeedback);
+  feedback_buffer = p_rm->create_buffer("TextureFeedbackBuffer", buffer_info,
+                                        vma_alloc_info);
+
+  vma_alloc_info.requiredFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+  vma_alloc_info.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
+  buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+  for (u32 i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+    feedback_readback_buffers[i] = p_rm->create_buffer(
+        "TextureFeedbackReadbackBuffer_" + std::to_string(i), buffer_info,
+        vma_alloc_info);
+    std::memcpy(p_rm->access_buffer(feedback_readback_buffers[i])->p_data,
+                feedback_data.data(), buffer_info.size);
+  }
 }
 
 void LambertManager::shutdown(VkResourceManager *p_rm) {
@@ -135,8 +224,19 @@ void LambertManager::shutdown(VkResourceManager *p_rm) {
   p_rm->queue_destroy({texture_sampler});
 
   // Destroy remaining textures
-  for (u32 index : material_indices) {
-    p_rm->queue_destroy({.handle = lambert_textures[index]});
+  pending_texture_releases.clear();
+  texture_index_pool.release_all();
+  for (u32 texture_index : texture_indices) {
+    const TextureResidency &residency = texture_residency[texture_index];
+    if (residency.resident_level < residency.encoded->level_count)
+      p_rm->queue_destroy({.handle = lambert_textures[texture_index]});
+    if (residency.pending_level != residency.resident_level)
+      p_rm->queue_destroy({.handle = residency.pending_texture});
+  }
+  texture_index_pool.shutdown();
+  p_rm->queue_destroy({feedback_buffer});
+  for (const BufferHandle &readback_buffer : feedback_readback_buffers) {
+    p_rm->queue_destroy({readback_buffer});
   }
   vkDestroyDescriptorSetLayout(p_rm->p_device->vk_device,
                                vk_descriptor_set_layout, nullptr);
@@ -145,9 +245,31 @@ void LambertManager::shutdown(VkResourceManager *p_rm) {
   MaterialManager::shutdown(p_rm);
 }
 
-void LambertManager::update(VkDeviceManager *p_device) {
+void LambertManager::update(VkStagingBuffer &staging_buffer,
+                            VkResourceManager *p_rm) {
+  // Indices of removed textures are reused once no frame in flight can read
+  // their descriptors
+  const u64 frame_count = p_rm->p_device->frame_count;
+  std::erase_if(pending_texture_releases,
+                [&](const PendingTextureRelease &entry) {
+                  if (frame_count - entry.frame_index <= MAX_FRAMES_IN_FLIGHT)
+                    return false;
+                  texture_index_pool.release(entry.texture_index);
+                  return true;
+                });
+  std::erase_if(retired_texture_images,
+                [&](const RetiredTextureImage &entry) {
+                  if (frame_count - entry.frame_index <= MAX_FRAMES_IN_FLIGHT)
+                    return false;
+                  texture_bytes -= entry.bytes;
+                  retired_texture_bytes -= entry.bytes;
+                  return true;
+                });
+  read_texture_feedback(p_rm);
+  update_residency(staging_buffer, p_rm);
+  write_texture_feedback(p_rm);
   if (update_descriptor) {
-    vkUpdateDescriptorSets(p_device->vk_device, write_infos.size(),
+    vkUpdateDescriptorSets(p_rm->p_device->vk_device, write_infos.size(),
                            write_infos.data(), 0, nullptr);
     image_infos.clear();
     write_infos.clear();
@@ -155,19 +277,430 @@ void LambertManager::update(VkDeviceManager *p_device) {
   }
 }
 
+size_t LambertManager::get_texture_budget(VkDeviceManager *p_device) const {
+  // Largest device local heap
+  const VkPhysicalDeviceMemoryProperties *p_memory_properties = nullptr;
+  vmaGetMemoryProperties(p_device->vma_allocator, &p_memory_properties);
+  u32 heap_index = 0;
+  VkDeviceSize heap_size = 0;
+  for (u32 i = 0; i < p_memory_properties->memoryHeapCount; ++i) {
+    const VkMemoryHeap &heap = p_memory_properties->memoryHeaps[i];
+    if ((heap.flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) &&
+        heap.size > heap_size) {
+      heap_index = i;
+      heap_size = heap.size;
+    }
+  }
+  VmaBudget budgets[VK_MAX_MEMORY_HEAPS];
+  vmaGetHeapBudgets(p_device->vma_allocator, budgets);
+  const VmaBudget &budget = budgets[heap_index];
+
+  // The heap's usage includes the textures themselves
+  const size_t other_usage =
+      budget.usage - std::min<size_t>(budget.usage, texture_bytes);
+  const size_t room =
+      budget.budget - std::min<size_t>(budget.budget, other_usage);
+  return std::min(texture_budget, room);
+}
+
+void LambertManager::read_texture_feedback(VkResourceManager *p_rm) {
+  // The frame's fence has been waited on, so the copy of the frame's last
+  // feedback is complete
+  const u64 frame_count = p_rm->p_device->frame_count;
+  const TextureFeedback *p_feedback = static_cast<const TextureFeedback *>(
+      p_rm->access_buffer(
+              feedback_readback_buffers[p_rm->p_device->current_frame])
+          ->p_data);
+  for (u32 texture_index : texture_indices) {
+    const u32 requested_level = p_feedback[texture_index].requested_level;
+    if (requested_level == UINT32_MAX)
+      continue;
+    TextureResidency &residency = texture_residency[texture_index];
+    residency.requested_level = requested_level;
+    residency.last_used_frame = frame_count;
+  }
+}
+
+void LambertManager::write_texture_feedback(VkResourceManager *p_rm) {
+  for (u32 texture_index : texture_indices) {
+    feedback_data[texture_index].resident_level =
+        texture_residency[texture_index].resident_level;
+  }
+
+  // The last frame's dispatches wrote the feedback and its readback copy
+  // read it
+  VkCommandBuffer cmd = p_rm->p_device->get_current_cmd_buffer();
+  VkMemoryBarrier2 barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER_2};
+  barrier.srcStageMask =
+      VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_2_COPY_BIT;
+  barrier.srcAccessMask = VK_ACCESS_2_SHADER_WRITE_BIT;
+  barrier.dstStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+  barrier.dstAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+  VkDependencyInfo dependency_info{VK_STRUCTURE_TYPE_DEPENDENCY_INFO};
+  dependency_info.memoryBarrierCount = 1;
+  dependency_info.pMemoryBarriers = &barrier;
+  vkCmdPipelineBarrier2(cmd, &dependency_info);
+
+  // vkCmdUpdateBuffer is limited to 65536 bytes
+  constexpr u32 max_update_count = 65536 / sizeof(TextureFeedback);
+  const VkBuffer vk_feedback_buffer =
+      p_rm->access_buffer(feedback_buffer)->vk_handle;
+  for (u32 first = 0; first < feedback_data.size();
+       first += max_update_count) {
+    const u32 count = std::min<u32>(feedback_data.size() - first,
+                                    max_update_count);
+    vkCmdUpdateBuffer(cmd, vk_feedback_buffer,
+                      first * sizeof(TextureFeedback),
+                      count * sizeof(TextureFeedback),
+                      feedback_data.data() + first);
+  }
+
+  barrier.srcStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+  barrier.srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+  barrier.dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+  barrier.dstAccessMask =
+      VK_ACCESS_2_SHADER_READ_BIT | VK_ACCESS_2_SHADER_WRITE_BIT;
+  vkCmdPipelineBarrier2(cmd, &dependency_info);
+}
+
+void LambertManager::record_feedback_readback(VkCommandBuffer cmd,
+                                              VkResourceManager *p_rm) {
+  VkMemoryBarrier2 barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER_2};
+  barrier.srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+  barrier.srcAccessMask = VK_ACCESS_2_SHADER_WRITE_BIT;
+  barrier.dstStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+  barrier.dstAccessMask = VK_ACCESS_2_TRANSFER_READ_BIT;
+  VkDependencyInfo dependency_info{VK_STRUCTURE_TYPE_DEPENDENCY_INFO};
+  dependency_info.memoryBarrierCount = 1;
+  dependency_info.pMemoryBarriers = &barrier;
+  vkCmdPipelineBarrier2(cmd, &dependency_info);
+
+  const VkBufferCopy region{
+      .size = feedback_data.size() * sizeof(TextureFeedback)};
+  vkCmdCopyBuffer(
+      cmd, p_rm->access_buffer(feedback_buffer)->vk_handle,
+      p_rm->access_buffer(
+              feedback_readback_buffers[p_rm->p_device->current_frame])
+          ->vk_handle,
+      1, &region);
+
+  // Read on the cpu once the frame's fence signals
+  barrier.srcStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+  barrier.srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+  barrier.dstStageMask = VK_PIPELINE_STAGE_2_HOST_BIT;
+  barrier.dstAccessMask = VK_ACCESS_2_HOST_READ_BIT;
+  vkCmdPipelineBarrier2(cmd, &dependency_info);
+}
+
+void LambertManager::update_residency(VkStagingBuffer &staging_buffer,
+                                      VkResourceManager *p_rm) {
+  const u64 frame_count = p_rm->p_device->frame_count;
+  const size_t budget = get_texture_budget(p_rm->p_device);
+  if (texture_bytes > budget) {
+    evict_texture_levels(budget, UINT64_MAX, staging_buffer, p_rm);
+    return;
+  }
+
+  // Load one finer level of the textures sampled finer than resident, most
+  // recently used first
+  std::vector<u32> candidates;
+  u32 upload_count = 0;
+  for (u32 texture_index : texture_indices) {
+    const TextureResidency &residency = texture_residency[texture_index];
+    if (residency.pending_level != residency.resident_level)
+      ++upload_count;
+    else if (residency.requested_level < residency.resident_level &&
+             can_change_residency(texture_index, frame_count))
+      candidates.push_back(texture_index);
+  }
+  std::sort(candidates.begin(), candidates.end(), [this](u32 a, u32 b) {
+    return texture_residency[a].last_used_frame >
+           texture_residency[b].last_used_frame;
+  });
+  for (u32 texture_index : candidates) {
+    if (upload_count >= MAX_RESIDENCY_UPLOADS)
+      break;
+    const TextureResidency &residency = texture_residency[texture_index];
+    // The resident image stays alive next to the new one until the swap
+    const u32 level = residency.resident_level - 1;
+    const size_t cost = get_level_bytes(*residency.encoded, level);
+    if (texture_bytes + cost > budget) {
+      // Make room from the textures that are no longer sampled
+      if (frame_count > RESIDENCY_STALE_FRAMES) {
+        evict_texture_levels(budget - std::min(budget, cost),
+                             frame_count - RESIDENCY_STALE_FRAMES,
+                             staging_buffer, p_rm);
+      }
+      break;
+    }
+    change_residency(texture_index, level, staging_buffer, p_rm);
+    ++upload_count;
+  }
+}
+
+void LambertManager::evict_texture_levels(size_t target_bytes,
+                                          u64 used_before_frame,
+                                          VkStagingBuffer &staging_buffer,
+                                          VkResourceManager *p_rm) {
+  const u64 frame_count = p_rm->p_device->frame_count;
+  std::vector<u32> candidates;
+  for (u32 texture_index : texture_indices) {
+    const TextureResidency &residency = texture_residency[texture_index];
+    if (residency.resident_level < residency.min_resident_level &&
+        residency.last_used_frame < used_before_frame &&
+        can_change_residency(texture_index, frame_count))
+      candidates.push_back(texture_index);
+  }
+  std::sort(candidates.begin(), candidates.end(), [this](u32 a, u32 b) {
+    return texture_residency[a].last_used_frame <
+           texture_residency[b].last_used_frame;
+  });
+  // The replaced images still count until they are destroyed
+  size_t bytes = texture_bytes - retired_texture_bytes;
+  for (u32 texture_index : candidates) {
+    if (bytes <= target_bytes)
+      break;
+    const TextureResidency &residency = texture_residency[texture_index];
+    bytes -= get_level_bytes(*residency.encoded, residency.resident_level) -
+             get_level_bytes(*residency.encoded, residency.resident_level + 1);
+    change_residency(texture_index, residency.resident_level + 1,
+                     staging_buffer, p_rm);
+  }
+}
+
+u64 LambertManager::hash_material(const Lambert &material) {
+  return GenerateHash(&material, sizeof(Lambert)).A;
+}
+
 MaterialHandle LambertManager::add_material(VkStagingBuffer &staging_buffer,
-                                            VkResourceManager *p_rm, i32 width,
-                                            i32 height, u8 *pixels) {
+                                            const glm::vec3 &albedo,
+                                            u32 texture_index) {
+  return add_material(staging_buffer, albedo,
+                      {.texture_index = texture_index,
+                       .uv_scale_offset = {1.f, 1.f, 0.f, 0.f}});
+}
+
+MaterialHandle
+LambertManager::add_material(VkStagingBuffer &staging_buffer,
+                             const glm::vec3 &albedo,
+                             const LambertTextureRegion &region) {
+  Lambert material{.albedo = {albedo.x, albedo.y, albedo.z},
+                   .texture_index = region.texture_index};
+  std::copy(region.uv_scale_offset, region.uv_scale_offset + 4,
+            material.uv_scale_offset);
+  const u64 hash = hash_material(material);
+  const auto it = interned_materials.find(hash);
+  if (it != interned_materials.end() &&
+      std::memcmp(&materials[it->second], &material, sizeof(Lambert)) == 0) {
+    return MaterialHandle(it->second, MaterialType::LAMBERT);
+  }
+
   u32 index = index_pool.obtain_new();
-  // Create Image
+  materials[index] = material;
+  material_indices.insert(index);
+  // A colliding hash keeps its first material
+  interned_materials.try_emplace(hash, index);
+  if (region.texture_index != INVALID_TEXTURE_INDEX) {
+    HASSERT(texture_indices.contains(region.texture_index));
+    ++texture_reference_counts[region.texture_index];
+  }
+  stage_material(staging_buffer, index);
+  return MaterialHandle(index, MaterialType::LAMBERT);
+}
+
+std::vector<LambertTextureRegion>
+LambertManager::add_textures(VkStagingBuffer &staging_buffer,
+                             VkResourceManager *p_rm,
+                             std::span<const LambertTextureSource> sources) {
+  std::vector<LambertTextureRegion> regions(sources.size());
+  TextureAtlasBuilder atlas;
+  std::vector<u32> atlas_entries(sources.size(), UINT32_MAX);
+  u32 texture_count = 0;
+  for (size_t i = 0; i < sources.size(); ++i) {
+    const LambertTextureSource &source = sources[i];
+    if (atlas_enabled &&
+        static_cast<u32>(source.width) <= ATLAS_MAX_TEXTURE_SIZE &&
+        static_cast<u32>(source.height) <= ATLAS_MAX_TEXTURE_SIZE) {
+      atlas_entries[i] = atlas.add(source.pixels, source.width, source.height);
+      continue;
+    }
+    regions[i] = {.texture_index = add_texture(staging_buffer, p_rm,
+                                               source.width, source.height,
+                                               source.pixels),
+                  .uv_scale_offset = {1.f, 1.f, 0.f, 0.f}};
+    ++texture_count;
+  }
+  if (texture_count == sources.size())
+    return regions;
+
+  atlas.build();
+  std::vector<u32> page_texture_indices(atlas.pages.size());
+  for (size_t i = 0; i < atlas.pages.size(); ++i) {
+    const AtlasPage &page = atlas.pages[i];
+    page_texture_indices[i] =
+        add_texture(staging_buffer, p_rm, page.width, page.height,
+                    page.pixels.data(), ATLAS_LEVEL_COUNT);
+  }
+  for (size_t i = 0; i < sources.size(); ++i) {
+    if (atlas_entries[i] == UINT32_MAX)
+      continue;
+    const AtlasEntry &entry = atlas.entries[atlas_entries[i]];
+    regions[i].texture_index = page_texture_indices[entry.page];
+    std::copy(entry.uv_scale_offset, entry.uv_scale_offset + 4,
+              regions[i].uv_scale_offset);
+  }
+  HINFO("LambertManager - {} textures use {} descriptors, {} of them packed "
+        "into {} atlas pages",
+        sources.size(), 2 * (texture_count + atlas.pages.size()),
+        sources.size() - texture_count, atlas.pages.size());
+  return regions;
+}
+
+u32 LambertManager::add_texture(VkStagingBuffer &staging_buffer,
+                                VkResourceManager *p_rm, i32 width, i32 height,
+                                const u8 *pixels, u32 max_level_count) {
+  u32 texture_index = texture_index_pool.obtain_new();
+  // Encode the texels, kept as the source of the texture's residency changes
+  const TextureEncoding encoding = width < 4 || height < 4
+                                       ? TextureEncoding::RGBA8
+                                       : texture_encoding;
+  const u32 level_count =
+      generate_mips ? std::min(get_mip_level_count(width, height),
+                               max_level_count)
+                    : 1;
+  TextureResidency &residency = texture_residency[texture_index];
+  residency = {};
+  Clock encode_clock;
+  encode_clock.start();
+  residency.encoded = std::make_shared<const EncodedTexture>(
+      encode_texture(pixels, width, height, encoding, level_count));
+  HINFO("LambertManager - Encoded a {}x{} texture with {} levels in {:.1f} ms, "
+        "{} bytes ({} as RGBA8)",
+        width, height, level_count, encode_clock.get_elapsed_time_ms(),
+        residency.encoded->data.size(),
+        static_cast<size_t>(width) * height * 4);
+  while (residency.min_resident_level + 1 < level_count &&
+         static_cast<u32>(std::max(width, height)) >>
+                 residency.min_resident_level >
+             RESIDENT_MIN_TEXTURE_SIZE) {
+    ++residency.min_resident_level;
+  }
+  residency.resident_level = level_count;
+  residency.pending_level = level_count;
+
+  texture_reference_counts[texture_index] = 0;
+  texture_indices.insert(texture_index);
+  texture_bytes_rgba8 += static_cast<size_t>(width) * height * 4;
+  change_residency(texture_index, residency.min_resident_level,
+                   staging_buffer, p_rm);
+  return texture_index;
+}
+
+void LambertManager::stage_material(VkStagingBuffer &staging_buffer,
+                                    u32 index) {
+  Lambert material = materials[index];
+  if (material.texture_index != INVALID_TEXTURE_INDEX) {
+    const TextureResidency &residency =
+        texture_residency[material.texture_index];
+    material.texture_index =
+        residency.resident_level < residency.encoded->level_count
+            ? material.texture_index * 2 + residency.descriptor_parity
+            : INVALID_TEXTURE_INDEX;
+  }
+  // Stage buffer change
+  staging_buffer.stage(&material, buffer, index * sizeof(Lambert),
+                       sizeof(Lambert));
+}
+
+void LambertManager::write_texture_descriptor(u32 texture_index,
+                                              VkResourceManager *p_rm) {
+  const TextureResidency &residency = texture_residency[texture_index];
+  // Descriptor update write
+  const VkDescriptorImageInfo descriptor_image_info{
+      .sampler = p_rm->access_sampler(texture_sampler)->vk_handle,
+      .imageView =
+          p_rm->access_image_view(lambert_textures[texture_index])->vk_handle,
+      .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL};
+  image_infos.push_back(descriptor_image_info);
+
+  const VkWriteDescriptorSet image_write = {
+      .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+      .dstSet = vk_descriptor_set,
+      .dstBinding = 0,
+      .dstArrayElement = texture_index * 2 + residency.descriptor_parity,
+      .descriptorCount = 1,
+      .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+      .pImageInfo = &image_infos[image_infos.size() - 1]};
+  write_infos.push_back(image_write);
+  update_descriptor = true;
+}
+
+void LambertManager::remove_material(const MaterialHandle &material_handle,
+                                     VkStagingBuffer &staging_buffer,
+                                     VkResourceManager *p_rm) {
+  if (MaterialManager::remove_material(material_handle)) {
+    const Lambert &material = materials[material_handle.index];
+    const auto it = interned_materials.find(hash_material(material));
+    if (it != interned_materials.end() &&
+        it->second == material_handle.index) {
+      interned_materials.erase(it);
+    }
+
+    const u32 texture_index = material.texture_index;
+    if (texture_index != INVALID_TEXTURE_INDEX &&
+        --texture_reference_counts[texture_index] == 0) {
+      remove_texture(texture_index, staging_buffer, p_rm);
+    }
+  }
+}
+
+void LambertManager::remove_texture(u32 texture_index,
+                                    VkStagingBuffer &staging_buffer,
+                                    VkResourceManager *p_rm) {
+  TextureResidency &residency = texture_residency[texture_index];
+  const EncodedTexture &encoded = *residency.encoded;
+  const u64 frame_count = p_rm->p_device->frame_count;
+  if (residency.stream_id) {
+    staging_buffer.cancel_stream(residency.stream_id);
+    residency.stream_id = 0;
+  }
+  if (residency.pending_level != residency.resident_level) {
+    p_rm->queue_destroy(
+        {.handle = residency.pending_texture, .frame_index = frame_count});
+  }
+  if (residency.resident_level < encoded.level_count) {
+    p_rm->queue_destroy({.handle = lambert_textures[texture_index],
+                         .frame_index = frame_count});
+  }
+  size_t bytes = get_level_bytes(encoded, residency.resident_level);
+  if (residency.pending_level != residency.resident_level)
+    bytes += get_level_bytes(encoded, residency.pending_level);
+  retire_texture_bytes(bytes, frame_count);
+  texture_bytes_rgba8 -=
+      static_cast<size_t>(encoded.width) * encoded.height * 4;
+  residency = {};
+  texture_indices.erase(texture_index);
+  pending_texture_releases.push_back(
+      {.texture_index = texture_index, .frame_index = frame_count});
+}
+
+void LambertManager::change_residency(u32 texture_index, u32 level,
+                                      VkStagingBuffer &staging_buffer,
+                                      VkResourceManager *p_rm) {
+  TextureResidency &residency = texture_residency[texture_index];
+  const EncodedTexture &encoded = *residency.encoded;
+  HASSERT(level < encoded.level_count &&
+          residency.pending_level == residency.resident_level);
+
+  // Create Image holding the levels from level on
   VkImageCreateInfo image_info{VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO};
   image_info.imageType = VK_IMAGE_TYPE_2D;
-  image_info.extent.width = width;
-  image_info.extent.height = height;
+  image_info.extent.width = std::max(encoded.width >> level, 1u);
+  image_info.extent.height = std::max(encoded.height >> level, 1u);
   image_info.extent.depth = 1;
-  image_info.mipLevels = 1;
+  image_info.mipLevels = encoded.level_count - level;
   image_info.arrayLayers = 1;
-  image_info.format = VK_FORMAT_R8G8B8A8_UNORM;
+  image_info.format = encoded.format;
   image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
   image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
   image_info.usage =
@@ -187,43 +720,81 @@ MaterialHandle LambertManager::add_material(VkStagingBuffer &staging_buffer,
   view_info.subresourceRange.baseArrayLayer = 0;
   view_info.subresourceRange.layerCount = 1;
 
-  std::string name = "Lambert " + std::to_string(index) + "Image";
+  std::string name = "Lambert " + std::to_string(texture_index) + " Level " +
+                     std::to_string(level) + " Image";
   std::string view_name = name + "View";
-  lambert_textures[index] = p_rm->create_image_view(view_name, name, image_info,
-                                                    vma_alloc_info, view_info);
-  materials[index] = {index};
-  material_indices.insert(index);
-  // Stage pixel data
-  staging_buffer.stage(pixels, lambert_textures[index],
-                       image_info.extent.width * image_info.extent.height * 4);
-  // Stage buffer change
-  staging_buffer.stage(&materials[index], buffer, index * sizeof(Lambert),
-                       sizeof(Lambert));
-  // Descriptor update write
-  const VkDescriptorImageInfo descriptor_image_info{
-      .sampler = p_rm->access_sampler(texture_sampler)->vk_handle,
-      .imageView = p_rm->access_image_view(lambert_textures[index])->vk_handle,
-      .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL};
-  image_infos.push_back(descriptor_image_info);
+  const ImageViewHandle texture = p_rm->create_image_view(
+      view_name, name, image_info, vma_alloc_info, view_info);
+  texture_bytes += get_level_bytes(encoded, level);
+  residency.pending_level = level;
+  residency.pending_texture = texture;
+
+  // The levels from level on are a suffix of the encoded data
+  const size_t offset = encoded.level_offsets[level];
+  const size_t size = encoded.data.size() - offset;
+  if (size <= staging_buffer.segment_size) {
+    // Stage pixel data
+    staging_buffer.stage(encoded.data.data() + offset, texture, size, 4);
+    swap_texture(texture_index, staging_buffer, p_rm);
+    return;
+  }
 
-  const VkWriteDescriptorSet image_write = {
-      .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-      .dstSet = vk_descriptor_set,
-      .dstBinding = 0,
-      .dstArrayElement = index,
-      .descriptorCount = 1,
-      .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-      .pImageInfo = &image_infos[image_infos.size() - 1]};
-  write_infos.push_back(image_write);
-  update_descriptor = true;
-  return MaterialHandle(index, MaterialType::LAMBERT);
+  // Stream pixel data, the image is swapped in once the last rows have been
+  // uploaded
+  residency.stream_id = staging_buffer.stream(
+      [encoded = residency.encoded, offset](size_t src_offset,
+                                            size_t read_size, void *p_dst) {
+        std::memcpy(p_dst, encoded->data.data() + offset + src_offset,
+                    read_size);
+      },
+      texture, size,
+      [this, texture_index, &staging_buffer, p_rm](size_t uploaded_size,
+                                                    size_t total_size) {
+        if (uploaded_size != total_size)
+          return;
+        texture_residency[texture_index].stream_id = 0;
+        swap_texture(texture_index, staging_buffer, p_rm);
+        HINFO("LambertManager - Streamed texture {} ({} bytes)",
+              texture_index, total_size);
+      });
 }
 
-void LambertManager::remove_material(const MaterialHandle &material_handle,
-                                     VkResourceManager *p_rm) {
-  if (MaterialManager::remove_material(material_handle))
-    p_rm->queue_destroy({.handle = lambert_textures[material_handle.index],
-                         .frame_index = p_rm->p_device->frame_count});
+void LambertManager::swap_texture(u32 texture_index,
+                                  VkStagingBuffer &staging_buffer,
+                                  VkResourceManager *p_rm) {
+  TextureResidency &residency = texture_residency[texture_index];
+  const u64 frame_count = p_rm->p_device->frame_count;
+  if (residency.resident_level < residency.encoded->level_count) {
+    p_rm->queue_destroy({.handle = lambert_textures[texture_index],
+                         .frame_index = frame_count});
+    retire_texture_bytes(
+        get_level_bytes(*residency.encoded, residency.resident_level),
+        frame_count);
+  }
+  lambert_textures[texture_index] = residency.pending_texture;
+  residency.pending_texture = {};
+  residency.resident_level = residency.pending_level;
+  residency.descriptor_parity ^= 1;
+  residency.swap_frame = frame_count;
+  write_texture_descriptor(texture_index, p_rm);
+  for (u32 index : material_indices) {
+    if (materials[index].texture_index == texture_index)
+      stage_material(staging_buffer, index);
+  }
+}
+
+void LambertManager::retire_texture_bytes(size_t bytes, u64 frame_index) {
+  retired_texture_images.push_back(
+      {.bytes = bytes, .frame_index = frame_index});
+  retired_texture_bytes += bytes;
+}
+
+bool LambertManager::can_change_residency(u32 texture_index,
+                                          u64 frame_count) const {
+  // The descriptor the swap writes must be unused by the frames in flight
+  const TextureResidency &residency = texture_residency[texture_index];
+  return residency.pending_level == residency.resident_level &&
+         frame_count > residency.swap_frame + MAX_FRAMES_IN_FLIGHT;
 }
 
 //
@@ -1,14 +1,45 @@
 #pragma once
 
 #include "Core/FreeIndexPool.hpp"
+#include "Core/TlsfAllocator.hpp"
+#include "TextureCompression.hpp"
 #include "Vulkan/VkResources.hpp"
 // Vendor
 #include <glm/fwd.hpp>
 
 enum MaterialType { LAMBERT, METAL, DIELECTRIC, EMISSIVE, NONE };
 
-struct Lambert {
-  u32 index;
+constexpr u32 INVALID_TEXTURE_INDEX = UINT32_MAX;
+
+struct alignas(16) Lambert {
+  f32 albedo[3];
+  // Texture multiplied with the albedo, INVALID_TEXTURE_INDEX for none. The
+  // gpu copy holds the texture's current descriptor instead, see
+  // TextureResidency::descriptor_parity
+  u32 texture_index;
+  // Maps the wrapped uvs into the texture's rect, scale xy then offset xy
+  f32 uv_scale_offset[4];
+};
+
+struct LambertTextureSource {
+  i32 width;
+  i32 height;
+  // RGBA8
+  const u8 *pixels;
+};
+
+struct LambertTextureRegion {
+  u32 texture_index;
+  f32 uv_scale_offset[4];
+};
+
+// Written by the shader for every texture it samples, one array per frame in
+// flight
+struct TextureFeedback {
+  // First level of the texture's image, in levels of the full chain
+  u32 resident_level;
+  // Finest level of the full chain sampled in the frame, UINT32_MAX for none
+  u32 requested_level;
 };
 
 struct alignas(16) Metal {
@@ -34,6 +65,28 @@ struct VkResourceManager;
 struct VkStagingBuffer;
 struct VkDeviceManager;
 
+// Only the levels of a texture from resident_level on are in device memory.
+// Changing it uploads the new levels' image from the encoded copy and swaps it
+// in once it is complete
+struct TextureResidency {
+  std::shared_ptr<const EncodedTexture> encoded;
+  // level_count while nothing is resident
+  u32 resident_level{0};
+  // Coarsest level the texture is loaded to and evicted to
+  u32 min_resident_level{0};
+  // Level of the image being uploaded, resident_level when there is none
+  u32 pending_level{0};
+  ImageViewHandle pending_texture;
+  u64 stream_id{0};
+  // From the texture feedback, UINT32_MAX until the texture is sampled
+  u32 requested_level{UINT32_MAX};
+  u64 last_used_frame{0};
+  // Each texture has two descriptors, 2 * texture index + parity. A swap
+  // writes the one no frame in flight reads
+  u32 descriptor_parity{0};
+  u64 swap_frame{0};
+};
+
 struct MaterialManager {
 public:
   // Tracks how many blas instances are using a blas
@@ -52,13 +105,43 @@ protected:
 
 struct LambertManager : public MaterialManager {
 public:
-  void init(u32 max_material_count, VkResourceManager *p_rm);
+  // max_texture_count is capped by the device's update after bind limits
+  void init(u32 max_material_count, u32 max_texture_count,
+            VkResourceManager *p_rm);
   void shutdown(VkResourceManager *p_rm);
-  void update(VkDeviceManager *p_device);
+  // Reads the texture feedback of the frame's last use, starts residency
+  // changes within the budget and resets the feedback for this frame
+  void update(VkStagingBuffer &staging_buffer, VkResourceManager *p_rm);
+  // Copies the feedback of this frame's path tracing dispatches into the
+  // frame's readback buffer
+  void record_feedback_readback(VkCommandBuffer cmd, VkResourceManager *p_rm);
+  // Device local memory textures may use, texture_budget capped by the room
+  // the driver's heap budget leaves
+  size_t get_texture_budget(VkDeviceManager *p_device) const;
+  // Materials are interned, adding a material equal to a live one returns the
+  // live one's handle
+  MaterialHandle add_material(VkStagingBuffer &staging_buffer,
+                              const glm::vec3 &albedo,
+                              u32 texture_index = INVALID_TEXTURE_INDEX);
   MaterialHandle add_material(VkStagingBuffer &staging_buffer,
-                              VkResourceManager *p_rm, i32 width, i32 height,
-                              u8 *pixels);
+                              const glm::vec3 &albedo,
+                              const LambertTextureRegion &region);
+  // The RGBA8 pixels are encoded with texture_encoding and are not referenced
+  // after this returns. Only the levels up to RESIDENT_MIN_TEXTURE_SIZE are
+  // loaded, finer ones follow the texture feedback. Materials use the albedo
+  // alone until the first levels are resident. A texture is destroyed with
+  // the last material using it
+  u32 add_texture(VkStagingBuffer &staging_buffer, VkResourceManager *p_rm,
+                  i32 width, i32 height, const u8 *pixels,
+                  u32 max_level_count = UINT32_MAX);
+  // Adds textures at once. With atlas_enabled, textures no larger than
+  // ATLAS_MAX_TEXTURE_SIZE are packed into shared atlas pages and their
+  // regions carry the uv transform into their rect
+  std::vector<LambertTextureRegion>
+  add_textures(VkStagingBuffer &staging_buffer, VkResourceManager *p_rm,
+               std::span<const LambertTextureSource> sources);
   void remove_material(const MaterialHandle &material_handle,
+                       VkStagingBuffer &staging_buffer,
                        VkResourceManager *p_rm);
 
 public:
@@ -66,11 +149,84 @@ public:
   VkDescriptorPool vk_descriptor_pool{VK_NULL_HANDLE};
   VkDescriptorSetLayout vk_descriptor_set_layout{VK_NULL_HANDLE};
   VkDescriptorSet vk_descriptor_set{VK_NULL_HANDLE};
+  // Allocated in the bindless set, two per texture
+  u32 descriptor_count{0};
+  // Indexed by texture index
   std::vector<ImageViewHandle> lambert_textures;
+  // Materials using each texture
+  std::vector<u32> texture_reference_counts;
+  std::unordered_set<u32> texture_indices;
+  FreeIndexPool texture_index_pool;
+  std::vector<TextureResidency> texture_residency;
+  // Device local, reset by the cpu at the start of each frame
+  BufferHandle feedback_buffer;
+  std::array<BufferHandle, MAX_FRAMES_IN_FLIGHT> feedback_readback_buffers;
   std::vector<VkDescriptorImageInfo> image_infos;
   std::vector<VkWriteDescriptorSet> write_infos;
   SamplerHandle texture_sampler;
   bool update_descriptor{false};
+
+  // Applied to textures added afterwards. Textures smaller than a block stay
+  // RGBA8
+  TextureEncoding texture_encoding{TextureEncoding::BC7};
+  bool generate_mips{true};
+  bool atlas_enabled{true};
+  // Upper bound of texture memory, in bytes
+  size_t texture_budget{hmega(512)};
+  // Device memory of the textures' images, pending ones and replaced ones
+  // awaiting destruction included, and of the same textures as RGBA8 without
+  // mips
+  size_t texture_bytes{0};
+  size_t texture_bytes_rgba8{0};
+
+private:
+  void write_texture_descriptor(u32 texture_index, VkResourceManager *p_rm);
+  // Stages a material, without its texture while none of its levels are
+  // resident
+  void stage_material(VkStagingBuffer &staging_buffer, u32 index);
+  void read_texture_feedback(VkResourceManager *p_rm);
+  // Records the reset of the feedback buffer to feedback_data
+  void write_texture_feedback(VkResourceManager *p_rm);
+  void update_residency(VkStagingBuffer &staging_buffer,
+                        VkResourceManager *p_rm);
+  // Evicts the finest level of the least recently used textures, last used
+  // before used_before_frame, until texture_bytes once the replaced images
+  // are destroyed is below target_bytes
+  void evict_texture_levels(size_t target_bytes, u64 used_before_frame,
+                            VkStagingBuffer &staging_buffer,
+                            VkResourceManager *p_rm);
+  bool can_change_residency(u32 texture_index, u64 frame_count) const;
+  // Keeps the bytes of an image queued for destruction in texture_bytes until
+  // it is destroyed
+  void retire_texture_bytes(size_t bytes, u64 frame_index);
+  void change_residency(u32 texture_index, u32 level,
+                        VkStagingBuffer &staging_buffer,
+                        VkResourceManager *p_rm);
+  // Makes the uploaded pending image the texture's image
+  void swap_texture(u32 texture_index, VkStagingBuffer &staging_buffer,
+                    VkResourceManager *p_rm);
+  void remove_texture(u32 texture_index, VkStagingBuffer &staging_buffer,
+                      VkResourceManager *p_rm);
+  static u64 hash_material(const Lambert &material);
+
+  // Live material index by material hash
+  std::unordered_map<u64, u32> interned_materials;
+
+  struct PendingTextureRelease {
+    u32 texture_index;
+    u64 frame_index;
+  };
+  std::vector<PendingTextureRelease> pending_texture_releases;
+  // Queued for destruction, their memory is freed once no frame in flight
+  // can use them
+  struct RetiredTextureImage {
+    size_t bytes;
+    u64 frame_index;
+  };
+  std::vector<RetiredTextureImage> retired_texture_images;
+  size_t retired_texture_bytes{0};
+  // Feedback the device buffer is reset to each frame
+  std::vector<TextureFeedback> feedback_data;
 };
 
 struct MetalManager : public MaterialManager {
@@ -12,11 +12,26 @@
 #include "Vulkan/VkShaderCompilation.h"
 #include "Vulkan/VkUtils.hpp"
 // Vendor
+#include <glm/vec2.hpp>
 #include <imgui/imgui.h>
 #include <tracy/public/tracy/Tracy.hpp>
 
 namespace hlx {
 
+// Seconds between presented frames while the image converges without input
+constexpr f64 CONVERGING_PRESENT_INTERVAL_S = 0.5;
+// Wait between the unpresented frames of a converged image
+constexpr u64 CONVERGED_SLEEP_MS = 10;
+
+// Maps the fullscreen uvs to the rendered region of the output image
+struct FullscreenPushConstant {
+  glm::vec2 uv_scale;
+  // Keeps bilinear taps inside the rendered region
+  glm::vec2 uv_max;
+  // Samples the denoised image instead of the output image
+  u32 show_denoised;
+};
+
 static SceneGraph scene_graph;
 static u32 selected_node_id = INVALID_NODE_ID;
 static MaterialHandle current_material_handle{.index = UINT32_MAX,
@@ -225,10 +240,11 @@ void PathTracer::run() {
   ShaderHandle frag_shader;
   PipelineHandle fullscreen_pipeline;
 
-  // Create the fullscreen pipeline sampler
+  // Create the fullscreen pipeline sampler, bilinear to scale the render
+  // resolution to the window
   VkSamplerCreateInfo sampler_info{VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO};
-  sampler_info.magFilter = VK_FILTER_NEAREST;
-  sampler_info.minFilter = VK_FILTER_NEAREST;
+  sampler_info.magFilter = VK_FILTER_LINEAR;
+  sampler_info.minFilter = VK_FILTER_LINEAR;
   sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
   sampler_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
   sampler_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
@@ -256,16 +272,19 @@ void PathTracer::run() {
     HERROR("{}", exception.what());
   }
 
-  VkDescriptorSetLayoutBinding binding{};
-  binding.binding = 0;
-  binding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-  binding.descriptorCount = 1;
-  binding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+  // The output image and the denoised image
+  std::array<VkDescriptorSetLayoutBinding, 2> bindings{};
+  for (u32 i = 0; i < bindings.size(); ++i) {
+    bindings[i].binding = i;
+    bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    bindings[i].descriptorCount = 1;
+    bindings[i].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+  }
 
   VkDescriptorSetLayoutCreateInfo layout_info{
       VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO};
-  layout_info.bindingCount = 1;
-  layout_info.pBindings = &binding;
+  layout_info.bindingCount = static_cast<u32>(bindings.size());
+  layout_info.pBindings = bindings.data();
   SetLayoutHandle final_image_set_layout = rm.create_descriptor_set_layout(
       "FullscreenDescriptorSetLayout", layout_info);
 
@@ -277,19 +296,7 @@ void PathTracer::run() {
 
   VK_CHECK(vkAllocateDescriptorSets(device.vk_device, &alloc_info,
                                     &final_image_set));
-  VkDescriptorImageInfo image_info = {
-      .sampler = rm.access_sampler(fullscreen_sampler)->vk_handle,
-      .imageView = rm.access_image_view(renderer.output_image_view)->vk_handle,
-      .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL};
-  VkWriteDescriptorSet write_info{
-      .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-      .dstSet = final_image_set,
-      .dstBinding = 0,
-      .dstArrayElement = 0,
-      .descriptorCount = 1,
-      .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-      .pImageInfo = &image_info};
-  vkUpdateDescriptorSets(device.vk_device, 1, &write_info, 0, nullptr);
+  update_final_image_set();
 
   // Create the pipeline
   const VkPipelineRasterizationStateCreateInfo raster_info =
@@ -372,7 +379,7 @@ void PathTracer::run() {
   VkPushConstantRange push_constant = {.stageFlags =
                                            VK_SHADER_STAGE_FRAGMENT_BIT,
                                        .offset = 0,
-                                       .size = sizeof(u32)};
+                                       .size = sizeof(FullscreenPushConstant)};
   const VkPipelineLayoutCreateInfo pipeline_layout_info = {
       .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
       .setLayoutCount = 1,
@@ -387,6 +394,7 @@ void PathTracer::run() {
   clock.start();
   f64 last_time = clock.get_elapsed_time_s();
   u64 frame_number = 0;
+  f64 last_present_time = 0.0;
   Camera cam;
   cam.position = glm::vec3(0.f, 0.75f, 1.5f);
   cam.look_at = glm::vec3(0.f, 0.75f, -1.f);
@@ -405,13 +413,33 @@ void PathTracer::run() {
     if (!Platform::is_suspended()) {
       cam.update(delta_time);
       scene_graph.update_transforms(&renderer);
-      device.begin_frame();
+      // The output image is in use by the frames in flight
+      if (renderer.is_output_image_outdated()) {
+        vkDeviceWaitIdle(device.vk_device);
+        renderer.resize(device.back_buffer_width, device.back_buffer_height);
+        update_final_image_set();
+      }
+      // While the image converges without input, frames only add samples and
+      // the swapchain and ui are refreshed at a low rate
+      const bool interacted = InputSys::consume_activity() || cam.changed;
+      const bool present_frame =
+          interacted || !renderer.is_converging() ||
+          current_time - last_present_time >= CONVERGING_PRESENT_INTERVAL_S;
+      // A converged image is not traced, but its frames still stream uploads
+      // and textures and retire freed resources, at a throttled rate
+      if (!present_frame && renderer.converged)
+        Platform::sleep(CONVERGED_SLEEP_MS);
+      device.begin_frame(present_frame);
       VkCommandBuffer cmd = device.get_current_cmd_buffer();
 
       renderer.render(cam);
+      // Acquire the ui textures uploaded on the transfer queue
+      staging_buffer.flush();
+      staging_buffer.record_acquire_barriers(cmd);
 
       push_debug_label(cmd, "Fullscreen");
-      // Transition the output image to sampled layout
+      // Transition the output image to sampled layout, the renderer leaves
+      // the denoised image in it
       VulkanImageView *vk_output_image_view =
           rm.access_image_view(renderer.output_image_view);
       VulkanImage *vk_output_image =
@@ -439,6 +467,15 @@ void PathTracer::run() {
       dependency_info.pImageMemoryBarriers = &image_barrier;
       vkCmdPipelineBarrier2(cmd, &dependency_info);
 
+      if (!present_frame) {
+        device.end_frame();
+        device.present();
+        rm.update(frame_number++);
+        FrameMark;
+        continue;
+      }
+      last_present_time = current_time;
+
       const VkExtent2D screen_extents{.width = device.back_buffer_width,
                                       .height = device.back_buffer_height};
 
@@ -463,13 +500,24 @@ void PathTracer::run() {
 
       const VkRect2D scissor{.offset = {0, 0}, .extent = screen_extents};
       vkCmdSetScissor(cmd, 0, 1, &scissor);
-      const VkViewport viewport{.x = 0.f,
-                                .y = 0.f,
-                                .width = static_cast<f32>(screen_extents.width),
-                                .height =
-                                    static_cast<f32>(screen_extents.height),
-                                .minDepth = 0.f,
-                                .maxDepth = 1.f};
+      // Fit the rendered region's aspect ratio, fixed resolutions can differ
+      // from the window's
+      const VkExtent2D render_extent = renderer.render_extent;
+      const f32 render_aspect =
+          static_cast<f32>(render_extent.width) / render_extent.height;
+      f32 viewport_width = static_cast<f32>(screen_extents.width);
+      f32 viewport_height = static_cast<f32>(screen_extents.height);
+      if (viewport_width > viewport_height * render_aspect)
+        viewport_width = viewport_height * render_aspect;
+      else
+        viewport_height = viewport_width / render_aspect;
+      const VkViewport viewport{
+          .x = 0.5f * (screen_extents.width - viewport_width),
+          .y = 0.5f * (screen_extents.height - viewport_height),
+          .width = viewport_width,
+          .height = viewport_height,
+          .minDepth = 0.f,
+          .maxDepth = 1.f};
       vkCmdSetViewport(cmd, 0, 1, &viewport);
 
       vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS,
@@ -484,10 +532,20 @@ void PathTracer::run() {
           .pDescriptorSets = &final_image_set,
       };
       vkCmdBindDescriptorSets2(cmd, &bind_info);
-      f32 total_rays = 0.f;
+      const VkExtent2D output_extent = renderer.output_extent;
+      FullscreenPushConstant fullscreen_constant;
+      fullscreen_constant.uv_scale =
+          glm::vec2(static_cast<f32>(render_extent.width) / output_extent.width,
+                    static_cast<f32>(render_extent.height) /
+                        output_extent.height);
+      fullscreen_constant.uv_max =
+          glm::vec2((render_extent.width - 0.5f) / output_extent.width,
+                    (render_extent.height - 0.5f) / output_extent.height);
+      fullscreen_constant.show_denoised = renderer.denoiser_settings.enabled;
       vkCmdPushConstants(
           cmd, rm.access_pipeline(fullscreen_pipeline)->vk_pipeline_layout,
-          VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(f32), &total_rays);
+          VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(FullscreenPushConstant),
+          &fullscreen_constant);
       vkCmdDraw(cmd, 3, 1, 0, 0);
 
       pop_debug_label(cmd);
@@ -501,6 +559,7 @@ void PathTracer::run() {
       render_scene_graph_nodes_property(scene_graph, selected_node_id,
                                         &renderer);
       render_materials_window(&renderer, current_material_handle);
+      render_renderer_settings_window(&renderer);
       ImGui::End();
       scene_ui.end_frame();
 
@@ -545,20 +604,34 @@ void PathTracer::shutdown() {
 void PathTracer::resize() {
   device.reset();
   renderer.resize(device.back_buffer_width, device.back_buffer_height);
+  update_final_image_set();
+}
 
-  VkDescriptorImageInfo image_info = {
-      .sampler = rm.access_sampler(fullscreen_sampler)->vk_handle,
-      .imageView = rm.access_image_view(renderer.output_image_view)->vk_handle,
-      .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL};
-  VkWriteDescriptorSet write_info{
-      .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-      .dstSet = final_image_set,
-      .dstBinding = 0,
-      .dstArrayElement = 0,
-      .descriptorCount = 1,
-      .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-      .pImageInfo = &image_info};
-  vkUpdateDescriptorSets(device.vk_device, 1, &write_info, 0, nullptr);
+void PathTracer::update_final_image_set() {
+  const VkSampler vk_sampler = rm.access_sampler(fullscreen_sampler)->vk_handle;
+  const std::array<VkDescriptorImageInfo, 2> image_infos{{
+      {.sampler = vk_sampler,
+       .imageView = rm.access_image_view(renderer.output_image_view)->vk_handle,
+       .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL},
+      {.sampler = vk_sampler,
+       .imageView =
+           rm.access_image_view(renderer.denoised_image_view)->vk_handle,
+       .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL},
+  }};
+  std::array<VkWriteDescriptorSet, 2> write_infos;
+  for (u32 i = 0; i < write_infos.size(); ++i) {
+    write_infos[i] = {
+        .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstSet = final_image_set,
+        .dstBinding = i,
+        .dstArrayElement = 0,
+        .descriptorCount = 1,
+        .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+        .pImageInfo = &image_infos[i]};
+  }
+  vkUpdateDescriptorSets(device.vk_device,
+                         static_cast<u32>(write_infos.size()),
+                         write_infos.data(), 0, nullptr);
 }
 
 } // namespace hlx
@@ -15,6 +15,10 @@ public:
   void shutdown() override;
   void resize();
 
+private:
+  // Points the fullscreen pass at the renderer's current output image
+  void update_final_image_set();
+
 public:
   VkDeviceManager device;
   VkResourceManager rm;
@@ -3,6 +3,7 @@
 #include "Core/Clock.hpp"
 #include "Core/Defines.hpp"
 #include "Core/Exceptions.hpp"
+#include "Core/MurmurHash.h"
 #include "Material.hpp"
 #include "Vulkan/VkDeviceManager.h"
 #include "Vulkan/VkResourceManager.hpp"
@@ -10,6 +11,7 @@
 #include "Vulkan/VkStagingBuffer.h"
 #include "Vulkan/VkUtils.hpp"
 // Vendor
+#include <format>
 #include <glm/ext/matrix_transform.hpp>
 #include <glm/gtc/constants.hpp>
 #include <glm/vec3.hpp>
@@ -17,13 +19,41 @@
 #include <stb_image.h>
 #include <tracy/public/tracy/Tracy.hpp>
 
-// TODO: Make configurable
-constexpr u32 samples_per_pixel = 3u;
+// Rows per tile dispatch, the height of a thread group
+static constexpr u32 TILE_HEIGHT = 32;
+// Up to 16 stratified samples per pixel in a dispatch
+static constexpr u32 MAX_SQRT_SPP = 4;
+// Still frames before the resolution returns to the idle scale
+static constexpr u32 IDLE_RESOLUTION_DELAY_FRAMES = 8;
+// Samples every tile gets before the error estimates drive adaptive sampling
+static constexpr u32 MIN_ADAPTIVE_SPP = 16;
+static constexpr u32 TILE_COMPACTION_GROUP_SIZE = 64;
+// Accumulations shorter than this, like those of a moving camera, are left
+// out of the path stats reports
+static constexpr f64 MIN_PATH_STATS_REPORT_S = 1.0;
+static constexpr size_t MAX_PATH_STATS_REPORTS = 8;
+static constexpr u32 DENOISE_GROUP_SIZE = 8;
+// Specialized pipelines kept, and frames a permutation must stay unchanged
+// before it is built, so dragging a setting does not build one per value
+static constexpr size_t MAX_PIPELINE_PERMUTATIONS = 8;
+static constexpr u64 PERMUTATION_SETTLE_FRAMES = 30;
+// Initial capacity of the light list, it grows to the emissive triangle count
+static constexpr size_t INITIAL_LIGHT_COUNT = 1024;
 
 static constexpr VkFormat output_image_format = VK_FORMAT_R32G32B32A32_SFLOAT;
-static constexpr size_t MAX_TRIANGLE_COUNT = 4'000'000;
+// Initial capacity of the geometry pools, they grow geometrically from here
+static constexpr size_t INITIAL_TRIANGLE_COUNT = 64 * 1024;
+static constexpr size_t INITIAL_VERTEX_COUNT = 64 * 1024;
+// Address space reserved for the geometry pools. Only the part the pools have
+// grown into is committed
+static constexpr size_t MAX_TRIANGLE_COUNT = 256'000'000;
+static constexpr size_t MAX_VERTEX_COUNT = 256'000'000;
 static constexpr size_t MAX_MATERIAL_COUNT = 1'000;
+// Capped by the device's update after bind descriptor limits
+static constexpr size_t MAX_TEXTURE_COUNT = 4'000;
 static constexpr size_t MAX_BLAS_COUNT = 4'000;
+// Re-braiding can insert several TLAS leaves per blas instance
+static constexpr size_t MAX_TLAS_LEAF_COUNT = MAX_BLAS_COUNT * 2;
 static constexpr u32 BYTES_PER_PIXEL = 4u;
 
 namespace hlx {
@@ -32,8 +62,9 @@ struct alignas(16) UniformData {
   glm::vec4 pixel_delta_u;
   glm::vec4 pixel_delta_v;
   glm::vec4 camera_center;
-  VkDeviceAddress triangle_geom_buffer;
-  VkDeviceAddress triangle_shading_buffer;
+  VkDeviceAddress vertex_positions_buffer;
+  VkDeviceAddress vertex_shading_buffer;
+  VkDeviceAddress triangle_indices_buffer;
   VkDeviceAddress tlas_nodes_buffer;
   VkDeviceAddress bvh_nodes_buffer;
   VkDeviceAddress blas_buffer;
@@ -43,6 +74,16 @@ struct alignas(16) UniformData {
   VkDeviceAddress metal_materials_buffer;
   VkDeviceAddress dielectric_materials_buffer;
   VkDeviceAddress emissive_materials_buffer;
+  VkDeviceAddress texture_feedback_buffer;
+  VkDeviceAddress tile_errors_buffer;
+  VkDeviceAddress tile_sample_counts_buffer;
+  VkDeviceAddress tile_list_buffer;
+  VkDeviceAddress light_triangles_buffer;
+  VkDeviceAddress instance_first_lights_buffer;
+  VkDeviceAddress light_bvh_nodes_buffer;
+  VkDeviceAddress path_stats_buffer;
+  VkDeviceAddress aov_albedo_buffer;
+  VkDeviceAddress aov_normal_depth_buffer;
 };
 
 struct PushConstant {
@@ -54,11 +95,120 @@ struct PushConstant {
   u32 triangle_count;
   u32 frame_index;
 
-  f32 pixel_sample_scale;
+  u32 sample_count;
   f32 recip_sqrt_spp;
 
   u32 sqrt_spp;
-  f32 padding;
+  u32 max_depth;
+
+  u32 tile_offset_y;
+  u32 adaptive;
+  u32 sampler_type;
+  // 0 disables next event estimation
+  u32 light_count;
+  u32 light_sampling;
+  u32 diffuse_depth;
+  u32 specular_depth;
+  u32 transmission_depth;
+  // 0 disables Russian roulette
+  u32 russian_roulette_depth;
+  u32 write_aovs;
+};
+
+struct TileCompactionConstant {
+  VkDeviceAddress tile_errors_buffer;
+  VkDeviceAddress tile_sample_counts_buffer;
+  VkDeviceAddress tile_list_buffer;
+  VkDeviceAddress tile_dispatch_buffer;
+
+  u32 tile_count;
+  f32 error_threshold;
+  u32 max_spp;
+  u32 padding;
+};
+
+struct ReferenceErrorConstant {
+  VkDeviceAddress reference_buffer;
+  VkDeviceAddress tile_errors_buffer;
+
+  u32 image_width;
+  u32 image_height;
+};
+
+struct DenoiseConstant {
+  VkDeviceAddress albedo_buffer;
+  VkDeviceAddress normal_depth_buffer;
+  VkDeviceAddress tile_sample_counts_buffer;
+  VkDeviceAddress source_buffer;
+  VkDeviceAddress destination_buffer;
+
+  u32 image_width;
+  u32 image_height;
+  u32 step_size;
+  u32 last;
+  f32 sigma_luminance;
+  f32 sigma_normal;
+  f32 sigma_depth;
+  u32 padding;
+};
+
+// Runs on a worker thread. The module, layout and cache are only read, the
+// pipeline cache is internally synchronized
+static VkPipeline create_specialized_pipeline(
+    VkDevice vk_device, VkPipelineCache vk_cache, VkShaderModule vk_module,
+    VkPipelineLayout vk_layout, PathTracingPermutation permutation) {
+  const VkSpecializationMapEntry map_entries[] = {
+      {.constantID = 0,
+       .offset = offsetof(PathTracingPermutation, max_depth),
+       .size = sizeof(u32)},
+      {.constantID = 1,
+       .offset = offsetof(PathTracingPermutation, material_mask),
+       .size = sizeof(u32)},
+      {.constantID = 2,
+       .offset = offsetof(PathTracingPermutation, feature_mask),
+       .size = sizeof(u32)}};
+  const VkSpecializationInfo specialization_info{
+      .mapEntryCount = 3,
+      .pMapEntries = map_entries,
+      .dataSize = sizeof(PathTracingPermutation),
+      .pData = &permutation};
+  VkComputePipelineCreateInfo pipeline_info{
+      VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO};
+  pipeline_info.stage.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  pipeline_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+  pipeline_info.stage.module = vk_module;
+  pipeline_info.stage.pName = "main";
+  pipeline_info.stage.pSpecializationInfo = &specialization_info;
+  pipeline_info.layout = vk_layout;
+  VkPipeline vk_pipeline = VK_NULL_HANDLE;
+  VK_CHECK(vkCreateComputePipelines(vk_device, vk_cache, 1, &pipeline_info,
+                                    nullptr, &vk_pipeline));
+  return vk_pipeline;
+}
+
+// Used to weld identical vertices in add_blas
+struct VertexKey {
+  glm::vec3 position;
+  glm::vec3 normal;
+  glm::vec2 uv;
+
+  bool operator==(const VertexKey &other) const {
+    return position == other.position && normal == other.normal &&
+           uv == other.uv;
+  }
+};
+
+struct VertexKeyHash {
+  size_t operator()(const VertexKey &key) const {
+    // -0.f == 0.f, so both must hash the same
+    f32 values[8] = {key.position.x, key.position.y, key.position.z,
+                     key.normal.x,   key.normal.y,   key.normal.z,
+                     key.uv.x,       key.uv.y};
+    for (f32 &value : values)
+      value = value == 0.f ? 0.f : value;
+    return static_cast<size_t>(GenerateHash(values, sizeof(values)).A);
+  }
 };
 
 void generate_sphere(std::vector<glm::vec3> &out_vertices,
@@ -226,22 +376,26 @@ void Renderer::init(VkDeviceManager *p_device, VkResourceManager *p_rm,
   staging_buffer.init(
       p_device, p_rm,
       p_device->queue_family_indices.transfer_family_index.value(),
-      p_device->vk_transfer_queue, 4096 * 4096 * 4);
+      p_device->vk_transfer_queue, hmega(16));
 
   // Create the output image
-  create_output_image(output_image_width, output_image_height);
-
-  // Create descriptor set layout
-  VkDescriptorSetLayoutBinding output_image_binding{};
-  output_image_binding.binding = 0;
-  output_image_binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
-  output_image_binding.descriptorCount = 1;
-  output_image_binding.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  window_extent = {output_image_width, output_image_height};
+  const VkExtent2D extent = get_output_extent();
+  create_output_image(extent.width, extent.height);
+
+  // Create descriptor set layout, the output image and the denoised image
+  std::array<VkDescriptorSetLayoutBinding, 2> image_bindings{};
+  for (u32 i = 0; i < image_bindings.size(); ++i) {
+    image_bindings[i].binding = i;
+    image_bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    image_bindings[i].descriptorCount = 1;
+    image_bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  }
 
   VkDescriptorSetLayoutCreateInfo layout_info{
       VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO};
-  layout_info.bindingCount = 1;
-  layout_info.pBindings = &output_image_binding;
+  layout_info.bindingCount = static_cast<u32>(image_bindings.size());
+  layout_info.pBindings = image_bindings.data();
   set_layout =
       p_rm->create_descriptor_set_layout("PathTracingSetLayout", layout_info);
   const VkDescriptorSetLayout vk_set_layout =
@@ -254,61 +408,36 @@ void Renderer::init(VkDeviceManager *p_device, VkResourceManager *p_rm,
       .descriptorSetCount = 1,
       .pSetLayouts = &vk_set_layout};
   VK_CHECK(vkAllocateDescriptorSets(p_device->vk_device, &alloc_info, &vk_set));
-
-  // Update the set
-  const VkDescriptorImageInfo image_update_info{
-      .sampler = VK_NULL_HANDLE,
-      .imageView = p_rm->access_image_view(output_image_view)->vk_handle,
-      .imageLayout = VK_IMAGE_LAYOUT_GENERAL};
-
-  VkWriteDescriptorSet write_info = {
-      .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-      .dstSet = vk_set,
-      .dstBinding = 0,
-      .dstArrayElement = 0,
-      .descriptorCount = 1,
-      .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
-      .pImageInfo = &image_update_info};
-
-  vkUpdateDescriptorSets(p_device->vk_device, 1, &write_info, 0, nullptr);
+  update_output_image_set();
 
   // Create buffers
   VmaAllocationCreateInfo vma_alloc_info{
       .requiredFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT};
   VkBufferCreateInfo buffer_info{VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
-  buffer_info.size = MAX_TRIANGLE_COUNT * sizeof(TriangleGeom);
   buffer_info.usage = VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |
                       VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                      VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
                       VK_BUFFER_USAGE_TRANSFER_DST_BIT;
-  buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-  triangle_geom_buffer =
-      p_rm->create_buffer("TriangleGeomBuffer", buffer_info, vma_alloc_info);
-  tri_geom_data = static_cast<TriangleGeom *>(malloc(buffer_info.size));
-
-  buffer_info.size = MAX_TRIANGLE_COUNT * sizeof(TriangleShading);
-  triangle_shading_buffer =
-      p_rm->create_buffer("TriangleShadingBuffer", buffer_info, vma_alloc_info);
-  tri_surface_data = static_cast<TriangleShading *>(malloc(buffer_info.size));
-  triangle_centroids_data =
-      static_cast<glm::vec3 *>(malloc(sizeof(glm::vec3) * MAX_TRIANGLE_COUNT));
-
-  buffer_info.size = MAX_TRIANGLE_COUNT * sizeof(u32);
-  tri_ids_buffer =
-      p_rm->create_buffer("TriangleIDsBuffer", buffer_info, vma_alloc_info);
-  tri_id_allocator.init(buffer_info.size, alignof(u32));
+  p_device->set_upload_sharing(buffer_info);
+
+  // Geometry pools. The vertex allocator's memory holds the CPU-side vertex
+  // positions, the other vertex and triangle arrays are indexed in parallel
+  vertex_allocator.init_growable(INITIAL_VERTEX_COUNT * sizeof(glm::vec4),
+                                 MAX_VERTEX_COUNT * sizeof(glm::vec4));
+  tri_id_allocator.init_growable(INITIAL_TRIANGLE_COUNT * sizeof(u32),
+                                 MAX_TRIANGLE_COUNT * sizeof(u32));
+  // A blas has at most 2N - 1 nodes
+  bvh_nodes_allocator.init_growable(
+      INITIAL_TRIANGLE_COUNT * 2 * sizeof(BVHNode),
+      MAX_TRIANGLE_COUNT * 2 * sizeof(BVHNode));
+  resize_geometry_buffers();
 
   // Material buffers
-  lambert_mats.init(MAX_MATERIAL_COUNT, p_rm);
+  lambert_mats.init(MAX_MATERIAL_COUNT, MAX_TEXTURE_COUNT, p_rm);
   metal_mats.init(MAX_MATERIAL_COUNT, p_rm);
   dielectric_mats.init(MAX_MATERIAL_COUNT, p_rm);
   emissive_mats.init(MAX_MATERIAL_COUNT, p_rm);
 
-  // Create with upper bound limit
-  buffer_info.size = (MAX_TRIANGLE_COUNT * 2 - 1) * sizeof(BVHNode);
-  bvh_nodes_buffer =
-      p_rm->create_buffer("BVHNodesBuffer", buffer_info, vma_alloc_info);
-  bvh_nodes_allocator.init(buffer_info.size, sizeof(BVHNode));
-
   // Initialize blases_index_pool, blas_buffer and blases vector
   blases_index_pool.init(MAX_BLAS_COUNT);
   buffer_info.size = MAX_BLAS_COUNT * sizeof(BLAS);
@@ -324,10 +453,23 @@ void Renderer::init(VkDeviceManager *p_device, VkResourceManager *p_rm,
   blas_instances.resize(MAX_BLAS_COUNT);
 
   // TLAS buffer
-  buffer_info.size = MAX_BLAS_COUNT * sizeof(TLASNode);
+  buffer_info.size = MAX_TLAS_LEAF_COUNT * 2 * sizeof(TLASNode);
   tlas_nodes_buffer =
       p_rm->create_buffer("TLASNodesBuffer", buffer_info, vma_alloc_info);
 
+  // Light list, the first light of every blas instance starts out invalid
+  buffer_info.size = MAX_BLAS_COUNT * sizeof(u32);
+  instance_first_lights_buffer = p_rm->create_buffer(
+      "InstanceFirstLightsBuffer", buffer_info, vma_alloc_info);
+  instance_first_lights.assign(MAX_BLAS_COUNT, INVALID_LIGHT);
+  staging_buffer.stage(instance_first_lights.data(),
+                       instance_first_lights_buffer, 0,
+                       MAX_BLAS_COUNT * sizeof(u32));
+  grow_buffer(light_triangles_buffer, "LightTrianglesBuffer",
+              INITIAL_LIGHT_COUNT * sizeof(LightTriangle));
+  grow_buffer(light_bvh_nodes_buffer, "LightBVHNodesBuffer",
+              INITIAL_LIGHT_COUNT * 2 * sizeof(LightBVHNode));
+
   // Load primitive data
   load_plane_data();
   load_cube_data();
@@ -335,6 +477,7 @@ void Renderer::init(VkDeviceManager *p_device, VkResourceManager *p_rm,
 
   // Uniform buffers
   buffer_info.size = sizeof(UniformData);
+  buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
   buffer_info.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT |
                       VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
   vma_alloc_info.requiredFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
@@ -360,12 +503,11 @@ void Renderer::init(VkDeviceManager *p_device, VkResourceManager *p_rm,
   sampler_info.unnormalizedCoordinates = VK_FALSE;
   texture_sampler = p_rm->create_sampler("TextureSampler", sampler_info);
 
-  // Create path tracing shader
-  ShaderHandle path_tracing_shader;
+  // Create path tracing shader. The generic pipeline keeps the default
+  // specialization constants, permutations are built from the same module
   try {
     ShaderBlob blob;
     VkCompileOptions opts;
-    opts.add("ALBEDO_TEXTURE_COUNT", MAX_MATERIAL_COUNT);
     SlangCompiler::compile_code("compute_main", "RayTracing",
                                 SHADER_PATH "RayTracing.slang", blob, opts);
     path_tracing_shader = p_rm->create_shader("PathTracingComp", blob);
@@ -399,7 +541,121 @@ void Renderer::init(VkDeviceManager *p_device, VkResourceManager *p_rm,
   path_tracing_pipeline = p_rm->create_compute_pipeline(
       "PathTracingPipeline", pipelien_create_info, pipeline_layout_info);
 
-  p_rm->queue_destroy({path_tracing_shader});
+  if (p_device->vk_physical_device_properties.limits
+          .timestampComputeAndGraphics) {
+    VkQueryPoolCreateInfo query_pool_info{
+        VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO};
+    query_pool_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    query_pool_info.queryCount = 2 * MAX_FRAMES_IN_FLIGHT;
+    VK_CHECK(vkCreateQueryPool(p_device->vk_device, &query_pool_info, nullptr,
+                               &timestamp_query_pool));
+  } else {
+    HWARN("Timestamps are not supported, the frame budget is not measured");
+  }
+
+  // Adaptive sampling, the per tile buffers are sized with the output image
+  buffer_info.size = sizeof(VkDispatchIndirectCommand);
+  buffer_info.usage = VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |
+                      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                      VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+                      VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+                      VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+  vma_alloc_info.requiredFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+  vma_alloc_info.flags = 0;
+  tile_dispatch_buffer =
+      p_rm->create_buffer("TileDispatchBuffer", buffer_info, vma_alloc_info);
+  buffer_info.size = sizeof(u32);
+  buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+  vma_alloc_info.requiredFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+  vma_alloc_info.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
+  for (u32 i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+    tile_count_readback_buffers[i] = p_rm->create_buffer(
+        "TileCountReadbackBuffer_" + std::to_string(i), buffer_info,
+        vma_alloc_info);
+  }
+  readback_accumulations.fill(UINT32_MAX);
+
+  ShaderHandle tile_compaction_shader;
+  try {
+    ShaderBlob blob;
+    VkCompileOptions opts;
+    SlangCompiler::compile_code("compute_main", "TileCompaction",
+                                SHADER_PATH "TileCompaction.slang", blob, opts);
+    tile_compaction_shader = p_rm->create_shader("TileCompactionComp", blob);
+  } catch (Exception exception) {
+    HERROR("{}", exception.what());
+  }
+  shader_stage_info.module =
+      p_rm->access_shader(tile_compaction_shader)->vk_handle;
+  const VkPushConstantRange compaction_push_constant = {
+      .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+      .offset = 0,
+      .size = sizeof(TileCompactionConstant)};
+  pipeline_layout_info.setLayoutCount = 0;
+  pipeline_layout_info.pSetLayouts = nullptr;
+  pipeline_layout_info.pPushConstantRanges = &compaction_push_constant;
+  pipelien_create_info.stage = shader_stage_info;
+  tile_compaction_pipeline = p_rm->create_compute_pipeline(
+      "TileCompactionPipeline", pipelien_create_info, pipeline_layout_info);
+  p_rm->queue_destroy({tile_compaction_shader});
+
+  ShaderHandle reference_error_shader;
+  try {
+    ShaderBlob blob;
+    VkCompileOptions opts;
+    SlangCompiler::compile_code("compute_main", "ReferenceError",
+                                SHADER_PATH "ReferenceError.slang", blob, opts);
+    reference_error_shader = p_rm->create_shader("ReferenceErrorComp", blob);
+  } catch (Exception exception) {
+    HERROR("{}", exception.what());
+  }
+  shader_stage_info.module =
+      p_rm->access_shader(reference_error_shader)->vk_handle;
+  const VkPushConstantRange reference_error_push_constant = {
+      .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+      .offset = 0,
+      .size = sizeof(ReferenceErrorConstant)};
+  pipeline_layout_info.setLayoutCount = 1;
+  pipeline_layout_info.pSetLayouts = &vk_set_layout;
+  pipeline_layout_info.pPushConstantRanges = &reference_error_push_constant;
+  pipelien_create_info.stage = shader_stage_info;
+  reference_error_pipeline = p_rm->create_compute_pipeline(
+      "ReferenceErrorPipeline", pipelien_create_info, pipeline_layout_info);
+  p_rm->queue_destroy({reference_error_shader});
+
+  // Both denoiser passes share the set and the push constants
+  ShaderHandle denoise_prepare_shader;
+  ShaderHandle denoise_filter_shader;
+  try {
+    ShaderBlob blob;
+    VkCompileOptions opts;
+    SlangCompiler::compile_code("prepare_main", "Denoise",
+                                SHADER_PATH "Denoise.slang", blob, opts);
+    denoise_prepare_shader = p_rm->create_shader("DenoisePrepareComp", blob);
+    SlangCompiler::compile_code("filter_main", "Denoise",
+                                SHADER_PATH "Denoise.slang", blob, opts);
+    denoise_filter_shader = p_rm->create_shader("DenoiseFilterComp", blob);
+  } catch (Exception exception) {
+    HERROR("{}", exception.what());
+  }
+  const VkPushConstantRange denoise_push_constant = {
+      .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+      .offset = 0,
+      .size = sizeof(DenoiseConstant)};
+  pipeline_layout_info.pPushConstantRanges = &denoise_push_constant;
+  shader_stage_info.module =
+      p_rm->access_shader(denoise_prepare_shader)->vk_handle;
+  pipelien_create_info.stage = shader_stage_info;
+  denoise_prepare_pipeline = p_rm->create_compute_pipeline(
+      "DenoisePreparePipeline", pipelien_create_info, pipeline_layout_info);
+  shader_stage_info.module =
+      p_rm->access_shader(denoise_filter_shader)->vk_handle;
+  pipelien_create_info.stage = shader_stage_info;
+  denoise_filter_pipeline = p_rm->create_compute_pipeline(
+      "DenoiseFilterPipeline", pipelien_create_info, pipeline_layout_info);
+  p_rm->queue_destroy({denoise_prepare_shader});
+  p_rm->queue_destroy({denoise_filter_shader});
 
   // Create default material
   default_material = add_lambert_material(glm::vec3(0.7f));
@@ -416,6 +672,49 @@ void Renderer::shutdown() {
 
   lambert_mats.shutdown(p_rm);
   metal_mats.shutdown(p_rm);
+  // The device is idle, wait for the builds still running
+  for (PipelinePermutation &entry : pipeline_permutations) {
+    if (entry.build.valid())
+      entry.vk_pipeline = entry.build.get();
+    vkDestroyPipeline(p_device->vk_device, entry.vk_pipeline, nullptr);
+  }
+  pipeline_permutations.clear();
+  for (const RetiredPipeline &entry : retired_pipelines) {
+    vkDestroyPipeline(p_device->vk_device, entry.vk_pipeline, nullptr);
+  }
+  retired_pipelines.clear();
+  p_rm->queue_destroy({path_tracing_shader});
+  vkDestroyQueryPool(p_device->vk_device, timestamp_query_pool, nullptr);
+  timestamp_query_pool = VK_NULL_HANDLE;
+  p_rm->queue_destroy({tile_compaction_pipeline});
+  p_rm->queue_destroy({tile_errors_buffer});
+  p_rm->queue_destroy({tile_sample_counts_buffer});
+  p_rm->queue_destroy({tile_list_buffer});
+  p_rm->queue_destroy({tile_dispatch_buffer});
+  for (BufferHandle &handle : tile_count_readback_buffers) {
+    p_rm->queue_destroy({handle});
+  }
+  p_rm->queue_destroy({reference_error_pipeline});
+  if (has_reference())
+    p_rm->queue_destroy({reference_buffer});
+  for (BufferHandle &handle : reference_error_buffers) {
+    p_rm->queue_destroy({handle});
+  }
+  for (BufferHandle &handle : path_stats_buffers) {
+    p_rm->queue_destroy({handle});
+  }
+  p_rm->queue_destroy({denoise_prepare_pipeline});
+  p_rm->queue_destroy({denoise_filter_pipeline});
+  if (is_handle_valid(aov_albedo_buffer)) {
+    p_rm->queue_destroy({aov_albedo_buffer});
+    p_rm->queue_destroy({aov_normal_depth_buffer});
+    for (BufferHandle &handle : denoise_buffers) {
+      p_rm->queue_destroy({handle});
+    }
+  }
+  p_rm->queue_destroy({light_triangles_buffer});
+  p_rm->queue_destroy({light_bvh_nodes_buffer});
+  p_rm->queue_destroy({instance_first_lights_buffer});
   dielectric_mats.shutdown(p_rm);
   emissive_mats.shutdown(p_rm);
   for (BufferHandle &handle : uniform_buffers) {
@@ -425,24 +724,35 @@ void Renderer::shutdown() {
   p_rm->queue_destroy({blas_instances_buffer});
   p_rm->queue_destroy({blas_buffer});
   p_rm->queue_destroy({tlas_nodes_buffer});
+  for (u32 i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+    if (is_handle_valid(dynamic_instances_buffers[i]))
+      p_rm->queue_destroy({dynamic_instances_buffers[i]});
+    if (is_handle_valid(dynamic_tlas_nodes_buffers[i]))
+      p_rm->queue_destroy({dynamic_tlas_nodes_buffers[i]});
+  }
   p_rm->queue_destroy({bvh_nodes_buffer});
-  p_rm->queue_destroy({triangle_shading_buffer});
-  p_rm->queue_destroy({triangle_geom_buffer});
+  p_rm->queue_destroy({triangle_indices_buffer});
+  p_rm->queue_destroy({vertex_shading_buffer});
+  p_rm->queue_destroy({vertex_positions_buffer});
   p_rm->queue_destroy({set_layout});
   p_rm->queue_destroy({output_image_view});
+  p_rm->queue_destroy({denoised_image_view});
   p_rm->queue_destroy({path_tracing_pipeline});
   p_rm->queue_destroy({texture_sampler});
   staging_buffer.shutdown();
 
   for (const auto &[blas_id, allocation] : blas_allocations_map) {
     tri_id_allocator.deallocate(allocation.tri_id_allocation);
+    vertex_allocator.deallocate(allocation.vertex_allocation);
     bvh_nodes_allocator.deallocate(allocation.bvh_nodes_allocation);
   }
+  release_pending_geometry_frees(true);
 
   bvh_nodes_allocator.shutdown();
   tri_id_allocator.shutdown();
-  free(tri_geom_data);
-  free(tri_surface_data);
+  vertex_allocator.shutdown();
+  free(vertex_shading_data);
+  free(tri_indices_data);
   free(triangle_centroids_data);
 
   blases_index_pool.release(sphere_blas_index);
@@ -459,52 +769,104 @@ void Renderer::shutdown() {
   p_device = nullptr;
 }
 
-void Renderer::resize(u32 output_image_width, u32 output_image_height) {
+void Renderer::resize(u32 window_width, u32 window_height) {
   // delete the old output image
   p_rm->queue_destroy({output_image_view});
+  p_rm->queue_destroy({denoised_image_view});
 
   // Recreate the output image
-  create_output_image(output_image_width, output_image_height);
-
-  // Update the descriptor set
-  const VkDescriptorImageInfo image_update_info{
-      .sampler = VK_NULL_HANDLE,
-      .imageView = p_rm->access_image_view(output_image_view)->vk_handle,
-      .imageLayout = VK_IMAGE_LAYOUT_GENERAL};
-
-  VkWriteDescriptorSet write_info = {
-      .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-      .dstSet = vk_set,
-      .dstBinding = 0,
-      .dstArrayElement = 0,
-      .descriptorCount = 1,
-      .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
-      .pImageInfo = &image_update_info};
-
-  vkUpdateDescriptorSets(p_device->vk_device, 1, &write_info, 0, nullptr);
+  window_extent = {window_width, window_height};
+  const VkExtent2D extent = get_output_extent();
+  create_output_image(extent.width, extent.height);
+  output_image_outdated = false;
+
+  update_output_image_set();
   frame_index = 0;
 }
 
+void Renderer::update_output_image_set() {
+  const std::array<VkDescriptorImageInfo, 2> image_update_infos{{
+      {.sampler = VK_NULL_HANDLE,
+       .imageView = p_rm->access_image_view(output_image_view)->vk_handle,
+       .imageLayout = VK_IMAGE_LAYOUT_GENERAL},
+      {.sampler = VK_NULL_HANDLE,
+       .imageView = p_rm->access_image_view(denoised_image_view)->vk_handle,
+       .imageLayout = VK_IMAGE_LAYOUT_GENERAL},
+  }};
+
+  std::array<VkWriteDescriptorSet, 2> write_infos;
+  for (u32 i = 0; i < write_infos.size(); ++i) {
+    write_infos[i] = {.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                      .dstSet = vk_set,
+                      .dstBinding = i,
+                      .dstArrayElement = 0,
+                      .descriptorCount = 1,
+                      .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+                      .pImageInfo = &image_update_infos[i]};
+  }
+  vkUpdateDescriptorSets(p_device->vk_device,
+                         static_cast<u32>(write_infos.size()),
+                         write_infos.data(), 0, nullptr);
+}
+
 void Renderer::render(Camera &camera) {
   ZoneScoped;
   // Reset frame number if cam has moved
+  const bool moving = camera.changed;
   if (camera.changed) {
     frame_index = 0;
     camera.changed = false;
   }
+  still_frames = moving ? 0 : still_frames + 1;
+  // A new render region starts over from a cleared image
+  const VkExtent2D extent = get_render_extent();
+  if (extent.width != render_extent.width ||
+      extent.height != render_extent.height) {
+    render_extent = extent;
+    frame_index = 0;
+    output_image_cleared = false;
+  }
+  read_gpu_time();
+  read_reference_error();
+  read_path_stats();
 
-  lambert_mats.update(p_device);
+  release_pending_geometry_frees(false);
+  if (compaction_enabled)
+    compact_geometry();
   // Rebuild tlas if a change was made
+  // Record this frame's share of the streamed uploads. Completed geometry
+  // streams request a TLAS rebuild
+  staging_buffer.update();
+  // Texture residency follows the feedback of this frame slot's last use
+  lambert_mats.update(staging_buffer, p_rm);
   if (rebuild_tlas)
     build_tlas();
+  if (rebuild_lights)
+    build_light_list();
+  // Submit this frame's uploads on the transfer queue. The frame waits for the
+  // staged data, streamed chunks are uploaded alongside it
+  staging_buffer.flush();
+  staging_buffer.record_acquire_barriers(p_device->get_current_cmd_buffer());
+  if (dynamic_instances)
+    update_dynamic_instance_buffers();
+  const u32 frame = p_device->current_frame;
+  // The first hits are only written for the denoiser
+  if (denoiser_settings.enabled)
+    create_denoiser_buffers();
+  const bool write_aovs = denoiser_settings.enabled;
+  const BufferHandle frame_tlas_nodes_buffer =
+      dynamic_instances ? dynamic_tlas_nodes_buffers[frame] : tlas_nodes_buffer;
+  const BufferHandle frame_blas_instances_buffer =
+      dynamic_instances ? dynamic_instances_buffers[frame]
+                        : blas_instances_buffer;
 
   // Update uniforms
   VulkanImageView *vk_output_image_view =
       p_rm->access_image_view(output_image_view);
   VulkanImage *vk_output_image =
       p_rm->access_image(vk_output_image_view->image_handle);
-  VkExtent2D screen_extents = {vk_output_image->width(),
-                               vk_output_image->height()};
+  const VkExtent2D screen_extents = render_extent;
+  plan_dispatches(moving, screen_extents.width, screen_extents.height);
   f32 focal_length = glm::length(camera.position - camera.look_at);
   f32 theta = degrees_to_radians(camera.fov);
   f32 h = std::tan(theta / 2.f);
@@ -535,17 +897,19 @@ void Renderer::render(Camera &camera) {
       .pixel_delta_u = glm::vec4(pixel_delta_u, 1.f),
       .pixel_delta_v = glm::vec4(pixel_delta_v, 1.f),
       .camera_center = glm::vec4(camera.position, 1.f),
-      .triangle_geom_buffer =
-          p_rm->access_buffer(triangle_geom_buffer)->vk_device_address,
-      .triangle_shading_buffer =
-          p_rm->access_buffer(triangle_shading_buffer)->vk_device_address,
+      .vertex_positions_buffer =
+          p_rm->access_buffer(vertex_positions_buffer)->vk_device_address,
+      .vertex_shading_buffer =
+          p_rm->access_buffer(vertex_shading_buffer)->vk_device_address,
+      .triangle_indices_buffer =
+          p_rm->access_buffer(triangle_indices_buffer)->vk_device_address,
       .tlas_nodes_buffer =
-          p_rm->access_buffer(tlas_nodes_buffer)->vk_device_address,
+          p_rm->access_buffer(frame_tlas_nodes_buffer)->vk_device_address,
       .bvh_nodes_buffer =
           p_rm->access_buffer(bvh_nodes_buffer)->vk_device_address,
       .blas_buffer = p_rm->access_buffer(blas_buffer)->vk_device_address,
       .blas_instances_buffer =
-          p_rm->access_buffer(blas_instances_buffer)->vk_device_address,
+          p_rm->access_buffer(frame_blas_instances_buffer)->vk_device_address,
       .tri_ids_buffer = p_rm->access_buffer(tri_ids_buffer)->vk_device_address,
       .lambert_materials_buffer =
           p_rm->access_buffer(lambert_mats.buffer)->vk_device_address,
@@ -555,6 +919,30 @@ void Renderer::render(Camera &camera) {
           p_rm->access_buffer(dielectric_mats.buffer)->vk_device_address,
       .emissive_materials_buffer =
           p_rm->access_buffer(emissive_mats.buffer)->vk_device_address,
+      .texture_feedback_buffer =
+          p_rm->access_buffer(lambert_mats.feedback_buffer)->vk_device_address,
+      .tile_errors_buffer =
+          p_rm->access_buffer(tile_errors_buffer)->vk_device_address,
+      .tile_sample_counts_buffer =
+          p_rm->access_buffer(tile_sample_counts_buffer)->vk_device_address,
+      .tile_list_buffer =
+          p_rm->access_buffer(tile_list_buffer)->vk_device_address,
+      .light_triangles_buffer =
+          p_rm->access_buffer(light_triangles_buffer)->vk_device_address,
+      .instance_first_lights_buffer =
+          p_rm->access_buffer(instance_first_lights_buffer)->vk_device_address,
+      .light_bvh_nodes_buffer =
+          p_rm->access_buffer(light_bvh_nodes_buffer)->vk_device_address,
+      .path_stats_buffer =
+          p_rm->access_buffer(path_stats_buffers[frame])->vk_device_address,
+      .aov_albedo_buffer =
+          write_aovs
+              ? p_rm->access_buffer(aov_albedo_buffer)->vk_device_address
+              : 0,
+      .aov_normal_depth_buffer =
+          write_aovs
+              ? p_rm->access_buffer(aov_normal_depth_buffer)->vk_device_address
+              : 0,
   };
   VulkanBuffer *uniform_buffer =
       p_rm->access_buffer(uniform_buffers.at(p_device->current_frame));
@@ -580,8 +968,9 @@ void Renderer::render(Camera &camera) {
   dependency_info.dependencyFlags = 0;
   dependency_info.imageMemoryBarrierCount = 1;
   dependency_info.pImageMemoryBarriers = &image_barrier;
-  // Clear the image if something has changed
-  if (frame_index == 0) {
+  // Clear the new image, a reset pass overwrites the pixels it renders
+  if (!output_image_cleared) {
+    output_image_cleared = true;
     // Trasition to transfer dst layout
     image_barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
     image_barrier.dstStageMask = VK_PIPELINE_STAGE_2_CLEAR_BIT;
@@ -612,23 +1001,43 @@ void Renderer::render(Camera &camera) {
 
   vkCmdPipelineBarrier2(cmd, &dependency_info);
 
+  // The default material keeps lambert in every permutation
+  u32 material_mask = 1u << MaterialType::LAMBERT;
+  if (!metal_mats.material_indices.empty())
+    material_mask |= 1u << MaterialType::METAL;
+  if (!dielectric_mats.material_indices.empty())
+    material_mask |= 1u << MaterialType::DIELECTRIC;
+  if (!emissive_mats.material_indices.empty())
+    material_mask |= 1u << MaterialType::EMISSIVE;
   const VulkanPipeline *pipeline = p_rm->access_pipeline(path_tracing_pipeline);
-  vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline->vk_handle);
+  u32 feature_mask = 0;
+  if (next_event_estimation && light_count > 0)
+    feature_mask |= PathTracingFeature::NEXT_EVENT_ESTIMATION;
+  if (depth_settings.russian_roulette_depth != 0)
+    feature_mask |= PathTracingFeature::RUSSIAN_ROULETTE;
+  if (write_aovs)
+    feature_mask |= PathTracingFeature::DENOISER_AOVS;
+  const VkPipeline vk_pipeline = get_path_tracing_pipeline(
+      {.max_depth = depth_settings.max_depth,
+       .material_mask = material_mask,
+       .feature_mask = feature_mask});
+  vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, vk_pipeline);
 
   // Ray tracing parameters
   PushConstant push_constant;
   push_constant.image_width = screen_extents.width;
   push_constant.image_height = screen_extents.height;
-  push_constant.frame_index = frame_index;
   push_constant.triangle_count = total_triangle_count;
   push_constant.uniform_data_buffer = uniform_buffer->vk_device_address;
-  push_constant.sqrt_spp = u32(std::sqrt(samples_per_pixel));
-  push_constant.pixel_sample_scale =
-      1.f / (push_constant.sqrt_spp * push_constant.sqrt_spp);
-  push_constant.recip_sqrt_spp = 1.f / push_constant.sqrt_spp;
-  vkCmdPushConstants(cmd, pipeline->vk_pipeline_layout,
-                     VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstant),
-                     &push_constant);
+  push_constant.max_depth = depth_settings.max_depth;
+  push_constant.sampler_type = static_cast<u32>(sampler_type);
+  push_constant.light_count = next_event_estimation ? light_count : 0;
+  push_constant.light_sampling = static_cast<u32>(light_sampling);
+  push_constant.diffuse_depth = depth_settings.diffuse_depth;
+  push_constant.specular_depth = depth_settings.specular_depth;
+  push_constant.transmission_depth = depth_settings.transmission_depth;
+  push_constant.russian_roulette_depth = depth_settings.russian_roulette_depth;
+  push_constant.write_aovs = write_aovs;
   VkDescriptorSet vk_sets[] = {vk_set, lambert_mats.vk_descriptor_set};
   const VkBindDescriptorSetsInfo bind_info{
       .sType = VK_STRUCTURE_TYPE_BIND_DESCRIPTOR_SETS_INFO,
@@ -640,18 +1049,142 @@ void Renderer::render(Camera &camera) {
   };
   vkCmdBindDescriptorSets2(cmd, &bind_info);
 
+  // Each dispatch accumulates into the output image on top of the last one
+  VkMemoryBarrier2 accumulate_barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER_2};
+  accumulate_barrier.srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+  accumulate_barrier.srcAccessMask = VK_ACCESS_2_SHADER_WRITE_BIT;
+  accumulate_barrier.dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+  accumulate_barrier.dstAccessMask =
+      VK_ACCESS_2_SHADER_READ_BIT | VK_ACCESS_2_SHADER_WRITE_BIT;
+  VkDependencyInfo accumulate_dependency{VK_STRUCTURE_TYPE_DEPENDENCY_INFO};
+  accumulate_dependency.memoryBarrierCount = 1;
+  accumulate_dependency.pMemoryBarriers = &accumulate_barrier;
+
+  const u32 frame_query = 2 * p_device->current_frame;
+  if (timestamp_query_pool != VK_NULL_HANDLE) {
+    vkCmdResetQueryPool(cmd, timestamp_query_pool, frame_query, 2);
+    vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_TOP_OF_PIPE_BIT,
+                         timestamp_query_pool, frame_query);
+  }
+
   constexpr u32 thread_group_size = 32;
-  vkCmdDispatch(
-      cmd,
-      (vk_output_image->width() + thread_group_size - 1) / thread_group_size,
-      (vk_output_image->height() + thread_group_size - 1) / thread_group_size,
-      1);
+  readback_accumulations[frame] = UINT32_MAX;
+  for (u32 i = 0; i < tile_dispatches.size(); ++i) {
+    const TileDispatch &dispatch = tile_dispatches[i];
+    if (i > 0)
+      vkCmdPipelineBarrier2(cmd, &accumulate_dependency);
+    if (dispatch.adaptive) {
+      record_tile_compaction(cmd);
+      readback_accumulations[frame] = accumulation_id;
+      vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, vk_pipeline);
+      vkCmdBindDescriptorSets2(cmd, &bind_info);
+    }
+    push_constant.frame_index = frame_index;
+    push_constant.sample_count = dispatch.sample_count;
+    push_constant.sqrt_spp = dispatch.sqrt_spp;
+    push_constant.recip_sqrt_spp = 1.f / dispatch.sqrt_spp;
+    push_constant.tile_offset_y = dispatch.first_tile * TILE_HEIGHT;
+    push_constant.adaptive = dispatch.adaptive;
+    vkCmdPushConstants(cmd, pipeline->vk_pipeline_layout,
+                       VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstant),
+                       &push_constant);
+    if (dispatch.adaptive) {
+      vkCmdDispatchIndirect(
+          cmd, p_rm->access_buffer(tile_dispatch_buffer)->vk_handle, 0);
+    } else {
+      vkCmdDispatch(
+          cmd,
+          (screen_extents.width + thread_group_size - 1) / thread_group_size,
+          dispatch.tile_count * TILE_HEIGHT / thread_group_size, 1);
+    }
+    ++frame_index;
+  }
+
+  if (timestamp_query_pool != VK_NULL_HANDLE)
+    vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                         timestamp_query_pool, frame_query + 1);
+  lambert_mats.record_feedback_readback(cmd, p_rm);
+
+  // The path stats are read on the cpu once the frame's fence signals
+  if (!tile_dispatches.empty()) {
+    VkMemoryBarrier2 stats_barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER_2};
+    stats_barrier.srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+    stats_barrier.srcAccessMask = VK_ACCESS_2_SHADER_WRITE_BIT;
+    stats_barrier.dstStageMask = VK_PIPELINE_STAGE_2_HOST_BIT;
+    stats_barrier.dstAccessMask = VK_ACCESS_2_HOST_READ_BIT;
+    VkDependencyInfo stats_dependency{VK_STRUCTURE_TYPE_DEPENDENCY_INFO};
+    stats_dependency.memoryBarrierCount = 1;
+    stats_dependency.pMemoryBarriers = &stats_barrier;
+    vkCmdPipelineBarrier2(cmd, &stats_dependency);
+    path_stats_readbacks[frame] = {.accumulation_id = accumulation_id,
+                                   .tile_count = render_tile_count,
+                                   .depth_settings = depth_settings};
+  }
+
+  if (reference_capture_pending) {
+    reference_capture_pending = false;
+    record_reference_capture(cmd);
+  } else if (has_reference() &&
+             reference_extent.width == screen_extents.width &&
+             reference_extent.height == screen_extents.height) {
+    record_reference_error(cmd);
+  }
+
+  // Frames that add no samples keep the last denoised result
+  if (!tile_dispatches.empty())
+    denoised_image_current = false;
+  const bool denoise =
+      denoiser_settings.enabled &&
+      (!denoised_image_current || !(denoised_settings == denoiser_settings));
+  if (denoise || denoised_image_layout == VK_IMAGE_LAYOUT_UNDEFINED) {
+    // The denoised image is overwritten, its last contents were only sampled
+    VkImageMemoryBarrier2 denoised_barrier{
+        VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2};
+    denoised_barrier.subresourceRange = image_barrier.subresourceRange;
+    denoised_barrier.image =
+        p_rm->access_image(
+                p_rm->access_image_view(denoised_image_view)->image_handle)
+            ->vk_handle;
+    denoised_barrier.srcStageMask = VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT;
+    denoised_barrier.srcAccessMask = VK_ACCESS_2_NONE;
+    denoised_barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    if (denoise) {
+      denoised_barrier.dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+      denoised_barrier.dstAccessMask = VK_ACCESS_2_SHADER_WRITE_BIT;
+      denoised_barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+    } else {
+      denoised_barrier.dstStageMask = VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT;
+      denoised_barrier.dstAccessMask = VK_ACCESS_2_SHADER_SAMPLED_READ_BIT;
+      denoised_barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    }
+    VkDependencyInfo denoised_dependency{VK_STRUCTURE_TYPE_DEPENDENCY_INFO};
+    denoised_dependency.imageMemoryBarrierCount = 1;
+    denoised_dependency.pImageMemoryBarriers = &denoised_barrier;
+    vkCmdPipelineBarrier2(cmd, &denoised_dependency);
+
+    if (denoise) {
+      record_denoise(cmd);
+      denoised_barrier.srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+      denoised_barrier.srcAccessMask = VK_ACCESS_2_SHADER_WRITE_BIT;
+      denoised_barrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+      denoised_barrier.dstStageMask = VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT;
+      denoised_barrier.dstAccessMask = VK_ACCESS_2_SHADER_SAMPLED_READ_BIT;
+      denoised_barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+      vkCmdPipelineBarrier2(cmd, &denoised_dependency);
+      denoised_image_current = true;
+      denoised_settings = denoiser_settings;
+    }
+    denoised_image_layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+  }
 
   pop_debug_label(cmd);
-  ++frame_index;
 } // namespace hlx
 
 void Renderer::create_output_image(u32 width, u32 height) {
+  output_image_cleared = false;
+  output_extent = {width, height};
+  create_tile_buffers(((width + TILE_HEIGHT - 1) / TILE_HEIGHT) *
+                      ((height + TILE_HEIGHT - 1) / TILE_HEIGHT));
   VkImageCreateInfo image_info{VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO};
   image_info.imageType = VK_IMAGE_TYPE_2D;
   image_info.extent.width = width;
@@ -681,28 +1214,51 @@ void Renderer::create_output_image(u32 width, u32 height) {
 
   output_image_view = p_rm->create_image_view(
       "OutputImageView", "OutputImage", image_info, vma_alloc_info, view_info);
+  image_info.usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_STORAGE_BIT;
+  denoised_image_view =
+      p_rm->create_image_view("DenoisedImageView", "DenoisedImage",
+                              image_info, vma_alloc_info, view_info);
+  denoised_image_layout = VK_IMAGE_LAYOUT_UNDEFINED;
+  denoised_image_current = false;
 }
 
 MaterialHandle Renderer::add_lambert_material(i32 width, i32 height,
                                               u8 *pixels) {
-  return lambert_mats.add_material(staging_buffer, p_rm, width, height, pixels);
+  return add_lambert_material(width, height, pixels, glm::vec3(1.f));
+}
+
+MaterialHandle Renderer::add_lambert_material(i32 width, i32 height,
+                                              u8 *pixels,
+                                              const glm::vec3 &albedo) {
+  const u32 texture_index =
+      lambert_mats.add_texture(staging_buffer, p_rm, width, height, pixels);
+  return lambert_mats.add_material(
+      staging_buffer, glm::clamp(albedo, 0.f, 1.f), texture_index);
+}
+
+MaterialHandle
+Renderer::add_lambert_material(const glm::vec3 &albedo,
+                               const LambertTextureRegion &region) {
+  return lambert_mats.add_material(staging_buffer,
+                                   glm::clamp(albedo, 0.f, 1.f), region);
+}
+
+std::vector<LambertTextureRegion>
+Renderer::add_lambert_textures(std::span<const LambertTextureSource> sources) {
+  return lambert_mats.add_textures(staging_buffer, p_rm, sources);
 }
 
 MaterialHandle Renderer::add_lambert_material(const glm::vec3 &albedo) {
-  glm::vec3 clamped_albedo = glm::clamp(albedo, 0.f, 1.f);
-  // Create pixel data
-  u8 *pixels = static_cast<u8 *>(malloc(sizeof(u8) * 4));
-  HASSERT(pixels);
-  pixels[0] = static_cast<u8>(clamped_albedo.x * 255.f);
-  pixels[1] = static_cast<u8>(clamped_albedo.y * 255.f);
-  pixels[2] = static_cast<u8>(clamped_albedo.z * 255.f);
-  pixels[3] = 255;
-  MaterialHandle handle = add_lambert_material(1, 1, pixels);
-  free(pixels);
-  return handle;
+  return lambert_mats.add_material(staging_buffer,
+                                   glm::clamp(albedo, 0.f, 1.f));
 }
 
 MaterialHandle Renderer::add_lambert_material(std::string_view file_path) {
+  return add_lambert_material(file_path, glm::vec3(1.f));
+}
+
+MaterialHandle Renderer::add_lambert_material(std::string_view file_path,
+                                              const glm::vec3 &albedo) {
   i32 comp, image_width, image_height;
   stbi_set_flip_vertically_on_load(false);
   u8 *raw_bdata = stbi_load(file_path.data(), &image_width, &image_height,
@@ -710,8 +1266,8 @@ MaterialHandle Renderer::add_lambert_material(std::string_view file_path) {
   HASSERT_MSGS(raw_bdata, "Failed to load image: {}", file_path.data());
 
   MaterialHandle handle =
-      add_lambert_material(image_width, image_height, raw_bdata);
-  free(raw_bdata);
+      add_lambert_material(image_width, image_height, raw_bdata, albedo);
+  stbi_image_free(raw_bdata);
   return handle;
 }
 
@@ -732,7 +1288,7 @@ void Renderer::remove_material(const MaterialHandle &material_handle) {
   // TODO: Check if any blas instance uses the material
   switch (material_handle.type) {
   case MaterialType::LAMBERT: {
-    lambert_mats.remove_material(material_handle, p_rm);
+    lambert_mats.remove_material(material_handle, staging_buffer, p_rm);
     break;
   }
   case MaterialType::METAL: {
@@ -759,24 +1315,75 @@ u32 Renderer::add_blas(std::span<glm::vec3> positions,
   u32 trig_count = indices.size() / 3;
 
   // Allocate tri ids data
-  void *p_tri_ids =
-      tri_id_allocator.allocate(sizeof(u32) * trig_count, sizeof(u32));
+  void *p_tri_ids = allocate_geometry(tri_id_allocator,
+                                      sizeof(u32) * trig_count, sizeof(u32));
+  if (!p_tri_ids)
+    return INVALID_BLAS;
   std::ptrdiff_t byte_offset = static_cast<char *>(p_tri_ids) -
                                static_cast<char *>(tri_id_allocator.memory);
   // Get the index into the tri ids pool
   u32 tri_id_index = byte_offset / sizeof(u32);
 
+  // Weld identical vertices so each unique vertex is stored once
+  std::vector<u32> remap(positions.size());
+  std::vector<u32> unique_vertices;
+  unique_vertices.reserve(positions.size());
+  {
+    std::unordered_map<VertexKey, u32, VertexKeyHash> vertex_lookup;
+    vertex_lookup.reserve(positions.size());
+    for (u32 i = 0; i < positions.size(); ++i) {
+      VertexKey key = {positions[i], normals[i], uvs[i]};
+      auto [it, inserted] = vertex_lookup.try_emplace(
+          key, static_cast<u32>(unique_vertices.size()));
+      if (inserted)
+        unique_vertices.push_back(i);
+      remap[i] = it->second;
+    }
+  }
+  u32 vertex_count = static_cast<u32>(unique_vertices.size());
+
+  // Allocate vertex data
+  void *p_vertices =
+      allocate_geometry(vertex_allocator, sizeof(glm::vec4) * vertex_count,
+                        alignof(glm::vec4));
+  if (!p_vertices) {
+    // Nothing has been uploaded yet, no frame can read the allocations
+    tri_id_allocator.deallocate(p_tri_ids);
+    return INVALID_BLAS;
+  }
+  byte_offset = static_cast<char *>(p_vertices) -
+                static_cast<char *>(vertex_allocator.memory);
+  HASSERT((byte_offset % sizeof(glm::vec4)) == 0);
+  u32 vertex_index = byte_offset / sizeof(glm::vec4);
+
+  // Tiled and atlas UVs outside [-1, 1] would lose texels to fp16
+  bool wide_uvs = false;
+  for (const glm::vec2 &uv : uvs)
+    wide_uvs |= glm::abs(uv.x) > MAX_PACKED_UV ||
+                glm::abs(uv.y) > MAX_PACKED_UV;
+
+  glm::vec4 *vertex_positions_data = static_cast<glm::vec4 *>(p_vertices);
+  for (u32 i = 0; i < vertex_count; ++i) {
+    const u32 src = unique_vertices[i];
+    if (wide_uvs) {
+      vertex_positions_data[i] = glm::vec4(positions[src], uvs[src].x);
+      vertex_shading_data[vertex_index + i] =
+          VertexShading(normals[src], uvs[src].y);
+    } else {
+      vertex_positions_data[i] = glm::vec4(positions[src], 1.f);
+      vertex_shading_data[vertex_index + i] =
+          VertexShading(normals[src], uvs[src]);
+    }
+  }
+
   // Load the triangle data
   u32 *tri_ids_data = static_cast<u32 *>(p_tri_ids);
   u32 tri_index = tri_id_index;
   u32 index = 0;
   for (size_t i = 0; i < indices.size(); i += 3) {
-    tri_geom_data[tri_index] =
-        (TriangleGeom(positions[indices[i]], positions[indices[i + 1]],
-                      positions[indices[i + 2]]));
-    tri_surface_data[tri_index] = (TriangleShading(
-        normals[indices[i]], normals[indices[i + 1]], normals[indices[i + 2]],
-        uvs[indices[i]], uvs[indices[i + 1]], uvs[indices[i + 2]]));
+    tri_indices_data[tri_index] = {vertex_index + remap[indices[i]],
+                                   vertex_index + remap[indices[i + 1]],
+                                   vertex_index + remap[indices[i + 2]]};
     triangle_centroids_data[tri_index] =
         ((positions[indices[i]] + positions[indices[i + 1]] +
           positions[indices[i + 2]]) *
@@ -786,21 +1393,13 @@ u32 Renderer::add_blas(std::span<glm::vec3> positions,
     ++index;
   }
 
-  // Stage triangle data
-  {
-    std::span<TriangleGeom> data_view =
-        std::span(tri_geom_data + tri_id_index, trig_count);
-    staging_buffer.stage(data_view.data(), triangle_geom_buffer,
-                         tri_id_index * sizeof(TriangleGeom),
-                         trig_count * sizeof(TriangleGeom));
-  }
-  {
-    std::span<TriangleShading> data_view =
-        std::span(tri_surface_data + tri_id_index, trig_count);
-    staging_buffer.stage(data_view.data(), triangle_shading_buffer,
-                         tri_id_index * sizeof(TriangleShading),
-                         trig_count * sizeof(TriangleShading));
-  }
+  HINFO("Renderer::add_blas() - {} triangles, {} of {} vertices unique, {} "
+        "bytes of geometry ({} bytes unindexed){}",
+        trig_count, vertex_count, positions.size(),
+        vertex_count * (sizeof(glm::vec4) + sizeof(VertexShading)) +
+            trig_count * sizeof(TriangleIndices),
+        trig_count * (sizeof(glm::vec4) + sizeof(VertexShading)) * 3,
+        wide_uvs ? ", fp32 uvs" : "");
 
   // Create blas
   u32 prev_blas_nodes_count = bvh_nodes_size;
@@ -814,15 +1413,23 @@ u32 Renderer::add_blas(std::span<glm::vec3> positions,
   // bvh_nodes_allocator and update the blas' bvh_nodes_offset. This means we
   // don't need to pass in a bvh_nodes_offset parameter
   blas.build(bvh_nodes, /*This is redundant*/ prev_blas_nodes_count,
-             std::span(tri_geom_data, MAX_TRIANGLE_COUNT),
-             std::span(triangle_centroids_data, MAX_TRIANGLE_COUNT),
+             get_triangle_mesh(),
+             std::span(triangle_centroids_data, triangle_capacity),
              std::span(static_cast<u32 *>(tri_id_allocator.memory),
-                       MAX_TRIANGLE_COUNT),
+                       triangle_capacity),
              trig_count, tri_id_index);
+  blas.flags = wide_uvs ? BLAS_WIDE_UVS : 0u;
 
   // Allocate from the bvh_nodes_allocator and copy the data
-  void *p_bvh_nodes = bvh_nodes_allocator.allocate(
-      sizeof(BVHNode) * blas.nodes_count, sizeof(BVHNode));
+  void *p_bvh_nodes =
+      allocate_geometry(bvh_nodes_allocator,
+                        sizeof(BVHNode) * blas.nodes_count, sizeof(BVHNode));
+  if (!p_bvh_nodes) {
+    tri_id_allocator.deallocate(p_tri_ids);
+    vertex_allocator.deallocate(p_vertices);
+    blases_index_pool.release(blas_index);
+    return INVALID_BLAS;
+  }
   std::memcpy(p_bvh_nodes, bvh_nodes.data(),
               sizeof(BVHNode) * blas.nodes_count);
   byte_offset = static_cast<char *>(p_bvh_nodes) -
@@ -834,23 +1441,69 @@ u32 Renderer::add_blas(std::span<glm::vec3> positions,
 
   // Update map
   blas_allocations_map[blas_index] = {.tri_id_allocation = p_tri_ids,
-                                      .bvh_nodes_allocation = p_bvh_nodes};
-
-  // Stage ids data
-  {
-    std::span<u32> data_view = std::span(tri_ids_data, trig_count);
-    staging_buffer.stage(data_view.data(), tri_ids_buffer,
+                                      .vertex_allocation = p_vertices,
+                                      .bvh_nodes_allocation = p_bvh_nodes,
+                                      .vertex_count = vertex_count};
+
+  const size_t upload_size =
+      vertex_count * (sizeof(glm::vec4) + sizeof(VertexShading)) +
+      trig_count * (sizeof(TriangleIndices) + sizeof(u32)) +
+      blas.nodes_count * sizeof(BVHNode);
+  if (upload_size <= staging_buffer.segment_size) {
+    // Stage vertex and triangle data
+    staging_buffer.stage(p_vertices, vertex_positions_buffer,
+                         vertex_index * sizeof(glm::vec4),
+                         vertex_count * sizeof(glm::vec4));
+    staging_buffer.stage(vertex_shading_data + vertex_index,
+                         vertex_shading_buffer,
+                         vertex_index * sizeof(VertexShading),
+                         vertex_count * sizeof(VertexShading));
+    staging_buffer.stage(tri_indices_data + tri_id_index,
+                         triangle_indices_buffer,
+                         tri_id_index * sizeof(TriangleIndices),
+                         trig_count * sizeof(TriangleIndices));
+    // Stage ids data
+    staging_buffer.stage(tri_ids_data, tri_ids_buffer,
                          tri_id_index * sizeof(u32), trig_count * sizeof(u32));
-  }
-  // Stage bvh data
-  {
+    // Stage bvh data
     staging_buffer.stage(p_bvh_nodes, bvh_nodes_buffer, byte_offset,
                          blas.nodes_count * sizeof(BVHNode));
+  } else {
+    // Stream the ranges over the next frames. The parallel arrays can be
+    // reallocated while streaming, so they are read through this
+    stream_geometry(blas_index, vertex_positions_buffer,
+                    vertex_index * sizeof(glm::vec4),
+                    vertex_count * sizeof(glm::vec4), p_vertices);
+    stream_geometry(
+        blas_index, vertex_shading_buffer, vertex_index * sizeof(VertexShading),
+        vertex_count * sizeof(VertexShading),
+        [this, vertex_index](size_t src_offset, size_t size, void *p_dst) {
+          std::memcpy(p_dst,
+                      reinterpret_cast<const u8 *>(vertex_shading_data +
+                                                   vertex_index) +
+                          src_offset,
+                      size);
+        });
+    stream_geometry(
+        blas_index, triangle_indices_buffer,
+        tri_id_index * sizeof(TriangleIndices),
+        trig_count * sizeof(TriangleIndices),
+        [this, tri_id_index](size_t src_offset, size_t size, void *p_dst) {
+          std::memcpy(p_dst,
+                      reinterpret_cast<const u8 *>(tri_indices_data +
+                                                   tri_id_index) +
+                          src_offset,
+                      size);
+        });
+    stream_geometry(blas_index, tri_ids_buffer, tri_id_index * sizeof(u32),
+                    trig_count * sizeof(u32), p_tri_ids);
+    stream_geometry(blas_index, bvh_nodes_buffer, byte_offset,
+                    blas.nodes_count * sizeof(BVHNode), p_bvh_nodes);
+    HINFO("Renderer::add_blas() - Streaming {} bytes for blas {}", upload_size,
+          blas_index);
   }
-  {
-    staging_buffer.stage(&blas, blas_buffer, sizeof(BLAS) * blas_index,
-                         sizeof(BLAS));
-  }
+  staging_buffer.stage(&blas, blas_buffer, sizeof(BLAS) * blas_index,
+                       sizeof(BLAS));
 
   return blas_index;
 }
@@ -864,8 +1517,7 @@ u32 Renderer::add_blas_instance(u32 blas_index, const glm::mat4 &transform,
   inst.blas_id = blas_index;
   inst.set_transform(transform);
   inst.material_handle = material;
-  staging_buffer.stage(&inst, blas_instances_buffer,
-                       sizeof(BLASInstance) * index, sizeof(BLASInstance));
+  upload_blas_instance(index);
   rebuild_tlas = true;
   blas_instance_ids.insert(index);
 
@@ -908,9 +1560,7 @@ void Renderer::set_blas_instance_transform(u32 blas_instance_id,
   }
   BLASInstance &inst = blas_instances[blas_instance_id];
   inst.set_transform(transform);
-  staging_buffer.stage(&inst, blas_instances_buffer,
-                       sizeof(BLASInstance) * blas_instance_id,
-                       sizeof(BLASInstance));
+  upload_blas_instance(blas_instance_id);
 
   rebuild_tlas = true;
 }
@@ -929,8 +1579,12 @@ void Renderer::remove_blas(u32 blas_id) {
   }
 
   BLAS_Allocation &allocation = blas_allocations_map[blas_id];
-  tri_id_allocator.deallocate(allocation.tri_id_allocation);
-  bvh_nodes_allocator.deallocate(allocation.bvh_nodes_allocation);
+  for (const u64 stream_id : allocation.stream_ids) {
+    staging_buffer.cancel_stream(stream_id);
+  }
+  free_geometry(tri_id_allocator, allocation.tri_id_allocation);
+  free_geometry(vertex_allocator, allocation.vertex_allocation);
+  free_geometry(bvh_nodes_allocator, allocation.bvh_nodes_allocation);
   blases_index_pool.release(blas_id);
   blas_allocations_map.erase(blas_id);
 }
@@ -991,27 +1645,1264 @@ void Renderer::load_plane_data() {
   blas_use_count[plane_blas_index] = 1;
 }
 
+TriangleMesh Renderer::get_triangle_mesh() {
+  return {.vertices = std::span(
+              static_cast<glm::vec4 *>(vertex_allocator.memory),
+              vertex_capacity),
+          .triangles = std::span(tri_indices_data, triangle_capacity)};
+}
+
+void *Renderer::allocate_geometry(TlsfAllocator &allocator, size_t size,
+                                  size_t alignment) {
+  void *p_allocation = allocator.allocate(size, alignment);
+  while (!p_allocation) {
+    // Grow geometrically, and at least by enough for this allocation
+    const size_t new_size = std::min(
+        std::max(allocator.max_size * 2, allocator.max_size + size * 2),
+        allocator.reserved_size);
+    if (new_size <= allocator.max_size || !allocator.grow(new_size)) {
+      HCRITICAL("Renderer::allocate_geometry() - Failed to grow a geometry "
+                "pool to fit {} bytes",
+                size);
+      return nullptr;
+    }
+    resize_geometry_buffers();
+    p_allocation = allocator.allocate(size, alignment);
+  }
+  return p_allocation;
+}
+
+void Renderer::resize_geometry_buffers() {
+  const size_t new_vertex_capacity =
+      vertex_allocator.max_size / sizeof(glm::vec4);
+  if (new_vertex_capacity > vertex_capacity) {
+    vertex_shading_data = static_cast<VertexShading *>(realloc(
+        vertex_shading_data, new_vertex_capacity * sizeof(VertexShading)));
+    HASSERT(vertex_shading_data);
+    grow_buffer(vertex_positions_buffer, "VertexPositionsBuffer",
+                new_vertex_capacity * sizeof(glm::vec4));
+    grow_buffer(vertex_shading_buffer, "VertexShadingBuffer",
+                new_vertex_capacity * sizeof(VertexShading));
+    vertex_capacity = new_vertex_capacity;
+  }
+
+  const size_t new_triangle_capacity = tri_id_allocator.max_size / sizeof(u32);
+  if (new_triangle_capacity > triangle_capacity) {
+    tri_indices_data = static_cast<TriangleIndices *>(realloc(
+        tri_indices_data, new_triangle_capacity * sizeof(TriangleIndices)));
+    triangle_centroids_data = static_cast<glm::vec3 *>(realloc(
+        triangle_centroids_data, new_triangle_capacity * sizeof(glm::vec3)));
+    HASSERT(tri_indices_data && triangle_centroids_data);
+    grow_buffer(tri_ids_buffer, "TriangleIDsBuffer",
+                new_triangle_capacity * sizeof(u32));
+    grow_buffer(triangle_indices_buffer, "TriangleIndicesBuffer",
+                new_triangle_capacity * sizeof(TriangleIndices));
+    triangle_capacity = new_triangle_capacity;
+  }
+
+  grow_buffer(bvh_nodes_buffer, "BVHNodesBuffer",
+              bvh_nodes_allocator.max_size);
+}
+
+void Renderer::grow_buffer(BufferHandle &buffer, std::string_view name,
+                           size_t size) {
+  const VulkanBuffer *old_buffer = p_rm->access_buffer(buffer);
+  if (old_buffer && old_buffer->vk_device_size >= size)
+    return;
+  const size_t used_size = old_buffer ? old_buffer->current_size : 0;
+
+  VmaAllocationCreateInfo vma_alloc_info{
+      .requiredFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT};
+  VkBufferCreateInfo buffer_info{VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
+  buffer_info.size = size;
+  buffer_info.usage = VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |
+                      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                      VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+                      VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+  p_device->set_upload_sharing(buffer_info);
+  BufferHandle new_buffer =
+      p_rm->create_buffer(name, buffer_info, vma_alloc_info);
+
+  if (is_handle_valid(buffer)) {
+    // Copy the old contents on the gpu. The new device address is picked up by
+    // the next UniformData update, frames in flight keep using the old buffer
+    staging_buffer.copy_buffer(buffer, 0, new_buffer, 0, used_size);
+    staging_buffer.retarget_streams(buffer, new_buffer);
+    p_rm->queue_destroy({buffer, p_device->frame_count});
+    HINFO("Renderer - Grew {} to {} bytes", name, size);
+  }
+  buffer = new_buffer;
+}
+
+void Renderer::stream_geometry(u32 blas_id, BufferHandle buffer,
+                               size_t dst_offset, size_t size,
+                               const void *p_data) {
+  stream_geometry(blas_id, buffer, dst_offset, size,
+                  [p_data](size_t src_offset, size_t read_size, void *p_dst) {
+                    std::memcpy(p_dst,
+                                static_cast<const u8 *>(p_data) + src_offset,
+                                read_size);
+                  });
+}
+
+void Renderer::stream_geometry(u32 blas_id, BufferHandle buffer,
+                               size_t dst_offset, size_t size,
+                               VkStagingBuffer::StreamReadFn read) {
+  BLAS_Allocation &allocation = blas_allocations_map[blas_id];
+  ++allocation.pending_stream_count;
+  const u64 stream_id = staging_buffer.stream(
+      std::move(read), buffer, dst_offset, size,
+      [this, blas_id](size_t uploaded_size, size_t total_size) {
+        if (uploaded_size != total_size)
+          return;
+        BLAS_Allocation &allocation = blas_allocations_map[blas_id];
+        if (--allocation.pending_stream_count == 0) {
+          allocation.stream_ids.clear();
+          rebuild_tlas = true;
+          HINFO("Renderer - Finished streaming blas {}", blas_id);
+        }
+      });
+  allocation.stream_ids.push_back(stream_id);
+}
+
+void Renderer::free_geometry(TlsfAllocator &allocator, void *p_allocation) {
+  pending_geometry_frees.push_back({.p_allocator = &allocator,
+                                    .p_allocation = p_allocation,
+                                    .frame_index = p_device->frame_count});
+}
+
+void Renderer::release_pending_geometry_frees(bool release_all) {
+  std::erase_if(pending_geometry_frees, [&](const PendingGeometryFree &entry) {
+    if (!release_all &&
+        (p_device->frame_count - entry.frame_index) <= MAX_FRAMES_IN_FLIGHT)
+      return false;
+    entry.p_allocator->deallocate(entry.p_allocation);
+    return true;
+  });
+}
+
+u32 Renderer::find_highest_allocation(void *BLAS_Allocation::*allocation) {
+  u32 highest_blas_id = UINT32_MAX;
+  const char *p_highest = nullptr;
+  for (const auto &[blas_id, blas_allocation] : blas_allocations_map) {
+    // Streams read the source ranges until they finish
+    if (blas_allocation.pending_stream_count)
+      continue;
+    const char *p = static_cast<const char *>(blas_allocation.*allocation);
+    if (!p_highest || p > p_highest) {
+      p_highest = p;
+      highest_blas_id = blas_id;
+    }
+  }
+  return highest_blas_id;
+}
+
+void Renderer::compact_geometry() {
+  ZoneScoped;
+  size_t moved_bytes = 0;
+  size_t step_bytes = 0;
+  do {
+    step_bytes = compact_bvh_nodes();
+    step_bytes += compact_tri_ids();
+    step_bytes += compact_vertices();
+    moved_bytes += step_bytes;
+  } while (step_bytes && moved_bytes < compaction_bytes_per_frame);
+}
+
+size_t Renderer::compact_bvh_nodes() {
+  const u32 blas_id =
+      find_highest_allocation(&BLAS_Allocation::bvh_nodes_allocation);
+  if (blas_id == UINT32_MAX)
+    return 0;
+
+  BLAS_Allocation &allocation = blas_allocations_map[blas_id];
+  BLAS &blas = blases[blas_id];
+  const size_t size = blas.nodes_count * sizeof(BVHNode);
+  void *p_old = allocation.bvh_nodes_allocation;
+  void *p_new = bvh_nodes_allocator.allocate(size, sizeof(BVHNode));
+  if (!p_new)
+    return 0;
+  if (static_cast<char *>(p_new) > static_cast<char *>(p_old)) {
+    bvh_nodes_allocator.deallocate(p_new);
+    return 0;
+  }
+
+  // Node links are local to the blas, only the blas offset changes
+  std::memcpy(p_new, p_old, size);
+  const size_t old_offset = static_cast<char *>(p_old) -
+                            static_cast<char *>(bvh_nodes_allocator.memory);
+  const size_t new_offset = static_cast<char *>(p_new) -
+                            static_cast<char *>(bvh_nodes_allocator.memory);
+  staging_buffer.copy_buffer(bvh_nodes_buffer, old_offset, bvh_nodes_buffer,
+                             new_offset, size);
+  blas.bvh_nodes_offset = new_offset / sizeof(BVHNode);
+  staging_buffer.stage(&blas, blas_buffer, sizeof(BLAS) * blas_id,
+                       sizeof(BLAS));
+
+  free_geometry(bvh_nodes_allocator, p_old);
+  allocation.bvh_nodes_allocation = p_new;
+  return size;
+}
+
+size_t Renderer::compact_tri_ids() {
+  const u32 blas_id =
+      find_highest_allocation(&BLAS_Allocation::tri_id_allocation);
+  if (blas_id == UINT32_MAX)
+    return 0;
+
+  BLAS_Allocation &allocation = blas_allocations_map[blas_id];
+  BLAS &blas = blases[blas_id];
+  const u32 tri_count = blas.tri_count_;
+  void *p_old = allocation.tri_id_allocation;
+  void *p_new = tri_id_allocator.allocate(tri_count * sizeof(u32), sizeof(u32));
+  if (!p_new)
+    return 0;
+  if (static_cast<char *>(p_new) > static_cast<char *>(p_old)) {
+    tri_id_allocator.deallocate(p_new);
+    return 0;
+  }
+
+  const u32 old_index = (static_cast<char *>(p_old) -
+                         static_cast<char *>(tri_id_allocator.memory)) /
+                        sizeof(u32);
+  const u32 new_index = (static_cast<char *>(p_new) -
+                         static_cast<char *>(tri_id_allocator.memory)) /
+                        sizeof(u32);
+
+  // Triangle slots share the tri id offsets, move them along and rebase the
+  // tri ids
+  u32 *p_new_tri_ids = static_cast<u32 *>(p_new);
+  const u32 *p_old_tri_ids = static_cast<const u32 *>(p_old);
+  for (u32 i = 0; i < tri_count; ++i) {
+    p_new_tri_ids[i] = p_old_tri_ids[i] - old_index + new_index;
+  }
+  std::memcpy(tri_indices_data + new_index, tri_indices_data + old_index,
+              tri_count * sizeof(TriangleIndices));
+  std::memcpy(triangle_centroids_data + new_index,
+              triangle_centroids_data + old_index,
+              tri_count * sizeof(glm::vec3));
+
+  staging_buffer.stage(p_new_tri_ids, tri_ids_buffer, new_index * sizeof(u32),
+                       tri_count * sizeof(u32));
+  staging_buffer.copy_buffer(triangle_indices_buffer,
+                             old_index * sizeof(TriangleIndices),
+                             triangle_indices_buffer,
+                             new_index * sizeof(TriangleIndices),
+                             tri_count * sizeof(TriangleIndices));
+
+  // Rebase the leaves. The old range stays alive until no frame in flight
+  // reads it, so a traversal sees valid triangles with either node version
+  BVHNode *p_nodes = static_cast<BVHNode *>(allocation.bvh_nodes_allocation);
+  for (u32 i = 0; i < blas.nodes_count; ++i) {
+    if (p_nodes[i].tri_count > 0)
+      p_nodes[i].local_left_first =
+          p_nodes[i].local_left_first - old_index + new_index;
+  }
+  staging_buffer.stage(p_nodes, bvh_nodes_buffer,
+                       blas.bvh_nodes_offset * sizeof(BVHNode),
+                       blas.nodes_count * sizeof(BVHNode));
+
+  free_geometry(tri_id_allocator, p_old);
+  allocation.tri_id_allocation = p_new;
+  // Lights refer to the triangle slots
+  rebuild_lights = true;
+  return tri_count * (sizeof(u32) + sizeof(TriangleIndices)) +
+         blas.nodes_count * sizeof(BVHNode);
+}
+
+size_t Renderer::compact_vertices() {
+  const u32 blas_id =
+      find_highest_allocation(&BLAS_Allocation::vertex_allocation);
+  if (blas_id == UINT32_MAX)
+    return 0;
+
+  BLAS_Allocation &allocation = blas_allocations_map[blas_id];
+  const u32 vertex_count = allocation.vertex_count;
+  void *p_old = allocation.vertex_allocation;
+  void *p_new = vertex_allocator.allocate(vertex_count * sizeof(glm::vec4),
+                                          alignof(glm::vec4));
+  if (!p_new)
+    return 0;
+  if (static_cast<char *>(p_new) > static_cast<char *>(p_old)) {
+    vertex_allocator.deallocate(p_new);
+    return 0;
+  }
+
+  const u32 old_index = (static_cast<char *>(p_old) -
+                         static_cast<char *>(vertex_allocator.memory)) /
+                        sizeof(glm::vec4);
+  const u32 new_index = (static_cast<char *>(p_new) -
+                         static_cast<char *>(vertex_allocator.memory)) /
+                        sizeof(glm::vec4);
+
+  std::memcpy(p_new, p_old, vertex_count * sizeof(glm::vec4));
+  std::memcpy(vertex_shading_data + new_index, vertex_shading_data + old_index,
+              vertex_count * sizeof(VertexShading));
+  staging_buffer.copy_buffer(vertex_positions_buffer,
+                             old_index * sizeof(glm::vec4),
+                             vertex_positions_buffer,
+                             new_index * sizeof(glm::vec4),
+                             vertex_count * sizeof(glm::vec4));
+  staging_buffer.copy_buffer(vertex_shading_buffer,
+                             old_index * sizeof(VertexShading),
+                             vertex_shading_buffer,
+                             new_index * sizeof(VertexShading),
+                             vertex_count * sizeof(VertexShading));
+
+  // Rebase the blas' triangles onto the new vertex range
+  const u32 tri_index = (static_cast<char *>(allocation.tri_id_allocation) -
+                         static_cast<char *>(tri_id_allocator.memory)) /
+                        sizeof(u32);
+  const u32 tri_count = blases[blas_id].tri_count_;
+  for (u32 i = tri_index; i < tri_index + tri_count; ++i) {
+    TriangleIndices &tri = tri_indices_data[i];
+    tri = {tri.i0 - old_index + new_index, tri.i1 - old_index + new_index,
+           tri.i2 - old_index + new_index};
+  }
+  staging_buffer.stage(tri_indices_data + tri_index, triangle_indices_buffer,
+                       tri_index * sizeof(TriangleIndices),
+                       tri_count * sizeof(TriangleIndices));
+
+  free_geometry(vertex_allocator, p_old);
+  allocation.vertex_allocation = p_new;
+  return vertex_count * (sizeof(glm::vec4) + sizeof(VertexShading)) +
+         tri_count * sizeof(TriangleIndices);
+}
+
+void Renderer::set_resolution_settings(const ResolutionSettings &settings) {
+  resolution_settings = settings;
+  const VkExtent2D extent = get_output_extent();
+  output_image_outdated = extent.width != output_extent.width ||
+                          extent.height != output_extent.height;
+}
+
+static VkExtent2D scale_extent(const VkExtent2D &extent, f32 scale) {
+  return {std::max(static_cast<u32>(extent.width * scale), 1u),
+          std::max(static_cast<u32>(extent.height * scale), 1u)};
+}
+
+VkExtent2D Renderer::get_output_extent() const {
+  if (resolution_settings.fixed)
+    return {std::max(resolution_settings.fixed_width, 1u),
+            std::max(resolution_settings.fixed_height, 1u)};
+  // Sized for the larger scale, so motion only changes the rendered region
+  return scale_extent(window_extent,
+                      std::max(resolution_settings.moving_scale,
+                               resolution_settings.idle_scale));
+}
+
+VkExtent2D Renderer::get_render_extent() const {
+  if (resolution_settings.fixed)
+    return output_extent;
+  const f32 scale = still_frames < IDLE_RESOLUTION_DELAY_FRAMES
+                        ? resolution_settings.moving_scale
+                        : resolution_settings.idle_scale;
+  const VkExtent2D extent = scale_extent(window_extent, scale);
+  return {std::min(extent.width, output_extent.width),
+          std::min(extent.height, output_extent.height)};
+}
+
+void Renderer::set_tlas_build_settings(const TLASBuildSettings &settings) {
+  tlas_settings = settings;
+  rebuild_tlas = true;
+}
+
 void Renderer::build_tlas() {
-  tlas_nodes.resize(blas_inst_index_pool.size * 2);
+  size_t max_leaf_count = blas_inst_index_pool.size;
+  if (tlas_settings.rebraid)
+    max_leaf_count = std::min(max_leaf_count *
+                                  tlas_settings.max_leaves_per_instance,
+                              MAX_TLAS_LEAF_COUNT);
+  tlas_nodes.resize(max_leaf_count * 2);
   if (tlas_nodes.size()) {
     Clock clock;
     clock.start();
-    std::vector<u32> temp_blas_instance_ids(blas_instance_ids.begin(),
-                                            blas_instance_ids.end());
+    // Instances of blases that are still streaming are left out
+    std::vector<u32> temp_blas_instance_ids;
+    temp_blas_instance_ids.reserve(blas_instance_ids.size());
+    for (const u32 blas_instance_id : blas_instance_ids) {
+      const u32 blas_id = blas_instances[blas_instance_id].blas_id;
+      if (blas_allocations_map[blas_id].pending_stream_count == 0)
+        temp_blas_instance_ids.push_back(blas_instance_id);
+    }
+    if (temp_blas_instance_ids.empty()) {
+      // Nothing can be traced yet, upload a root that every ray misses
+      tlas_nodes[0] = {.aabb_min = glm::vec3(infinity),
+                       .left_right = 0,
+                       .aabb_max = glm::vec3(-infinity),
+                       .blas_instance_idx = INVALID_BLAS_INSTANCE};
+      upload_tlas_nodes(1);
+      rebuild_tlas = false;
+      rebuild_lights = true;
+      frame_index = 0;
+      return;
+    }
     tlas.build(tlas_nodes, blas_instances, temp_blas_instance_ids, blases,
                std::span<BVHNode>(
                    reinterpret_cast<BVHNode *>(bvh_nodes_allocator.memory),
-                   bvh_nodes_allocator.max_size / sizeof(BVHNode)));
-    HINFO("TLAS build time: {}s", clock.get_elapsed_time_s());
+                   bvh_nodes_allocator.max_size / sizeof(BVHNode)),
+               tlas_settings);
+    HINFO("TLAS build time: {}s, {} leaves, {} nodes",
+          clock.get_elapsed_time_s(), tlas.leaf_count, tlas.node_count);
 
-    VulkanBuffer *vk_tlas_nodes = p_rm->access_buffer(tlas_nodes_buffer);
-
-    staging_buffer.stage(tlas_nodes.data(), tlas_nodes_buffer, 0,
-                         tlas.node_count * sizeof(TLASNode));
-    staging_buffer.flush();
+    upload_tlas_nodes(tlas.node_count);
   }
   rebuild_tlas = false;
+  rebuild_lights = true;
   frame_index = 0;
 }
 
+void Renderer::build_light_list() {
+  ZoneScoped;
+  rebuild_lights = false;
+  for (const LightTriangle &light : light_triangles) {
+    instance_first_lights[light.blas_instance_id] = INVALID_LIGHT;
+  }
+
+  std::vector<LightTriangle> lights;
+  std::vector<LightBVHNode> light_bounds;
+  std::vector<f32> weights;
+  f64 weight_sum = 0.0;
+  const glm::vec4 *positions =
+      static_cast<const glm::vec4 *>(vertex_allocator.memory);
+  for (const u32 blas_instance_id : blas_instance_ids) {
+    const BLASInstance &inst = blas_instances[blas_instance_id];
+    if (inst.material_handle.type != MaterialType::EMISSIVE)
+      continue;
+    // Same instances as the TLAS, streaming blases are not traced yet
+    const BLAS_Allocation &allocation = blas_allocations_map[inst.blas_id];
+    if (allocation.pending_stream_count)
+      continue;
+    const Emissive &emissive =
+        emissive_mats.materials[inst.material_handle.index];
+    const f32 power = 0.2126f * emissive.intensity[0] +
+                      0.7152f * emissive.intensity[1] +
+                      0.0722f * emissive.intensity[2];
+    if (power <= 0.f)
+      continue;
+
+    const u32 first_tri =
+        (static_cast<const char *>(allocation.tri_id_allocation) -
+         static_cast<const char *>(tri_id_allocator.memory)) /
+        sizeof(u32);
+    const u32 tri_count = blases[inst.blas_id].tri_count_;
+    instance_first_lights[blas_instance_id] = static_cast<u32>(lights.size());
+    for (u32 i = first_tri; i < first_tri + tri_count; ++i) {
+      const TriangleIndices &tri = tri_indices_data[i];
+      // w holds the u of wide uv blases
+      const glm::vec3 v0 = glm::vec3(
+          inst.transform * glm::vec4(glm::vec3(positions[tri.i0]), 1.f));
+      const glm::vec3 v1 = glm::vec3(
+          inst.transform * glm::vec4(glm::vec3(positions[tri.i1]), 1.f));
+      const glm::vec3 v2 = glm::vec3(
+          inst.transform * glm::vec4(glm::vec3(positions[tri.i2]), 1.f));
+      const f32 weight =
+          0.5f * glm::length(glm::cross(v1 - v0, v2 - v0)) * power;
+      lights.push_back(
+          {.blas_instance_id = blas_instance_id, .triangle_index = i});
+      light_bounds.push_back(get_triangle_light_bounds(v0, v1, v2, weight));
+      weights.push_back(weight);
+      weight_sum += weight;
+    }
+  }
+
+  if (weight_sum <= 0.0) {
+    for (const LightTriangle &light : lights) {
+      instance_first_lights[light.blas_instance_id] = INVALID_LIGHT;
+    }
+    lights.clear();
+  }
+  light_count = static_cast<u32>(lights.size());
+  staging_buffer.stage(instance_first_lights.data(),
+                       instance_first_lights_buffer, 0,
+                       MAX_BLAS_COUNT * sizeof(u32));
+  if (light_count == 0) {
+    light_triangles.clear();
+    light_bvh_nodes.clear();
+    return;
+  }
+
+  // Moved lights keep the tree and their trails, the nodes are refit
+  const bool same_lights =
+      std::equal(lights.begin(), lights.end(), light_triangles.begin(),
+                 light_triangles.end(),
+                 [](const LightTriangle &a, const LightTriangle &b) {
+                   return a.blas_instance_id == b.blas_instance_id;
+                 });
+  if (same_lights) {
+    for (u32 i = 0; i < light_count; ++i) {
+      lights[i].bvh_trail = light_triangles[i].bvh_trail;
+    }
+    refit_light_bvh(light_bvh_nodes, light_bounds);
+  } else {
+    Clock clock;
+    clock.start();
+    build_light_bvh(light_bvh_nodes, lights, light_bounds);
+    HINFO("Renderer - Light BVH of {} emissive triangles built in {}s",
+          light_count, clock.get_elapsed_time_s());
+  }
+  build_alias_table(lights, weights);
+  light_triangles = std::move(lights);
+
+  grow_buffer(light_triangles_buffer, "LightTrianglesBuffer",
+              light_count * sizeof(LightTriangle));
+  staging_buffer.stage(light_triangles.data(), light_triangles_buffer, 0,
+                       light_count * sizeof(LightTriangle));
+  grow_buffer(light_bvh_nodes_buffer, "LightBVHNodesBuffer",
+              light_bvh_nodes.size() * sizeof(LightBVHNode));
+  staging_buffer.stage(light_bvh_nodes.data(), light_bvh_nodes_buffer, 0,
+                       light_bvh_nodes.size() * sizeof(LightBVHNode));
+}
+
+void Renderer::upload_blas_instance(u32 blas_instance_id) {
+  if (dynamic_instances) {
+    ++instances_version;
+    return;
+  }
+  staging_buffer.stage(&blas_instances[blas_instance_id], blas_instances_buffer,
+                       sizeof(BLASInstance) * blas_instance_id,
+                       sizeof(BLASInstance));
+}
+
+void Renderer::upload_tlas_nodes(u32 node_count) {
+  tlas_upload_node_count = node_count;
+  if (dynamic_instances) {
+    ++tlas_version;
+    return;
+  }
+  staging_buffer.stage(tlas_nodes.data(), tlas_nodes_buffer, 0,
+                       node_count * sizeof(TLASNode));
+}
+
+void Renderer::set_dynamic_instances(bool enable) {
+  if (enable == dynamic_instances)
+    return;
+  dynamic_instances = enable;
+
+  if (enable) {
+    // Host-visible memory, device-local if the device exposes it (ReBAR)
+    VmaAllocationCreateInfo vma_alloc_info{};
+    vma_alloc_info.requiredFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                   VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    vma_alloc_info.preferredFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+    vma_alloc_info.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
+    VkBufferCreateInfo buffer_info{VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
+    buffer_info.usage = VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |
+                        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+    buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    for (u32 i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+      buffer_info.size = MAX_BLAS_COUNT * sizeof(BLASInstance);
+      dynamic_instances_buffers[i] = p_rm->create_buffer(
+          "DynamicBLASInstancesBuffer_" + std::to_string(i), buffer_info,
+          vma_alloc_info);
+      buffer_info.size = MAX_TLAS_LEAF_COUNT * 2 * sizeof(TLASNode);
+      dynamic_tlas_nodes_buffers[i] = p_rm->create_buffer(
+          "DynamicTLASNodesBuffer_" + std::to_string(i), buffer_info,
+          vma_alloc_info);
+    }
+    VkMemoryPropertyFlags memory_flags = 0;
+    vmaGetAllocationMemoryProperties(
+        p_device->vma_allocator,
+        p_rm->access_buffer(dynamic_instances_buffers[0])->vma_allocation,
+        &memory_flags);
+    HINFO("Renderer - Dynamic instances enabled, buffers are in {} memory",
+          (memory_flags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) ? "device-local"
+                                                               : "host");
+    // Every frame's copy is stale
+    dynamic_instances_versions.fill(0);
+    dynamic_tlas_versions.fill(0);
+  } else {
+    for (u32 i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+      p_rm->queue_destroy(
+          {dynamic_instances_buffers[i], p_device->frame_count});
+      p_rm->queue_destroy(
+          {dynamic_tlas_nodes_buffers[i], p_device->frame_count});
+      dynamic_instances_buffers[i] = {};
+      dynamic_tlas_nodes_buffers[i] = {};
+    }
+    // The device-local copies missed every change made in dynamic mode
+    for (const u32 blas_instance_id : blas_instance_ids) {
+      upload_blas_instance(blas_instance_id);
+    }
+    rebuild_tlas = true;
+  }
+}
+
+void Renderer::update_dynamic_instance_buffers() {
+  // The frame's fence has been waited on, nothing reads its slice anymore
+  const u32 frame = p_device->current_frame;
+  if (dynamic_instances_versions[frame] != instances_version) {
+    u32 instance_count = 0;
+    for (const u32 blas_instance_id : blas_instance_ids) {
+      instance_count = std::max(instance_count, blas_instance_id + 1);
+    }
+    std::memcpy(p_rm->access_buffer(dynamic_instances_buffers[frame])->p_data,
+                blas_instances.data(), instance_count * sizeof(BLASInstance));
+    dynamic_instances_versions[frame] = instances_version;
+  }
+  if (dynamic_tlas_versions[frame] != tlas_version) {
+    std::memcpy(p_rm->access_buffer(dynamic_tlas_nodes_buffers[frame])->p_data,
+                tlas_nodes.data(), tlas_upload_node_count * sizeof(TLASNode));
+    dynamic_tlas_versions[frame] = tlas_version;
+  }
+}
+
+VkPipeline
+Renderer::get_path_tracing_pipeline(const PathTracingPermutation &key) {
+  const VulkanPipeline *generic = p_rm->access_pipeline(path_tracing_pipeline);
+  const u64 frame_count = p_device->frame_count;
+  std::erase_if(retired_pipelines, [&](const RetiredPipeline &entry) {
+    if (frame_count - entry.frame_index <= MAX_FRAMES_IN_FLIGHT)
+      return false;
+    vkDestroyPipeline(p_device->vk_device, entry.vk_pipeline, nullptr);
+    return true;
+  });
+  if (!specialize_pipelines)
+    return generic->vk_handle;
+
+  for (PipelinePermutation &entry : pipeline_permutations) {
+    if (!(entry.permutation == key))
+      continue;
+    entry.last_used_frame = frame_count;
+    if (entry.build.valid() && entry.build.wait_for(std::chrono::seconds(0)) ==
+                                   std::future_status::ready) {
+      entry.vk_pipeline = entry.build.get();
+      p_device->set_resource_name<VkPipeline>(
+          VK_OBJECT_TYPE_PIPELINE, entry.vk_pipeline,
+          std::format("PathTracingPipeline_{}_{:x}_{:x}", key.max_depth,
+                      key.material_mask, key.feature_mask));
+      HINFO("Renderer - Specialized pipeline ready, max depth {}, material "
+            "mask {:#x}, feature mask {:#x}",
+            key.max_depth, key.material_mask, key.feature_mask);
+    }
+    return entry.vk_pipeline ? entry.vk_pipeline : generic->vk_handle;
+  }
+
+  if (!(key == unsettled_permutation)) {
+    unsettled_permutation = key;
+    unsettled_frame = frame_count;
+  }
+  if (frame_count - unsettled_frame < PERMUTATION_SETTLE_FRAMES)
+    return generic->vk_handle;
+  if (pipeline_permutations.size() >= MAX_PIPELINE_PERMUTATIONS &&
+      !evict_pipeline_permutation())
+    return generic->vk_handle;
+
+  // Build it on a worker thread, the generic pipeline renders meanwhile
+  PipelinePermutation &entry = pipeline_permutations.emplace_back();
+  entry.permutation = key;
+  entry.last_used_frame = frame_count;
+  entry.build = std::async(
+      std::launch::async, create_specialized_pipeline, p_device->vk_device,
+      p_rm->vk_pipeline_cache,
+      p_rm->access_shader(path_tracing_shader)->vk_handle,
+      generic->vk_pipeline_layout, key);
+  return generic->vk_handle;
+}
+
+bool Renderer::evict_pipeline_permutation() {
+  auto lru = pipeline_permutations.end();
+  for (auto it = pipeline_permutations.begin();
+       it != pipeline_permutations.end(); ++it) {
+    if (it->build.valid()) {
+      if (it->build.wait_for(std::chrono::seconds(0)) !=
+          std::future_status::ready)
+        continue;
+      it->vk_pipeline = it->build.get();
+    }
+    if (lru == pipeline_permutations.end() ||
+        it->last_used_frame < lru->last_used_frame)
+      lru = it;
+  }
+  if (lru == pipeline_permutations.end())
+    return false;
+
+  // Frames in flight may still use it
+  retired_pipelines.push_back({.vk_pipeline = lru->vk_pipeline,
+                               .frame_index = p_device->frame_count});
+  pipeline_permutations.erase(lru);
+  return true;
+}
+
+void Renderer::read_gpu_time() {
+  const u32 frame = p_device->current_frame;
+  if (timestamp_query_pool == VK_NULL_HANDLE || frame_samples[frame] == 0)
+    return;
+
+  // The frame's fence has been waited on, the results are available
+  std::array<u64, 2> timestamps;
+  const VkResult result = vkGetQueryPoolResults(
+      p_device->vk_device, timestamp_query_pool, 2 * frame, 2,
+      sizeof(timestamps), timestamps.data(), sizeof(u64),
+      VK_QUERY_RESULT_64_BIT);
+  const u64 samples = frame_samples[frame];
+  frame_samples[frame] = 0;
+  if (result != VK_SUCCESS || timestamps[1] < timestamps[0])
+    return;
+
+  const f64 time_ns =
+      static_cast<f64>(timestamps[1] - timestamps[0]) *
+      p_device->vk_physical_device_properties.limits.timestampPeriod;
+  gpu_time_ms = static_cast<f32>(time_ns * 1e-6);
+  const f64 cost_ns = time_ns / static_cast<f64>(samples);
+  sample_cost_ns = sample_cost_ns == 0.0
+                       ? cost_ns
+                       : sample_cost_ns + 0.25 * (cost_ns - sample_cost_ns);
+}
+
+void Renderer::plan_dispatches(bool moving, u32 width, u32 height) {
+  tile_dispatches.clear();
+  // Rows of tiles
+  const u32 tile_count = (height + TILE_HEIGHT - 1) / TILE_HEIGHT;
+  const u32 tiles_x = (width + TILE_HEIGHT - 1) / TILE_HEIGHT;
+  render_tile_count = tiles_x * tile_count;
+  next_tile %= tile_count;
+  // Anything that reset the accumulation restarts the pass from the next
+  // tile, so that partial passes keep cycling through the image
+  if (frame_index == 0) {
+    report_path_stats();
+    sample_count = 0;
+    pass_tiles_done = 0;
+    ++accumulation_id;
+    active_tile_count = render_tile_count;
+    converged = false;
+    accumulation_clock.start();
+  }
+
+  // Stop once the last compaction found no tile, or every tile is at the
+  // sample limit
+  read_active_tile_count();
+  if (!converged) {
+    converge_time_s =
+        static_cast<f32>(accumulation_clock.get_elapsed_time_s());
+    converged = sample_count >= max_spp ||
+                (adaptive_sampling && active_tile_count == 0);
+  }
+  if (converged) {
+    dispatches_per_frame = 0;
+    tiles_per_frame = 0;
+    frame_samples[p_device->current_frame] = 0;
+    return;
+  }
+
+  const f64 tile_samples = static_cast<f64>(width) * TILE_HEIGHT;
+  const f64 image_samples = tile_samples * tile_count;
+  // Until a frame is measured a single pass is rendered at 1 spp
+  const f64 budget_ms = moving ? moving_budget_ms : idle_budget_ms;
+  f64 budget_samples = sample_cost_ns > 0.0
+                           ? budget_ms * 1e6 / sample_cost_ns
+                           : image_samples;
+  const bool adaptive = adaptive_sampling && !moving &&
+                        pass_tiles_done == 0 &&
+                        sample_count >= MIN_ADAPTIVE_SPP;
+
+  u64 planned_samples = 0;
+  tiles_per_frame = 0;
+  // Partial passes render tiles at 1 spp until every tile has been rendered
+  if (pass_tiles_done > 0 || (!adaptive && budget_samples < image_samples)) {
+    const u32 budget_tiles = static_cast<u32>(
+        std::clamp(budget_samples / tile_samples, 1.0,
+                   static_cast<f64>(tile_count)));
+    const u32 tiles = std::min(budget_tiles, tile_count - pass_tiles_done);
+    const u32 first_count = std::min(tiles, tile_count - next_tile);
+    tile_dispatches.push_back({.first_tile = next_tile,
+                               .tile_count = first_count,
+                               .sqrt_spp = 1,
+                               .sample_count = sample_count,
+                               .adaptive = false});
+    if (first_count < tiles)
+      tile_dispatches.push_back({.first_tile = 0,
+                                 .tile_count = tiles - first_count,
+                                 .sqrt_spp = 1,
+                                 .sample_count = sample_count,
+                                 .adaptive = false});
+    next_tile = (next_tile + tiles) % tile_count;
+    pass_tiles_done += tiles;
+    tiles_per_frame = tiles * tiles_x;
+    planned_samples += static_cast<u64>(tiles * tile_samples);
+    budget_samples -= tiles * tile_samples;
+    if (pass_tiles_done == tile_count) {
+      pass_tiles_done = 0;
+      ++sample_count;
+    }
+  }
+
+  // Whole image passes with as many samples per dispatch as fit, then more
+  // dispatches while the image converges. Adaptive passes cost the tiles that
+  // were active at the last read back compaction
+  const f64 pass_samples =
+      adaptive ? static_cast<f64>(std::max(active_tile_count, 1u)) *
+                     TILE_HEIGHT * TILE_HEIGHT
+               : image_samples;
+  const f64 pass_spp = budget_samples / pass_samples;
+  if (pass_tiles_done == 0 && (pass_spp >= 1.0 || adaptive)) {
+    const u32 pass_sqrt_spp = std::clamp(
+        static_cast<u32>(std::sqrt(pass_spp)), 1u, MAX_SQRT_SPP);
+    const u32 spp = pass_sqrt_spp * pass_sqrt_spp;
+    const bool converging = convergence_mode && !moving;
+    const u32 max_passes = converging ? max_dispatches_per_frame : 1;
+    const u32 passes = std::clamp(static_cast<u32>(pass_spp / spp), 1u,
+                                  std::max(max_passes, 1u));
+    for (u32 i = 0; i < passes && tile_dispatches.size() < max_passes &&
+                    sample_count < max_spp;
+         ++i) {
+      tile_dispatches.push_back({.first_tile = 0,
+                                 .tile_count = tile_count,
+                                 .sqrt_spp = pass_sqrt_spp,
+                                 .sample_count = sample_count,
+                                 .adaptive = adaptive});
+      sample_count += spp;
+      planned_samples += static_cast<u64>(pass_samples * spp);
+      tiles_per_frame += adaptive ? active_tile_count : render_tile_count;
+    }
+  }
+
+  dispatches_per_frame = static_cast<u32>(tile_dispatches.size());
+  sqrt_spp = tile_dispatches.empty() ? 1 : tile_dispatches.back().sqrt_spp;
+  frame_samples[p_device->current_frame] = planned_samples;
+}
+
+void Renderer::read_active_tile_count() {
+  const u32 frame = p_device->current_frame;
+  if (readback_accumulations[frame] != accumulation_id)
+    return;
+  readback_accumulations[frame] = UINT32_MAX;
+  active_tile_count = *static_cast<const u32 *>(
+      p_rm->access_buffer(tile_count_readback_buffers[frame])->p_data);
+}
+
+void Renderer::resume_accumulation() {
+  converged = false;
+  active_tile_count = render_tile_count;
+}
+
+void Renderer::create_tile_buffers(u32 tile_count) {
+  if (is_handle_valid(tile_errors_buffer)) {
+    p_rm->queue_destroy({tile_errors_buffer, p_device->frame_count});
+    p_rm->queue_destroy({tile_sample_counts_buffer, p_device->frame_count});
+    p_rm->queue_destroy({tile_list_buffer, p_device->frame_count});
+  }
+
+  VmaAllocationCreateInfo vma_alloc_info{
+      .requiredFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT};
+  VkBufferCreateInfo buffer_info{VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
+  buffer_info.usage = VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |
+                      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+  buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  buffer_info.size = tile_count * sizeof(f32);
+  tile_errors_buffer =
+      p_rm->create_buffer("TileErrorsBuffer", buffer_info, vma_alloc_info);
+  buffer_info.size = tile_count * sizeof(u32);
+  tile_sample_counts_buffer = p_rm->create_buffer(
+      "TileSampleCountsBuffer", buffer_info, vma_alloc_info);
+  tile_list_buffer =
+      p_rm->create_buffer("TileListBuffer", buffer_info, vma_alloc_info);
+
+  for (u32 i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+    if (is_handle_valid(reference_error_buffers[i]))
+      p_rm->queue_destroy(
+          {reference_error_buffers[i], p_device->frame_count});
+  }
+  reference_error_readbacks.fill({});
+  buffer_info.size = tile_count * sizeof(f32);
+  vma_alloc_info.requiredFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+  vma_alloc_info.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT;
+  for (u32 i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+    reference_error_buffers[i] = p_rm->create_buffer(
+        "ReferenceErrorBuffer_" + std::to_string(i), buffer_info,
+        vma_alloc_info);
+  }
+
+  for (u32 i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+    if (is_handle_valid(path_stats_buffers[i]))
+      p_rm->queue_destroy({path_stats_buffers[i], p_device->frame_count});
+  }
+  path_stats_readbacks.fill({});
+  // Summed into by the gpu, so they start cleared
+  buffer_info.size = tile_count * 2 * sizeof(u32);
+  for (u32 i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+    path_stats_buffers[i] = p_rm->create_buffer(
+        "PathStatsBuffer_" + std::to_string(i), buffer_info, vma_alloc_info);
+    std::memset(p_rm->access_buffer(path_stats_buffers[i])->p_data, 0,
+                buffer_info.size);
+  }
+}
+
+void Renderer::record_tile_compaction(VkCommandBuffer cmd) {
+  const VulkanBuffer *vk_dispatch_buffer =
+      p_rm->access_buffer(tile_dispatch_buffer);
+
+  // The last path tracing dispatch wrote the errors and read the list and the
+  // indirect arguments
+  VkMemoryBarrier2 barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER_2};
+  barrier.srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT |
+                         VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT |
+                         VK_PIPELINE_STAGE_2_COPY_BIT;
+  barrier.srcAccessMask = VK_ACCESS_2_SHADER_WRITE_BIT;
+  barrier.dstStageMask =
+      VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_2_COPY_BIT;
+  barrier.dstAccessMask = VK_ACCESS_2_SHADER_READ_BIT |
+                          VK_ACCESS_2_SHADER_WRITE_BIT |
+                          VK_ACCESS_2_TRANSFER_WRITE_BIT;
+  VkDependencyInfo dependency_info{VK_STRUCTURE_TYPE_DEPENDENCY_INFO};
+  dependency_info.memoryBarrierCount = 1;
+  dependency_info.pMemoryBarriers = &barrier;
+  vkCmdPipelineBarrier2(cmd, &dependency_info);
+
+  const VkDispatchIndirectCommand empty_dispatch{.x = 0, .y = 1, .z = 1};
+  vkCmdUpdateBuffer(cmd, vk_dispatch_buffer->vk_handle, 0,
+                    sizeof(empty_dispatch), &empty_dispatch);
+  barrier.srcStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+  barrier.srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+  barrier.dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+  barrier.dstAccessMask =
+      VK_ACCESS_2_SHADER_READ_BIT | VK_ACCESS_2_SHADER_WRITE_BIT;
+  vkCmdPipelineBarrier2(cmd, &dependency_info);
+
+  const VulkanPipeline *pipeline =
+      p_rm->access_pipeline(tile_compaction_pipeline);
+  vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline->vk_handle);
+  TileCompactionConstant constant;
+  constant.tile_errors_buffer =
+      p_rm->access_buffer(tile_errors_buffer)->vk_device_address;
+  constant.tile_sample_counts_buffer =
+      p_rm->access_buffer(tile_sample_counts_buffer)->vk_device_address;
+  constant.tile_list_buffer =
+      p_rm->access_buffer(tile_list_buffer)->vk_device_address;
+  constant.tile_dispatch_buffer = vk_dispatch_buffer->vk_device_address;
+  constant.tile_count = render_tile_count;
+  constant.error_threshold = error_threshold;
+  constant.max_spp = max_spp;
+  constant.padding = 0;
+  vkCmdPushConstants(cmd, pipeline->vk_pipeline_layout,
+                     VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                     sizeof(TileCompactionConstant), &constant);
+  vkCmdDispatch(cmd,
+                (render_tile_count + TILE_COMPACTION_GROUP_SIZE - 1) /
+                    TILE_COMPACTION_GROUP_SIZE,
+                1, 1);
+
+  barrier.srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+  barrier.srcAccessMask = VK_ACCESS_2_SHADER_WRITE_BIT;
+  barrier.dstStageMask = VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT |
+                         VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT |
+                         VK_PIPELINE_STAGE_2_COPY_BIT;
+  barrier.dstAccessMask = VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT |
+                          VK_ACCESS_2_SHADER_READ_BIT |
+                          VK_ACCESS_2_TRANSFER_READ_BIT;
+  vkCmdPipelineBarrier2(cmd, &dependency_info);
+
+  // The active tile count is read on the cpu once the frame's fence signals
+  const VkBufferCopy copy{.srcOffset = 0, .dstOffset = 0, .size = sizeof(u32)};
+  vkCmdCopyBuffer(
+      cmd, vk_dispatch_buffer->vk_handle,
+      p_rm->access_buffer(tile_count_readback_buffers[p_device->current_frame])
+          ->vk_handle,
+      1, &copy);
+}
+
+void Renderer::record_reference_capture(VkCommandBuffer cmd) {
+  const VkDeviceSize size = static_cast<VkDeviceSize>(render_extent.width) *
+                            render_extent.height * 4 * sizeof(f32);
+  const VulkanBuffer *old_buffer = p_rm->access_buffer(reference_buffer);
+  if (!old_buffer || old_buffer->vk_device_size < size) {
+    if (old_buffer)
+      p_rm->queue_destroy({reference_buffer, p_device->frame_count});
+    VmaAllocationCreateInfo vma_alloc_info{
+        .requiredFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT};
+    VkBufferCreateInfo buffer_info{VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
+    buffer_info.size = size;
+    buffer_info.usage = VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |
+                        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                        VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    reference_buffer =
+        p_rm->create_buffer("ReferenceBuffer", buffer_info, vma_alloc_info);
+  }
+  reference_extent = render_extent;
+  reference_mse = -1.f;
+  equal_time_mse = {-1.f, -1.f};
+
+  VkMemoryBarrier2 barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER_2};
+  barrier.srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+  barrier.srcAccessMask = VK_ACCESS_2_SHADER_WRITE_BIT;
+  barrier.dstStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+  barrier.dstAccessMask = VK_ACCESS_2_TRANSFER_READ_BIT;
+  VkDependencyInfo dependency_info{VK_STRUCTURE_TYPE_DEPENDENCY_INFO};
+  dependency_info.memoryBarrierCount = 1;
+  dependency_info.pMemoryBarriers = &barrier;
+  vkCmdPipelineBarrier2(cmd, &dependency_info);
+
+  // Tightly packed rows of the render region
+  const VkBufferImageCopy region{
+      .bufferOffset = 0,
+      .bufferRowLength = 0,
+      .bufferImageHeight = 0,
+      .imageSubresource = {.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                           .mipLevel = 0,
+                           .baseArrayLayer = 0,
+                           .layerCount = 1},
+      .imageOffset = {0, 0, 0},
+      .imageExtent = {render_extent.width, render_extent.height, 1}};
+  const VulkanImageView *vk_output_image_view =
+      p_rm->access_image_view(output_image_view);
+  vkCmdCopyImageToBuffer(
+      cmd, p_rm->access_image(vk_output_image_view->image_handle)->vk_handle,
+      VK_IMAGE_LAYOUT_GENERAL, p_rm->access_buffer(reference_buffer)->vk_handle,
+      1, &region);
+
+  // Read by the error dispatches of the next frames
+  barrier.srcStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+  barrier.srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+  barrier.dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+  barrier.dstAccessMask = VK_ACCESS_2_SHADER_READ_BIT;
+  vkCmdPipelineBarrier2(cmd, &dependency_info);
+  HINFO("Renderer - Captured a {}x{} reference at {} spp", render_extent.width,
+        render_extent.height, sample_count);
+}
+
+void Renderer::record_reference_error(VkCommandBuffer cmd) {
+  const u32 frame = p_device->current_frame;
+  VkMemoryBarrier2 barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER_2};
+  barrier.srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+  barrier.srcAccessMask = VK_ACCESS_2_SHADER_WRITE_BIT;
+  barrier.dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+  barrier.dstAccessMask = VK_ACCESS_2_SHADER_READ_BIT;
+  VkDependencyInfo dependency_info{VK_STRUCTURE_TYPE_DEPENDENCY_INFO};
+  dependency_info.memoryBarrierCount = 1;
+  dependency_info.pMemoryBarriers = &barrier;
+  vkCmdPipelineBarrier2(cmd, &dependency_info);
+
+  const VulkanPipeline *pipeline =
+      p_rm->access_pipeline(reference_error_pipeline);
+  vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline->vk_handle);
+  const VkBindDescriptorSetsInfo bind_info{
+      .sType = VK_STRUCTURE_TYPE_BIND_DESCRIPTOR_SETS_INFO,
+      .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+      .layout = pipeline->vk_pipeline_layout,
+      .firstSet = 0,
+      .descriptorSetCount = 1,
+      .pDescriptorSets = &vk_set,
+  };
+  vkCmdBindDescriptorSets2(cmd, &bind_info);
+  ReferenceErrorConstant constant;
+  constant.reference_buffer =
+      p_rm->access_buffer(reference_buffer)->vk_device_address;
+  constant.tile_errors_buffer =
+      p_rm->access_buffer(reference_error_buffers[frame])->vk_device_address;
+  constant.image_width = render_extent.width;
+  constant.image_height = render_extent.height;
+  vkCmdPushConstants(cmd, pipeline->vk_pipeline_layout,
+                     VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                     sizeof(ReferenceErrorConstant), &constant);
+  const u32 tiles_x = (render_extent.width + TILE_HEIGHT - 1) / TILE_HEIGHT;
+  const u32 tiles_y = (render_extent.height + TILE_HEIGHT - 1) / TILE_HEIGHT;
+  vkCmdDispatch(cmd, tiles_x, tiles_y, 1);
+
+  // Read on the cpu once the frame's fence signals
+  barrier.dstStageMask = VK_PIPELINE_STAGE_2_HOST_BIT;
+  barrier.dstAccessMask = VK_ACCESS_2_HOST_READ_BIT;
+  vkCmdPipelineBarrier2(cmd, &dependency_info);
+  reference_error_readbacks[frame] = {
+      .accumulation_id = accumulation_id,
+      .tile_count = tiles_x * tiles_y,
+      .pixel_count =
+          static_cast<u64>(render_extent.width) * render_extent.height,
+      .time_s = static_cast<f32>(accumulation_clock.get_elapsed_time_s()),
+      .next_event_estimation = next_event_estimation};
+}
+
+void Renderer::read_reference_error() {
+  ReferenceErrorReadback &readback =
+      reference_error_readbacks[p_device->current_frame];
+  if (readback.accumulation_id == UINT32_MAX)
+    return;
+  const f32 *p_tile_errors = static_cast<const f32 *>(
+      p_rm->access_buffer(reference_error_buffers[p_device->current_frame])
+          ->p_data);
+  f64 error_sum = 0.0;
+  for (u32 i = 0; i < readback.tile_count; ++i) {
+    error_sum += p_tile_errors[i];
+  }
+  reference_mse = static_cast<f32>(error_sum / readback.pixel_count);
+  reference_mse_time_s = readback.time_s;
+  if (readback.time_s >= equal_time_s &&
+      readback.accumulation_id != equal_time_accumulation) {
+    equal_time_accumulation = readback.accumulation_id;
+    equal_time_mse[readback.next_event_estimation] = reference_mse;
+    HINFO("Renderer - MSE {} after {:.2f}s, next event estimation {}",
+          reference_mse, readback.time_s,
+          readback.next_event_estimation ? "on" : "off");
+  }
+  readback.accumulation_id = UINT32_MAX;
+}
+
+void Renderer::read_path_stats() {
+  const u32 frame = p_device->current_frame;
+  PathStatsReadback &readback = path_stats_readbacks[frame];
+  if (readback.accumulation_id == UINT32_MAX)
+    return;
+  u32 *p_stats = static_cast<u32 *>(
+      p_rm->access_buffer(path_stats_buffers[frame])->p_data);
+  u64 segments = 0;
+  u64 paths = 0;
+  for (u32 i = 0; i < readback.tile_count; ++i) {
+    segments += p_stats[2 * i];
+    paths += p_stats[2 * i + 1];
+  }
+  // The slot's next submission sums from zero
+  std::memset(p_stats, 0, readback.tile_count * 2 * sizeof(u32));
+  const bool current = readback.accumulation_id == accumulation_id;
+  readback.accumulation_id = UINT32_MAX;
+  if (paths == 0)
+    return;
+
+  // gpu_time_ms was read from the same submission
+  path_length = static_cast<f32>(static_cast<f64>(segments) / paths);
+  samples_per_s =
+      gpu_time_ms > 0.f ? static_cast<f32>(paths / (gpu_time_ms * 1e-3)) : 0.f;
+  if (!current)
+    return;
+  accumulation_path_segments += segments;
+  accumulation_paths += paths;
+  accumulation_gpu_time_s += gpu_time_ms * 1e-3;
+  accumulation_depth_settings = readback.depth_settings;
+}
+
+void Renderer::report_path_stats() {
+  if (accumulation_paths > 0 &&
+      accumulation_clock.get_elapsed_time_s() >= MIN_PATH_STATS_REPORT_S) {
+    const PathStatsReport report{
+        .depth_settings = accumulation_depth_settings,
+        .path_length = static_cast<f32>(
+            static_cast<f64>(accumulation_path_segments) / accumulation_paths),
+        .samples_per_s =
+            accumulation_gpu_time_s > 0.0
+                ? static_cast<f32>(accumulation_paths / accumulation_gpu_time_s)
+                : 0.f};
+    const PathDepthSettings &depth = report.depth_settings;
+    HINFO("Renderer - Depth {} (diffuse {}, specular {}, transmission {}), "
+          "roulette from {}: {:.2f} segments per path, {:.1f} M samples/s, "
+          "{:.1f} Mrays/s",
+          depth.max_depth, depth.diffuse_depth, depth.specular_depth,
+          depth.transmission_depth, depth.russian_roulette_depth,
+          report.path_length, report.samples_per_s * 1e-6f,
+          report.path_length * report.samples_per_s * 1e-6f);
+    if (path_stats_reports.size() == MAX_PATH_STATS_REPORTS)
+      path_stats_reports.erase(path_stats_reports.begin());
+    path_stats_reports.push_back(report);
+  }
+  accumulation_path_segments = 0;
+  accumulation_paths = 0;
+  accumulation_gpu_time_s = 0.0;
+}
+
+void Renderer::create_denoiser_buffers() {
+  const VkDeviceSize size = static_cast<VkDeviceSize>(output_extent.width) *
+                            output_extent.height * sizeof(glm::vec4);
+  const VulkanBuffer *old_buffer = p_rm->access_buffer(aov_albedo_buffer);
+  if (old_buffer && old_buffer->vk_device_size >= size)
+    return;
+  if (old_buffer) {
+    p_rm->queue_destroy({aov_albedo_buffer, p_device->frame_count});
+    p_rm->queue_destroy({aov_normal_depth_buffer, p_device->frame_count});
+    for (BufferHandle &handle : denoise_buffers) {
+      p_rm->queue_destroy({handle, p_device->frame_count});
+    }
+  }
+
+  VmaAllocationCreateInfo vma_alloc_info{
+      .requiredFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT};
+  VkBufferCreateInfo buffer_info{VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
+  buffer_info.size = size;
+  buffer_info.usage = VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |
+                      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+  buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  aov_albedo_buffer =
+      p_rm->create_buffer("AOVAlbedoBuffer", buffer_info, vma_alloc_info);
+  aov_normal_depth_buffer =
+      p_rm->create_buffer("AOVNormalDepthBuffer", buffer_info, vma_alloc_info);
+  for (u32 i = 0; i < denoise_buffers.size(); ++i) {
+    denoise_buffers[i] = p_rm->create_buffer(
+        "DenoiseBuffer_" + std::to_string(i), buffer_info, vma_alloc_info);
+  }
+  // The guides are written by the first samples of an accumulation
+  frame_index = 0;
+}
+
+void Renderer::record_denoise(VkCommandBuffer cmd) {
+  push_debug_label(cmd, "Denoise");
+  // The path tracing dispatches wrote the image and the guides
+  VkMemoryBarrier2 barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER_2};
+  barrier.srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+  barrier.srcAccessMask = VK_ACCESS_2_SHADER_WRITE_BIT;
+  barrier.dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+  barrier.dstAccessMask =
+      VK_ACCESS_2_SHADER_READ_BIT | VK_ACCESS_2_SHADER_WRITE_BIT;
+  VkDependencyInfo dependency_info{VK_STRUCTURE_TYPE_DEPENDENCY_INFO};
+  dependency_info.memoryBarrierCount = 1;
+  dependency_info.pMemoryBarriers = &barrier;
+  vkCmdPipelineBarrier2(cmd, &dependency_info);
+
+  DenoiseConstant constant;
+  constant.albedo_buffer =
+      p_rm->access_buffer(aov_albedo_buffer)->vk_device_address;
+  constant.normal_depth_buffer =
+      p_rm->access_buffer(aov_normal_depth_buffer)->vk_device_address;
+  constant.tile_sample_counts_buffer =
+      p_rm->access_buffer(tile_sample_counts_buffer)->vk_device_address;
+  constant.source_buffer = 0;
+  constant.destination_buffer =
+      p_rm->access_buffer(denoise_buffers[0])->vk_device_address;
+  constant.image_width = render_extent.width;
+  constant.image_height = render_extent.height;
+  constant.step_size = 1;
+  constant.last = 0;
+  constant.sigma_luminance = denoiser_settings.sigma_luminance;
+  constant.sigma_normal = denoiser_settings.sigma_normal;
+  constant.sigma_depth = denoiser_settings.sigma_depth;
+  constant.padding = 0;
+  const u32 groups_x =
+      (render_extent.width + DENOISE_GROUP_SIZE - 1) / DENOISE_GROUP_SIZE;
+  const u32 groups_y =
+      (render_extent.height + DENOISE_GROUP_SIZE - 1) / DENOISE_GROUP_SIZE;
+
+  const VulkanPipeline *pipeline =
+      p_rm->access_pipeline(denoise_prepare_pipeline);
+  const VkBindDescriptorSetsInfo bind_info{
+      .sType = VK_STRUCTURE_TYPE_BIND_DESCRIPTOR_SETS_INFO,
+      .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+      .layout = pipeline->vk_pipeline_layout,
+      .firstSet = 0,
+      .descriptorSetCount = 1,
+      .pDescriptorSets = &vk_set,
+  };
+  vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline->vk_handle);
+  vkCmdBindDescriptorSets2(cmd, &bind_info);
+  vkCmdPushConstants(cmd, pipeline->vk_pipeline_layout,
+                     VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(DenoiseConstant),
+                     &constant);
+  vkCmdDispatch(cmd, groups_x, groups_y, 1);
+
+  // Each iteration reads the last one's output
+  pipeline = p_rm->access_pipeline(denoise_filter_pipeline);
+  vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline->vk_handle);
+  const u32 iterations = std::max(denoiser_settings.iterations, 1u);
+  for (u32 i = 0; i < iterations; ++i) {
+    vkCmdPipelineBarrier2(cmd, &dependency_info);
+    constant.source_buffer =
+        p_rm->access_buffer(denoise_buffers[i % 2])->vk_device_address;
+    constant.destination_buffer =
+        p_rm->access_buffer(denoise_buffers[(i + 1) % 2])->vk_device_address;
+    constant.step_size = 1u << i;
+    constant.last = i + 1 == iterations;
+    vkCmdPushConstants(cmd, pipeline->vk_pipeline_layout,
+                       VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(DenoiseConstant),
+                       &constant);
+    vkCmdDispatch(cmd, groups_x, groups_y, 1);
+  }
+  pop_debug_label(cmd);
+}
+
 } // namespace hlx
@@ -1,37 +1,135 @@
 #pragma once
 #include "BVHNode.hpp"
 #include "Camera.hpp"
+#include "Core/Clock.hpp"
 #include "Core/FreeIndexPool.hpp"
 #include "Core/TlsfAllocator.hpp"
+#include "LightList.hpp"
 #include "Material.hpp"
 #include "TLAS.hpp"
 #include "Triangle.hpp"
 #include "Vulkan/VkResources.hpp"
 #include "Vulkan/VkStagingBuffer.h"
 // Vendor
+#include <future>
 #include <glm/fwd.hpp>
 
 namespace hlx {
 struct VkDeviceManager;
 struct VkResourceManager;
 
+// Specialization constants of the path tracing pipeline, in constant_id order
+struct PathTracingPermutation {
+  u32 max_depth;
+  // Bit per MaterialType the shader handles
+  u32 material_mask;
+  // PathTracingFeature bits the shader handles
+  u32 feature_mask;
+
+  bool operator==(const PathTracingPermutation &other) const = default;
+};
+
+// Integrator features a permutation can compile out, the push constants still
+// switch them off in a permutation that has them
+enum PathTracingFeature : u32 {
+  NEXT_EVENT_ESTIMATION = 1u << 0,
+  RUSSIAN_ROULETTE = 1u << 1,
+  DENOISER_AOVS = 1u << 2,
+};
+
+// Sequence the path samples are drawn from, see Sampler.slang
+enum class SamplerType : u32 { WANG_HASH, OWEN_SOBOL };
+
+// How next event estimation picks an emissive triangle, proportionally to its
+// power from the alias table, or by its importance to the shading point from
+// the light BVH
+enum class LightSampling : u32 { POWER, LIGHT_BVH };
+
+// Bounce limits of a path. max_depth bounds the whole path and is a
+// specialization constant of the permutations, the others bound the diffuse,
+// specular and refracted bounces. From russian_roulette_depth bounces on, paths
+// are continued with a probability that follows their throughput, 0 disables
+// Russian roulette
+struct PathDepthSettings {
+  u32 max_depth{8};
+  u32 diffuse_depth{4};
+  u32 specular_depth{8};
+  u32 transmission_depth{8};
+  u32 russian_roulette_depth{3};
+
+  bool operator==(const PathDepthSettings &other) const = default;
+};
+
+// Means over an accumulation rendered with the depth settings
+struct PathStatsReport {
+  PathDepthSettings depth_settings;
+  // Ray segments per path, shadow rays excluded
+  f32 path_length;
+  // Paths per second of GPU time, 0 without timestamps
+  f32 samples_per_s;
+};
+
+// Edge-avoiding a-trous filter over the accumulated image, guided by the
+// albedo, normal and distance of the first hits and by the variance of each
+// pixel, see Denoise.slang. The fullscreen pass shows the denoised image while
+// it is enabled
+struct DenoiserSettings {
+  bool enabled{false};
+  // Filter passes, the taps of pass i are 2^i pixels apart
+  u32 iterations{5};
+  // Edge stopping on the luminance in standard deviations, on the normal as
+  // a cosine exponent, and on the distance in expected changes across a pixel
+  f32 sigma_luminance{4.f};
+  f32 sigma_normal{128.f};
+  f32 sigma_depth{1.f};
+
+  bool operator==(const DenoiserSettings &other) const = default;
+};
+
+struct ResolutionSettings {
+  // Render resolution relative to the window while the camera moves and once
+  // it has been still for a few frames. Above 1 supersamples
+  f32 moving_scale{0.5f};
+  f32 idle_scale{1.f};
+  // Renders at fixed_width x fixed_height whatever the window size
+  bool fixed{false};
+  u32 fixed_width{7680};
+  u32 fixed_height{4320};
+
+  bool operator==(const ResolutionSettings &other) const = default;
+};
+
 struct Renderer {
 public:
   void init(VkDeviceManager *p_device, VkResourceManager *p_rm,
             u32 output_image_width, u32 output_image_height);
   void shutdown();
-  void resize(u32 output_image_width, u32 output_image_height);
+  // Recreates the output image for the window size and resolution settings
+  void resize(u32 window_width, u32 window_height);
   void render(Camera &camera);
   void create_output_image(u32 width, u32 height);
 
+  // Constant colour, no texture is created
   MaterialHandle add_lambert_material(const glm::vec3 &albedo);
+  // The texture is multiplied by albedo, white if it is omitted
   MaterialHandle add_lambert_material(std::string_view file_path);
+  MaterialHandle add_lambert_material(std::string_view file_path,
+                                      const glm::vec3 &albedo);
   MaterialHandle add_lambert_material(i32 width, i32 height, u8 *pixels);
+  MaterialHandle add_lambert_material(i32 width, i32 height, u8 *pixels,
+                                      const glm::vec3 &albedo);
+  MaterialHandle add_lambert_material(const glm::vec3 &albedo,
+                                      const LambertTextureRegion &region);
+  // Small textures are packed into shared atlas pages, see
+  // LambertManager::add_textures()
+  std::vector<LambertTextureRegion>
+  add_lambert_textures(std::span<const LambertTextureSource> sources);
   MaterialHandle add_metal_material(const glm::vec3 &albedo, const f32 fuzz);
   MaterialHandle add_dielectric_material(const f32 refractive_index);
   MaterialHandle add_emissive_material(const glm::vec3 &intensity);
   void remove_material(const MaterialHandle &material_handle);
 
+  // Returns INVALID_BLAS if the geometry pools cannot fit the mesh
   u32 add_blas(std::span<glm::vec3> positions, std::span<glm::vec3> normals,
                std::span<glm::vec2> uvs, std::span<u32> indices);
   u32 add_blas_instance(u32 blas_index, const glm::mat4 &transform,
@@ -42,17 +140,41 @@ public:
   void remove_blas(u32 blas_id);
   void remove_blas_instance(u32 blas_instance_id);
 
+  // Triggers a TLAS rebuild
+  void set_tlas_build_settings(const TLASBuildSettings &settings);
+  // Keeps the blas instances and TLAS nodes in persistently mapped buffers,
+  // one per frame in flight, that are written directly instead of staged
+  void set_dynamic_instances(bool enable);
+  // The output image is resized by the next resize() call, which the caller
+  // makes once the device is idle
+  void set_resolution_settings(const ResolutionSettings &settings);
+  bool is_output_image_outdated() const { return output_image_outdated; }
+  // Continues a converged accumulation, after its stop condition was raised
+  void resume_accumulation();
+  // True while the camera and scene are unchanged and frames only add samples
+  bool is_converging() const { return convergence_mode && frame_index > 0; }
+  // Copies the next frame's image as the reference of the error measurements
+  void capture_reference() { reference_capture_pending = true; }
+  bool has_reference() const { return is_handle_valid(reference_buffer); }
+
 public:
   VkDeviceManager *p_device{nullptr};
   VkResourceManager *p_rm{nullptr};
   VkStagingBuffer staging_buffer;
   ImageViewHandle output_image_view;
+  // Written by the denoiser, same size and format as the output image
+  ImageViewHandle denoised_image_view;
+  // Size of the output image, and of its top left region that is rendered
+  VkExtent2D output_extent{};
+  VkExtent2D render_extent{};
+  ResolutionSettings resolution_settings;
   PipelineHandle path_tracing_pipeline;
   SetLayoutHandle set_layout;
   VkDescriptorSet vk_set;
   std::array<BufferHandle, MAX_FRAMES_IN_FLIGHT> uniform_buffers;
-  BufferHandle triangle_geom_buffer;
-  BufferHandle triangle_shading_buffer;
+  BufferHandle vertex_positions_buffer;
+  BufferHandle vertex_shading_buffer;
+  BufferHandle triangle_indices_buffer;
   BufferHandle tlas_nodes_buffer;
   BufferHandle bvh_nodes_buffer;
   BufferHandle blas_buffer;
@@ -73,32 +195,319 @@ public:
 
   MaterialHandle default_material;
 
+  TLASBuildSettings tlas_settings;
+  bool dynamic_instances{false};
+
+  // Changing it restarts the accumulation
+  PathDepthSettings depth_settings;
+  // Enabling it restarts the accumulation, whose first samples write the
+  // denoiser's guides
+  DenoiserSettings denoiser_settings;
+  // Changing it restarts the accumulation
+  SamplerType sampler_type{SamplerType::OWEN_SOBOL};
+  // Diffuse hits sample an emissive triangle, weighted against the BSDF
+  // sampled hits with multiple importance sampling. Changing it restarts the
+  // accumulation
+  bool next_event_estimation{true};
+  LightSampling light_sampling{LightSampling::LIGHT_BVH};
+  // Emissive triangles in the light list
+  u32 light_count{0};
+  // Last frame's path length and throughput, and the means of past
+  // accumulations that ran for a while, the most recent last
+  f32 path_length{0.f};
+  f32 samples_per_s{0.f};
+  std::vector<PathStatsReport> path_stats_reports;
+  // Renders with pipelines specialized to max_depth and the material types in
+  // the scene once they have been built
+  bool specialize_pipelines{true};
+
+  // GPU time of the path tracing dispatches per frame. Samples per dispatch,
+  // the dispatch count and the rendered tiles are scaled to the budget from
+  // timestamps of earlier frames
+  f32 moving_budget_ms{16.f};
+  f32 idle_budget_ms{33.f};
+  // While the image converges, several accumulation dispatches are recorded
+  // per frame, up to max_dispatches_per_frame
+  bool convergence_mode{true};
+  u32 max_dispatches_per_frame{32};
+  // Last frame's plan and measured time, for display
+  u32 dispatches_per_frame{1};
+  u32 sqrt_spp{1};
+  u32 tiles_per_frame{0};
+  f32 gpu_time_ms{0.f};
+  // Samples per pixel in the output image, the most any tile has once
+  // sampling is adaptive
+  u32 sample_count{0};
+
+  // Once every tile has a few samples, only the tiles whose relative error is
+  // above error_threshold are traced, from a tile list compacted on the gpu.
+  // Accumulation stops when no tile is left or all have max_spp samples
+  bool adaptive_sampling{true};
+  f32 error_threshold{0.02f};
+  u32 max_spp{4096};
+  // Tiles left after the last compaction that was read back
+  u32 active_tile_count{0};
+  u32 render_tile_count{0};
+  bool converged{false};
+  f32 converge_time_s{0.f};
+
+  // Mean squared error of the accumulation against the captured reference,
+  // -1 until measured. equal_time_mse is the first error measured after
+  // equal_time_s of accumulation, without and with next event estimation
+  f32 equal_time_s{5.f};
+  f32 reference_mse{-1.f};
+  f32 reference_mse_time_s{0.f};
+  std::array<f32, 2> equal_time_mse{-1.f, -1.f};
+
+  bool compaction_enabled{true};
+  // Upper bound of geometry bytes relocated per frame. A single range larger
+  // than this is still moved, on its own frame
+  size_t compaction_bytes_per_frame{hmega(4)};
+
 private:
+  // Returns the permutation's pipeline, or the generic one while it is built
+  // on a worker thread
+  VkPipeline get_path_tracing_pipeline(const PathTracingPermutation &key);
+  // Retires the least recently used permutation with no build in flight,
+  // false if there is none
+  bool evict_pipeline_permutation();
+  // Reads the path tracing time of this frame slot's last submission
+  void read_gpu_time();
+  // Reads the active tile count of this frame slot's last compaction
+  void read_active_tile_count();
+  // Per tile buffers for the output image's tile count
+  void create_tile_buffers(u32 tile_count);
+  void record_tile_compaction(VkCommandBuffer cmd);
+  // Copies the render region into the reference buffer
+  void record_reference_capture(VkCommandBuffer cmd);
+  // Sums the squared error per tile against the reference
+  void record_reference_error(VkCommandBuffer cmd);
+  void read_reference_error();
+  // Reads the path stats of this frame slot's last submission
+  void read_path_stats();
+  // Records the finished accumulation's path stats and starts new sums
+  void report_path_stats();
+  // Points the path tracing set at the output and denoised images
+  void update_output_image_set();
+  // Guide and filter buffers for the output image's pixel count
+  void create_denoiser_buffers();
+  void record_denoise(VkCommandBuffer cmd);
+  // Splits this frame's sample budget into tile dispatches
+  void plan_dispatches(bool moving, u32 width, u32 height);
+
+  // Output image size for the window and resolution settings
+  VkExtent2D get_output_extent() const;
+  // Render region for the current motion state
+  VkExtent2D get_render_extent() const;
+
   void load_sphere_data();
   void load_cube_data();
   void load_plane_data();
   void build_tlas();
+  // Lists the triangles of the traced emissive instances, weighted by world
+  // area times the luminance of their emission, and bounds them in the light
+  // BVH
+  void build_light_list();
+  TriangleMesh get_triangle_mesh();
+
+  // Stage the cpu copies, or mark the per-frame copies stale in dynamic mode
+  void upload_blas_instance(u32 blas_instance_id);
+  void upload_tlas_nodes(u32 node_count);
+  // Refreshes the current frame's dynamic buffers if they are stale
+  void update_dynamic_instance_buffers();
+
+  // Allocates from a geometry pool, growing the pool and its GPU mirrors if
+  // it is full
+  void *allocate_geometry(TlsfAllocator &allocator, size_t size,
+                          size_t alignment);
+  // Grows the GPU buffers and parallel CPU arrays to the pools' capacities
+  void resize_geometry_buffers();
+  // Replaces buffer with a larger one, copying its contents on the gpu
+  void grow_buffer(BufferHandle &buffer, std::string_view name, size_t size);
+
+  // Queues a geometry range upload for a blas whose instances stay out of the
+  // TLAS until all of its streams have finished
+  void stream_geometry(u32 blas_id, BufferHandle buffer, size_t dst_offset,
+                       size_t size, const void *p_data);
+  void stream_geometry(u32 blas_id, BufferHandle buffer, size_t dst_offset,
+                       size_t size, VkStagingBuffer::StreamReadFn read);
+
+  // Frees geometry ranges once no frame in flight can reference them
+  void free_geometry(TlsfAllocator &allocator, void *p_allocation);
+  void release_pending_geometry_frees(bool release_all);
+
+  // Incremental defragmentation of the geometry pools. Each step moves the
+  // highest live BLAS range of a pool into a lower free block and returns the
+  // number of bytes moved, 0 if nothing was moved
+  void compact_geometry();
+  size_t compact_bvh_nodes();
+  size_t compact_tri_ids();
+  size_t compact_vertices();
 
 private:
   struct BLAS_Allocation {
     void *tri_id_allocation;
+    void *vertex_allocation;
     void *bvh_nodes_allocation;
+    u32 vertex_count;
+    // Streamed uploads still in flight, see stream_geometry()
+    u32 pending_stream_count{0};
+    std::vector<u64> stream_ids;
   };
 
+  struct PipelinePermutation {
+    PathTracingPermutation permutation;
+    std::future<VkPipeline> build;
+    VkPipeline vk_pipeline{VK_NULL_HANDLE};
+    u64 last_used_frame{0};
+  };
+
+  struct RetiredPipeline {
+    VkPipeline vk_pipeline;
+    u64 frame_index;
+  };
+
+  struct PendingGeometryFree {
+    TlsfAllocator *p_allocator;
+    void *p_allocation;
+    u64 frame_index;
+  };
+
+  u32 find_highest_allocation(void *BLAS_Allocation::*allocation);
+
   // Tracks how many blas instances are using a blas
   std::vector<u32> blas_use_count;
 
   // NOTE: This is only used for creating bvh_nodes
-  glm::vec3 *triangle_centroids_data;
+  glm::vec3 *triangle_centroids_data{nullptr};
 
-  // CPU-side triangle data uploaded to the gpu
-  TriangleGeom *tri_geom_data;
-  TriangleShading *tri_surface_data;
+  // CPU-side vertex data uploaded to the gpu. Vertex positions live in the
+  // vertex_allocator's memory, vertex_shading_data is indexed in parallel
+  TlsfAllocator vertex_allocator;
+  VertexShading *vertex_shading_data{nullptr};
+
+  // CPU-side triangle data uploaded to the gpu, indexed by tri id
+  TriangleIndices *tri_indices_data{nullptr};
   TlsfAllocator tri_id_allocator;
 
+  // Element capacities of the parallel arrays and GPU buffers
+  size_t vertex_capacity{0};
+  size_t triangle_capacity{0};
+
   // CPU-side acceleration structure data uploaded to the gpu
   TlsfAllocator bvh_nodes_allocator;
   std::unordered_map<u32, BLAS_Allocation> blas_allocations_map;
+  std::vector<PendingGeometryFree> pending_geometry_frees;
+  // Kept for the permutations, which share the generic pipeline's layout
+  ShaderHandle path_tracing_shader;
+  std::vector<PipelinePermutation> pipeline_permutations;
+  // Destroyed once no frame in flight can use them
+  std::vector<RetiredPipeline> retired_pipelines;
+  // Last permutation without a pipeline, built once it has been used for
+  // PERMUTATION_SETTLE_FRAMES frames
+  PathTracingPermutation unsettled_permutation{};
+  u64 unsettled_frame{0};
+
+  // Rows of TILE_HEIGHT pixels dispatched together. A pass renders every tile
+  // once with the same sample count, over one or several frames when the
+  // budget is below a full image
+  struct TileDispatch {
+    u32 first_tile;
+    u32 tile_count;
+    u32 sqrt_spp;
+    // Samples per pixel accumulated before the dispatch
+    u32 sample_count;
+    // Traces the compacted tile list instead of the tile rows
+    bool adaptive;
+  };
+  std::vector<TileDispatch> tile_dispatches;
+  u32 next_tile{0};
+  u32 pass_tiles_done{0};
+  // Begin and end timestamps per frame in flight, null if unsupported
+  VkQueryPool timestamp_query_pool{VK_NULL_HANDLE};
+  // Pixel samples traced by the last submission of each frame slot
+  std::array<u64, MAX_FRAMES_IN_FLIGHT> frame_samples{};
+  // Smoothed GPU cost of a pixel sample, 0 until measured
+  f64 sample_cost_ns{0.0};
+  // The image is cleared on first use, afterwards a pass overwrites it
+  bool output_image_cleared{false};
+  bool output_image_outdated{false};
+
+  PipelineHandle tile_compaction_pipeline;
+  BufferHandle tile_errors_buffer;
+  BufferHandle tile_sample_counts_buffer;
+  BufferHandle tile_list_buffer;
+  // VkDispatchIndirectCommand over the compacted tile list
+  BufferHandle tile_dispatch_buffer;
+  // Copies of the compacted tile count, read on the cpu
+  std::array<BufferHandle, MAX_FRAMES_IN_FLIGHT> tile_count_readback_buffers;
+  // Accumulation each readback belongs to, UINT32_MAX if none
+  std::array<u32, MAX_FRAMES_IN_FLIGHT> readback_accumulations;
+  // Incremented whenever the accumulation restarts
+  u32 accumulation_id{0};
+  Clock accumulation_clock;
+
+  PipelineHandle reference_error_pipeline;
+  // Render region of the reference image, tightly packed rgba floats
+  BufferHandle reference_buffer;
+  VkExtent2D reference_extent{};
+  bool reference_capture_pending{false};
+  // Squared error sum per tile, written by the gpu and read on the cpu
+  std::array<BufferHandle, MAX_FRAMES_IN_FLIGHT> reference_error_buffers;
+  struct ReferenceErrorReadback {
+    u32 accumulation_id{UINT32_MAX};
+    u32 tile_count;
+    u64 pixel_count;
+    f32 time_s;
+    bool next_event_estimation;
+  };
+  std::array<ReferenceErrorReadback, MAX_FRAMES_IN_FLIGHT>
+      reference_error_readbacks;
+  // Accumulation whose equal time error has been recorded
+  u32 equal_time_accumulation{UINT32_MAX};
+
+  // Ray segments and paths per tile, summed by the gpu and cleared by the cpu
+  // once read
+  std::array<BufferHandle, MAX_FRAMES_IN_FLIGHT> path_stats_buffers;
+  struct PathStatsReadback {
+    u32 accumulation_id{UINT32_MAX};
+    u32 tile_count;
+    PathDepthSettings depth_settings;
+  };
+  std::array<PathStatsReadback, MAX_FRAMES_IN_FLIGHT> path_stats_readbacks;
+  // Sums over the current accumulation's frames that were read back
+  u64 accumulation_path_segments{0};
+  u64 accumulation_paths{0};
+  f64 accumulation_gpu_time_s{0.0};
+  PathDepthSettings accumulation_depth_settings;
+
+  PipelineHandle denoise_prepare_pipeline;
+  PipelineHandle denoise_filter_pipeline;
+  // Albedo, normal and distance of the first hits, created once the denoiser
+  // is enabled
+  BufferHandle aov_albedo_buffer;
+  BufferHandle aov_normal_depth_buffer;
+  // Demodulated illumination and variance, filtered back and forth
+  std::array<BufferHandle, 2> denoise_buffers;
+  // The denoised image is sampled between frames and keeps its last result
+  // until samples are added or the settings change
+  VkImageLayout denoised_image_layout{VK_IMAGE_LAYOUT_UNDEFINED};
+  bool denoised_image_current{false};
+  DenoiserSettings denoised_settings;
+
+  std::vector<LightTriangle> light_triangles;
+  // First light of each blas instance, INVALID_LIGHT if it is not in the list.
+  // An instance's triangles are listed in order
+  std::vector<u32> instance_first_lights;
+  // Rebuilt when the listed lights change, refit when they only move
+  std::vector<LightBVHNode> light_bvh_nodes;
+  BufferHandle light_triangles_buffer;
+  BufferHandle instance_first_lights_buffer;
+  BufferHandle light_bvh_nodes_buffer;
+  bool rebuild_lights{false};
+  VkExtent2D window_extent{};
+  // Frames since the camera last moved
+  u32 still_frames{0};
   FreeIndexPool blases_index_pool;
   std::vector<BLAS> blases;
   std::unordered_set<u32> blas_instance_ids;
@@ -108,6 +517,15 @@ private:
 
   u32 bvh_nodes_size{0};
   TLAS tlas;
+  u32 tlas_upload_node_count{0};
+
+  std::array<BufferHandle, MAX_FRAMES_IN_FLIGHT> dynamic_instances_buffers;
+  std::array<BufferHandle, MAX_FRAMES_IN_FLIGHT> dynamic_tlas_nodes_buffers;
+  // Versions of the cpu arrays and of each frame's copy of them
+  u64 instances_version{1};
+  u64 tlas_version{1};
+  std::array<u64, MAX_FRAMES_IN_FLIGHT> dynamic_instances_versions{};
+  std::array<u64, MAX_FRAMES_IN_FLIGHT> dynamic_tlas_versions{};
 
   bool rebuild_tlas{false};
 };
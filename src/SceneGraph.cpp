@@ -5,6 +5,7 @@
 #include "Platform/FileIO.h"
 #include "Renderer.hpp"
 #include "Transform.hpp"
+#include "Vulkan/VkDeviceManager.h"
 // Vendor
 #include <fastgltf/core.hpp>
 #include <fastgltf/math.hpp>
@@ -39,11 +40,13 @@ static glm::mat4 gltf_get_matrix4x4(const fastgltf::math::fmat4x4 &m) {
                    m[3][0], m[3][1], m[3][2], m[3][3]);
 }
 
-static MaterialHandle gltf_load_texture(Renderer *renderer,
-                                        fastgltf::Asset &asset,
-                                        fastgltf::Texture &texture,
-                                        std::string_view texture_path) {
-  MaterialHandle material_handle;
+// Returns RGBA8 pixels to be released with stbi_image_free(), nullptr if the
+// image type is not supported
+static u8 *gltf_load_texture(fastgltf::Asset &asset,
+                             fastgltf::Texture &texture,
+                             std::string_view texture_path, i32 &width,
+                             i32 &height) {
+  u8 *texture_pixels = nullptr;
   fastgltf::Image &image = asset.images[texture.imageIndex.value()];
 
   std::visit(
@@ -71,9 +74,9 @@ static MaterialHandle gltf_load_texture(Renderer *renderer,
                 &channel_count, STBI_rgb_alpha);
             HASSERT(pixels);
 
-            material_handle = renderer->add_lambert_material(
-                texture_width, texture_height, pixels);
-            stbi_image_free(pixels);
+            texture_pixels = pixels;
+            width = texture_width;
+            height = texture_height;
           },
           [&](fastgltf::sources::URI &filePath) {
             HASSERT_MSG(
@@ -86,8 +89,14 @@ static MaterialHandle gltf_load_texture(Renderer *renderer,
                 "Gltf filePath.uri is not local"); // We're only capable of
                                                    // loading local files.
 
-            material_handle = renderer->add_lambert_material(
-                std::string(texture_path) + "\\" + filePath.uri.c_str());
+            const std::string file_path =
+                std::string(texture_path) + "\\" + filePath.uri.c_str();
+            i32 channel_count;
+            stbi_set_flip_vertically_on_load(false);
+            texture_pixels = stbi_load(file_path.c_str(), &width, &height,
+                                       &channel_count, STBI_rgb_alpha);
+            HASSERT_MSGS(texture_pixels, "Failed to load image: {}",
+                         file_path);
           },
           [&](fastgltf::sources::BufferView &view) {
             auto &bufferView = asset.bufferViews[view.bufferViewIndex];
@@ -124,10 +133,9 @@ static MaterialHandle gltf_load_texture(Renderer *renderer,
                           &channel_count, STBI_rgb_alpha);
                       HASSERT(pixels);
 
-                      material_handle = renderer->add_lambert_material(
-                          texture_width, texture_height, pixels);
-
-                      stbi_image_free(pixels);
+                      texture_pixels = pixels;
+                      width = texture_width;
+                      height = texture_height;
                     },
                     [&](fastgltf::sources::Vector &vector) {
                       i32 texture_width, texture_height;
@@ -152,17 +160,16 @@ static MaterialHandle gltf_load_texture(Renderer *renderer,
                           &channel_count, STBI_rgb_alpha);
                       HASSERT(pixels);
 
-                      material_handle = renderer->add_lambert_material(
-                          texture_width, texture_height, pixels);
-
-                      stbi_image_free(pixels);
+                      texture_pixels = pixels;
+                      width = texture_width;
+                      height = texture_height;
                     }},
                 buffer.data);
           },
       },
       image.data);
 
-  return material_handle;
+  return texture_pixels;
 }
 
 static bool load_gltf_scene(SceneGraph &scene_graph, Renderer *renderer,
@@ -195,30 +202,52 @@ static bool load_gltf_scene(SceneGraph &scene_graph, Renderer *renderer,
     return false;
   }
 
+  // Decode the base colour images, each once. They are added together so
+  // that small ones share atlas pages
+  std::vector<i32> image_sources(asset->images.size(), -1);
+  std::vector<LambertTextureSource> texture_sources;
+  for (const fastgltf::Material &material : asset->materials) {
+    if (!material.pbrData.baseColorTexture.has_value())
+      continue;
+    fastgltf::Texture &texture =
+        asset->textures[material.pbrData.baseColorTexture->textureIndex];
+    i32 &source = image_sources[texture.imageIndex.value()];
+    if (source != -1)
+      continue;
+    i32 width, height;
+    u8 *pixels = gltf_load_texture(asset.get(), texture, path, width, height);
+    if (!pixels)
+      continue;
+    source = static_cast<i32>(texture_sources.size());
+    texture_sources.push_back(
+        {.width = width, .height = height, .pixels = pixels});
+  }
+  const std::vector<LambertTextureRegion> texture_regions =
+      renderer->add_lambert_textures(texture_sources);
+  for (const LambertTextureSource &source : texture_sources) {
+    stbi_image_free(const_cast<u8 *>(source.pixels));
+  }
+
   // Load materials
   std::vector<MaterialHandle> material_handles(asset->materials.size());
   for (size_t i = 0; i < asset->materials.size(); ++i) {
     fastgltf::Material &material = asset->materials[i];
 
+    // Untextured materials with the same factor share one material
+    f32 *albedo_colour = material.pbrData.baseColorFactor.data();
+    const glm::vec3 albedo(albedo_colour[0], albedo_colour[1],
+                           albedo_colour[2]);
+    i32 source = -1;
     if (material.pbrData.baseColorTexture.has_value()) {
-      material_handles[i] = gltf_load_texture(
-          renderer, asset.get(),
-          asset->textures[material.pbrData.baseColorTexture.value()
-                              .textureIndex],
-          path);
+      const fastgltf::Texture &texture =
+          asset->textures[material.pbrData.baseColorTexture->textureIndex];
+      source = image_sources[texture.imageIndex.value()];
+    }
+    if (source != -1) {
+      material_handles[i] =
+          renderer->add_lambert_material(albedo, texture_regions[source]);
     } else {
-      u8 def_colour[4];
-      f32 *albedo_colour = material.pbrData.baseColorFactor.data();
-      def_colour[0] =
-          static_cast<u8>(std::clamp(albedo_colour[0], 0.0f, 1.0f) * 255.0f);
-      def_colour[1] =
-          static_cast<u8>(std::clamp(albedo_colour[1], 0.0f, 1.0f) * 255.0f);
-      def_colour[2] =
-          static_cast<u8>(std::clamp(albedo_colour[2], 0.0f, 1.0f) * 255.0f);
-      def_colour[3] =
-          static_cast<u8>(std::clamp(albedo_colour[3], 0.0f, 1.0f) * 255.0f);
-
-      material_handles[i] = renderer->add_lambert_material(1, 1, def_colour);
+      material_handles[i] = renderer->add_lambert_material(albedo);
     }
   }
 
@@ -386,6 +415,8 @@ static bool load_gltf_scene(SceneGraph &scene_graph, Renderer *renderer,
         }
         u32 blas_id =
             renderer->add_blas(positions, normals, tex_coords, indices);
+        if (blas_id == INVALID_BLAS)
+          continue;
 
         // TODO: Right now just using the first lambert material
         MaterialHandle mat_handle =
@@ -860,7 +891,16 @@ void render_materials_window(Renderer *renderer,
           selected_material.type == MaterialType::LAMBERT) {
         Lambert &mat =
             renderer->lambert_mats.materials[selected_material.index];
-        ImGui::Text("Image View Index: %d", mat.index);
+        ImGui::Text("Albedo: %.3f, %.3f, %.3f", mat.albedo[0], mat.albedo[1],
+                    mat.albedo[2]);
+        if (mat.texture_index != INVALID_TEXTURE_INDEX) {
+          ImGui::Text("Texture Index: %d", mat.texture_index);
+          ImGui::Text("UV Scale: %.3f, %.3f Offset: %.3f, %.3f",
+                      mat.uv_scale_offset[0], mat.uv_scale_offset[1],
+                      mat.uv_scale_offset[2], mat.uv_scale_offset[3]);
+        } else {
+          ImGui::Text("Texture Index: None");
+        }
       }
       ImGui::SeparatorText("");
       const char *albedo_types[] = {"Vec3", "File"};
@@ -993,4 +1033,256 @@ void render_materials_window(Renderer *renderer,
   ImGui::End();
 }
 
+void render_renderer_settings_window(Renderer *renderer) {
+  ImGui::Begin("Renderer Settings");
+
+  ImGui::SeparatorText("Path Tracing");
+  PathDepthSettings &depth = renderer->depth_settings;
+  const PathDepthSettings previous_depth = depth;
+  i32 max_depth = static_cast<i32>(depth.max_depth);
+  if (ImGui::SliderInt("Max Depth", &max_depth, 1, 32))
+    depth.max_depth = static_cast<u32>(max_depth);
+  i32 diffuse_depth = static_cast<i32>(depth.diffuse_depth);
+  if (ImGui::SliderInt("Diffuse Depth", &diffuse_depth, 0, 32))
+    depth.diffuse_depth = static_cast<u32>(diffuse_depth);
+  i32 specular_depth = static_cast<i32>(depth.specular_depth);
+  if (ImGui::SliderInt("Specular Depth", &specular_depth, 0, 32))
+    depth.specular_depth = static_cast<u32>(specular_depth);
+  i32 transmission_depth = static_cast<i32>(depth.transmission_depth);
+  if (ImGui::SliderInt("Transmission Depth", &transmission_depth, 0, 32))
+    depth.transmission_depth = static_cast<u32>(transmission_depth);
+  i32 roulette_depth = static_cast<i32>(depth.russian_roulette_depth);
+  if (ImGui::SliderInt("Russian Roulette Depth", &roulette_depth, 0, 16,
+                       roulette_depth == 0 ? "Off" : "%d"))
+    depth.russian_roulette_depth = static_cast<u32>(roulette_depth);
+  if (depth != previous_depth)
+    renderer->frame_index = 0;
+  ImGui::Checkbox("Specialized Pipelines", &renderer->specialize_pipelines);
+  const char *sampler_types[] = {"Wang Hash", "Owen Scrambled Sobol"};
+  i32 sampler_type = static_cast<i32>(renderer->sampler_type);
+  if (ImGui::Combo("Sampler", &sampler_type, sampler_types,
+                   IM_ARRAYSIZE(sampler_types))) {
+    renderer->sampler_type = static_cast<SamplerType>(sampler_type);
+    renderer->frame_index = 0;
+  }
+  if (ImGui::Checkbox("Next Event Estimation",
+                      &renderer->next_event_estimation))
+    renderer->frame_index = 0;
+  ImGui::BeginDisabled(!renderer->next_event_estimation);
+  const char *light_samplings[] = {"Power", "Light BVH"};
+  i32 light_sampling = static_cast<i32>(renderer->light_sampling);
+  if (ImGui::Combo("Light Sampling", &light_sampling, light_samplings,
+                   IM_ARRAYSIZE(light_samplings))) {
+    renderer->light_sampling = static_cast<LightSampling>(light_sampling);
+    renderer->frame_index = 0;
+  }
+  ImGui::EndDisabled();
+  ImGui::Text("Emissive Triangles: %d",
+              static_cast<i32>(renderer->light_count));
+  ImGui::Text("Path Length: %.2f, %.1f M samples/s", renderer->path_length,
+              renderer->samples_per_s * 1e-6f);
+  if (!renderer->path_stats_reports.empty() &&
+      ImGui::TreeNode("Path Stats Per Setting")) {
+    ImGui::TextUnformatted("Depth, Diffuse, Specular, Transmission, Roulette");
+    for (const PathStatsReport &report : renderer->path_stats_reports) {
+      const PathDepthSettings &settings = report.depth_settings;
+      ImGui::Text("%d, %d, %d, %d, %d: %.2f, %.1f M samples/s",
+                  static_cast<i32>(settings.max_depth),
+                  static_cast<i32>(settings.diffuse_depth),
+                  static_cast<i32>(settings.specular_depth),
+                  static_cast<i32>(settings.transmission_depth),
+                  static_cast<i32>(settings.russian_roulette_depth),
+                  report.path_length, report.samples_per_s * 1e-6f);
+    }
+    ImGui::TreePop();
+  }
+
+  ImGui::SeparatorText("Denoiser");
+  DenoiserSettings &denoiser = renderer->denoiser_settings;
+  // The guides are written by the first samples of an accumulation
+  if (ImGui::Checkbox("Denoise", &denoiser.enabled) && denoiser.enabled)
+    renderer->frame_index = 0;
+  ImGui::BeginDisabled(!denoiser.enabled);
+  i32 iterations = static_cast<i32>(denoiser.iterations);
+  if (ImGui::SliderInt("Iterations", &iterations, 1, 8))
+    denoiser.iterations = static_cast<u32>(iterations);
+  ImGui::SliderFloat("Sigma Luminance", &denoiser.sigma_luminance, 0.1f,
+                     16.f);
+  ImGui::SliderFloat("Sigma Normal", &denoiser.sigma_normal, 1.f, 256.f,
+                     "%.0f", ImGuiSliderFlags_Logarithmic);
+  ImGui::SliderFloat("Sigma Depth", &denoiser.sigma_depth, 0.1f, 16.f);
+  ImGui::EndDisabled();
+
+  ImGui::SeparatorText("Frame Budget");
+  ImGui::SliderFloat("Moving Budget ms", &renderer->moving_budget_ms, 1.f,
+                     100.f);
+  ImGui::SliderFloat("Idle Budget ms", &renderer->idle_budget_ms, 1.f, 200.f);
+  ImGui::Checkbox("Multiple Dispatches Per Frame",
+                  &renderer->convergence_mode);
+  ImGui::BeginDisabled(!renderer->convergence_mode);
+  i32 max_dispatches = static_cast<i32>(renderer->max_dispatches_per_frame);
+  if (ImGui::SliderInt("Max Dispatches", &max_dispatches, 1, 128))
+    renderer->max_dispatches_per_frame = static_cast<u32>(max_dispatches);
+  ImGui::EndDisabled();
+  ImGui::Text("GPU: %.2f ms", renderer->gpu_time_ms);
+  ImGui::Text("Dispatches: %d, Tiles: %d, Spp Per Dispatch: %d",
+              static_cast<i32>(renderer->dispatches_per_frame),
+              static_cast<i32>(renderer->tiles_per_frame),
+              static_cast<i32>(renderer->sqrt_spp * renderer->sqrt_spp));
+  ImGui::Text("Accumulated Spp: %d",
+              static_cast<i32>(renderer->sample_count));
+
+  ImGui::SeparatorText("Adaptive Sampling");
+  bool resume = ImGui::Checkbox("Adaptive", &renderer->adaptive_sampling);
+  ImGui::BeginDisabled(!renderer->adaptive_sampling);
+  resume |= ImGui::SliderFloat("Error Threshold", &renderer->error_threshold,
+                               0.001f, 0.2f, "%.3f",
+                               ImGuiSliderFlags_Logarithmic);
+  ImGui::EndDisabled();
+  i32 max_spp = static_cast<i32>(renderer->max_spp);
+  if (ImGui::SliderInt("Max Spp", &max_spp, 16, 65'536, "%d",
+                       ImGuiSliderFlags_Logarithmic)) {
+    renderer->max_spp = static_cast<u32>(max_spp);
+    resume = true;
+  }
+  if (resume)
+    renderer->resume_accumulation();
+  ImGui::Text("Active Tiles: %d / %d",
+              static_cast<i32>(renderer->active_tile_count),
+              static_cast<i32>(renderer->render_tile_count));
+  if (renderer->converged)
+    ImGui::Text("Converged in %.2f s", renderer->converge_time_s);
+  else
+    ImGui::Text("Converging: %.2f s", renderer->converge_time_s);
+
+  ImGui::SeparatorText("Reference Error");
+  if (ImGui::Button("Capture Reference"))
+    renderer->capture_reference();
+  ImGui::SliderFloat("Equal Time s", &renderer->equal_time_s, 0.5f, 60.f,
+                     "%.1f");
+  if (renderer->has_reference() && renderer->reference_mse >= 0.f) {
+    ImGui::Text("MSE: %.3e at %.2f s", renderer->reference_mse,
+                renderer->reference_mse_time_s);
+    const char *integrators[] = {"BSDF Sampling", "Next Event Estimation"};
+    for (u32 i = 0; i < 2; ++i) {
+      if (renderer->equal_time_mse[i] >= 0.f)
+        ImGui::Text("%s: %.3e", integrators[i], renderer->equal_time_mse[i]);
+    }
+  }
+
+  ImGui::SeparatorText("Resolution");
+  ResolutionSettings resolution = renderer->resolution_settings;
+  bool resolution_changed = ImGui::Checkbox("Fixed", &resolution.fixed);
+  if (resolution.fixed) {
+    i32 fixed_size[2] = {static_cast<i32>(resolution.fixed_width),
+                         static_cast<i32>(resolution.fixed_height)};
+    if (ImGui::InputInt2("Size", fixed_size,
+                         ImGuiInputTextFlags_EnterReturnsTrue)) {
+      resolution.fixed_width =
+          static_cast<u32>(std::clamp(fixed_size[0], 1, 16'384));
+      resolution.fixed_height =
+          static_cast<u32>(std::clamp(fixed_size[1], 1, 16'384));
+      resolution_changed = true;
+    }
+  } else {
+    resolution_changed |= ImGui::SliderFloat(
+        "Moving Scale", &resolution.moving_scale, 0.25f, 1.f);
+    resolution_changed |=
+        ImGui::SliderFloat("Idle Scale", &resolution.idle_scale, 0.5f, 2.f);
+  }
+  if (resolution_changed)
+    renderer->set_resolution_settings(resolution);
+  ImGui::Text("Render: %dx%d, Image: %dx%d",
+              static_cast<i32>(renderer->render_extent.width),
+              static_cast<i32>(renderer->render_extent.height),
+              static_cast<i32>(renderer->output_extent.width),
+              static_cast<i32>(renderer->output_extent.height));
+
+  ImGui::SeparatorText("TLAS");
+  TLASBuildSettings settings = renderer->tlas_settings;
+  bool changed = ImGui::Checkbox("Rebraid", &settings.rebraid);
+  ImGui::BeginDisabled(!settings.rebraid);
+  changed |= ImGui::SliderFloat("Rebraid Ratio", &settings.rebraid_ratio, 0.1f,
+                                1.f);
+  i32 max_leaves = static_cast<i32>(settings.max_leaves_per_instance);
+  if (ImGui::SliderInt("Max Leaves Per Instance", &max_leaves, 1, 16)) {
+    settings.max_leaves_per_instance = static_cast<u32>(max_leaves);
+    changed = true;
+  }
+  ImGui::EndDisabled();
+  i32 tight_depth = static_cast<i32>(settings.tight_bounds_depth);
+  if (ImGui::SliderInt("Tight Bounds Depth", &tight_depth, 0, 4)) {
+    settings.tight_bounds_depth = static_cast<u32>(tight_depth);
+    changed = true;
+  }
+  changed |= ImGui::SliderFloat("Tight Bounds Ratio",
+                                &settings.tight_bounds_ratio, 0.1f, 1.f);
+  if (changed)
+    renderer->set_tlas_build_settings(settings);
+  bool dynamic_instances = renderer->dynamic_instances;
+  if (ImGui::Checkbox("Dynamic Instances", &dynamic_instances))
+    renderer->set_dynamic_instances(dynamic_instances);
+
+  ImGui::SeparatorText("Geometry");
+  ImGui::Checkbox("Compaction", &renderer->compaction_enabled);
+  i32 compaction_kb = static_cast<i32>(renderer->compaction_bytes_per_frame /
+                                       hkilo(1));
+  if (ImGui::SliderInt("Compaction KiB Per Frame", &compaction_kb, 64,
+                       hkilo(64))) {
+    renderer->compaction_bytes_per_frame =
+        hkilo(static_cast<size_t>(compaction_kb));
+  }
+
+  ImGui::SeparatorText("Streaming");
+  i32 stream_mb = static_cast<i32>(
+      renderer->staging_buffer.stream_bytes_per_frame / hmega(1));
+  if (ImGui::SliderInt("Stream MiB Per Frame", &stream_mb, 1,
+                       static_cast<i32>(renderer->staging_buffer.segment_size /
+                                        hmega(1)))) {
+    renderer->staging_buffer.stream_bytes_per_frame =
+        hmega(static_cast<size_t>(stream_mb));
+  }
+  ImGui::Text("Remaining: %.2f MiB",
+              static_cast<f64>(
+                  renderer->staging_buffer.get_streaming_bytes_remaining()) /
+                  hmega(1));
+
+  ImGui::SeparatorText("Textures");
+  LambertManager &lambert_mats = renderer->lambert_mats;
+  ImGui::BeginDisabled(!renderer->p_device->texture_compression_bc);
+  const char *encodings[] = {"RGBA8", "BC1", "BC7"};
+  i32 encoding = static_cast<i32>(lambert_mats.texture_encoding);
+  if (ImGui::Combo("Encoding", &encoding, encodings,
+                   IM_ARRAYSIZE(encodings)))
+    lambert_mats.texture_encoding = static_cast<TextureEncoding>(encoding);
+  ImGui::EndDisabled();
+  ImGui::Checkbox("Generate Mips", &lambert_mats.generate_mips);
+  ImGui::Checkbox("Atlas Small Textures", &lambert_mats.atlas_enabled);
+  ImGui::Text("Descriptors: %u / %u",
+              2 * static_cast<u32>(lambert_mats.texture_indices.size()),
+              lambert_mats.descriptor_count);
+  ImGui::Text("Memory: %.2f MiB (%.2f MiB as RGBA8 without mips)",
+              static_cast<f64>(lambert_mats.texture_bytes) / hmega(1),
+              static_cast<f64>(lambert_mats.texture_bytes_rgba8) / hmega(1));
+  i32 budget_mib = static_cast<i32>(lambert_mats.texture_budget / hmega(1));
+  if (ImGui::SliderInt("Budget (MiB)", &budget_mib, 16, 8192))
+    lambert_mats.texture_budget = static_cast<size_t>(budget_mib) * hmega(1);
+  ImGui::Text("Usable: %.2f MiB%s",
+              static_cast<f64>(lambert_mats.get_texture_budget(
+                  renderer->p_device)) /
+                  hmega(1),
+              renderer->p_device->memory_budget
+                  ? ""
+                  : " (no VK_EXT_memory_budget)");
+  u32 partially_resident_count = 0;
+  for (u32 texture_index : lambert_mats.texture_indices) {
+    if (lambert_mats.texture_residency[texture_index].resident_level > 0)
+      ++partially_resident_count;
+  }
+  ImGui::Text("Partially Resident: %u / %u", partially_resident_count,
+              static_cast<u32>(lambert_mats.texture_indices.size()));
+
+  ImGui::End();
+}
+
 } // namespace hlx
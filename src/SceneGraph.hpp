@@ -54,4 +54,5 @@ void render_scene_graph_nodes_property(SceneGraph &scene_graph, u32 node_id,
                                        Renderer *renderer);
 void render_materials_window(Renderer *renderer,
                              MaterialHandle &selected_material);
+void render_renderer_settings_window(Renderer *renderer);
 } // namespace hlx
@@ -1,38 +1,150 @@
 #include "TLAS.hpp"
 #include "AABB.hpp"
 
+#include <algorithm>
+
 namespace hlx {
 
+// A candidate TLAS leaf: a BLAS node (local to its BLAS) seen through an
+// instance transform
+struct TLASLeafRef {
+  u32 blas_instance_idx;
+  u32 blas_node_idx;
+  AABB bounds;
+  f32 area;
+};
+
+static AABB transform_aabb(const glm::mat4 &transform, const glm::vec3 &bmin,
+                           const glm::vec3 &bmax) {
+  AABB bounds = AABB();
+  for (int j = 0; j < 8; j++) {
+    glm::vec3 corner((j & 1) ? bmax.x : bmin.x, (j & 2) ? bmax.y : bmin.y,
+                     (j & 4) ? bmax.z : bmin.z);
+
+    glm::vec3 world_pos = glm::vec3(transform * glm::vec4(corner, 1.0f));
+    bounds.grow(world_pos);
+  }
+  return bounds;
+}
+
+// Union of the transformed boxes of the BLAS nodes `depth` levels below
+// node_idx. Always contained in the transformed box of node_idx.
+static AABB world_bounds(const glm::mat4 &transform,
+                         std::span<BVHNode> blas_nodes, u32 node_idx,
+                         u32 depth) {
+  const BVHNode &node = blas_nodes[node_idx];
+  if (depth == 0 || node.tri_count > 0)
+    return transform_aabb(transform, node.aabb_min, node.aabb_max);
+
+  AABB bounds =
+      world_bounds(transform, blas_nodes, node.local_left_first, depth - 1);
+  bounds.grow(world_bounds(transform, blas_nodes, node.local_left_first + 1,
+                           depth - 1));
+  return bounds;
+}
+
+static TLASLeafRef make_leaf_ref(const std::span<BLASInstance> blas_instances,
+                                 const std::span<BLAS> blas,
+                                 const std::span<BVHNode> bvh_nodes,
+                                 const TLASBuildSettings &settings,
+                                 u32 blas_inst_id, u32 blas_node_idx) {
+  const BLASInstance &inst = blas_instances[blas_inst_id];
+  std::span<BVHNode> blas_nodes =
+      bvh_nodes.subspan(blas[inst.blas_id].bvh_nodes_offset);
+  const BVHNode &node = blas_nodes[blas_node_idx];
+
+  TLASLeafRef ref;
+  ref.blas_instance_idx = blas_inst_id;
+  ref.blas_node_idx = blas_node_idx;
+  ref.bounds = transform_aabb(inst.transform, node.aabb_min, node.aabb_max);
+  ref.area = ref.bounds.half_area();
+
+  // Rotated instances get a world box much larger than their geometry, try
+  // the tighter union of the sub-node boxes instead
+  if (settings.tight_bounds_depth > 0 && node.tri_count == 0) {
+    AABB tight_bounds = world_bounds(inst.transform, blas_nodes, blas_node_idx,
+                                     settings.tight_bounds_depth);
+    f32 tight_area = tight_bounds.half_area();
+    if (tight_area < settings.tight_bounds_ratio * ref.area) {
+      ref.bounds = tight_bounds;
+      ref.area = tight_area;
+    }
+  }
+  return ref;
+}
+
 void TLAS::build(std::span<TLASNode> tlas_nodes,
                  const std::span<BLASInstance> blas_instances,
                  const std::span<u32> blas_instance_indices,
-                 const std::span<BLAS> blas,
-                 const std::span<BVHNode> bvh_nodes) {
+                 const std::span<BLAS> blas, const std::span<BVHNode> bvh_nodes,
+                 const TLASBuildSettings &settings) {
   node_count = 1;
-  std::vector<i32> node_ids(blas_instance_indices.size());
-  i32 node_indices = node_ids.size();
-  // Assign a TLASleaf node to each BLAS
-  for (u32 i = 0; i < blas_instance_indices.size(); ++i) {
-    // Find the bounds (in world space)
-    u32 blas_inst_id = blas_instance_indices[i];
-    u32 blas_idx = blas_instances[blas_inst_id].blas_id;
-    glm::vec3 bmin = bvh_nodes[blas[blas_idx].bvh_nodes_offset].aabb_min,
-              bmax = bvh_nodes[blas[blas_idx].bvh_nodes_offset].aabb_max;
-    AABB bounds = AABB();
-    glm::mat4 transform =
-        glm::inverse(blas_instances[blas_inst_id].inv_transform);
-    for (int j = 0; j < 8; j++) {
-      glm::vec3 corner((j & 1) ? bmax.x : bmin.x, (j & 2) ? bmax.y : bmin.y,
-                       (j & 4) ? bmax.z : bmin.z);
-
-      glm::vec3 world_pos = glm::vec3(transform * glm::vec4(corner, 1.0f));
-      bounds.grow(world_pos);
+  std::vector<TLASLeafRef> leaves;
+  leaves.reserve(blas_instance_indices.size());
+  if (!settings.rebraid) {
+    for (u32 i = 0; i < blas_instance_indices.size(); ++i) {
+      leaves.push_back(make_leaf_ref(blas_instances, blas, bvh_nodes, settings,
+                                     blas_instance_indices[i], 0));
+    }
+  } else {
+    // Re-braiding: always open the largest candidate first while the leaf
+    // budget lasts, and only if its children are noticeably tighter than it
+    const size_t max_leaf_count = tlas_nodes.size() / 2;
+    const size_t leaf_budget = std::clamp<size_t>(
+        blas_instance_indices.size() * settings.max_leaves_per_instance,
+        blas_instance_indices.size(), max_leaf_count);
+    auto smaller_area = [](const TLASLeafRef &a, const TLASLeafRef &b) {
+      return a.area < b.area;
+    };
+    std::priority_queue<TLASLeafRef, std::vector<TLASLeafRef>,
+                        decltype(smaller_area)>
+        candidates(smaller_area);
+    for (u32 i = 0; i < blas_instance_indices.size(); ++i) {
+      candidates.push(make_leaf_ref(blas_instances, blas, bvh_nodes, settings,
+                                    blas_instance_indices[i], 0));
+    }
+
+    size_t candidate_leaf_count = candidates.size();
+    while (!candidates.empty()) {
+      TLASLeafRef ref = candidates.top();
+      candidates.pop();
+
+      const BLASInstance &inst = blas_instances[ref.blas_instance_idx];
+      const BVHNode &node = bvh_nodes[blas[inst.blas_id].bvh_nodes_offset +
+                                      ref.blas_node_idx];
+      if (candidate_leaf_count < leaf_budget && node.tri_count == 0) {
+        TLASLeafRef left =
+            make_leaf_ref(blas_instances, blas, bvh_nodes, settings,
+                          ref.blas_instance_idx, node.local_left_first);
+        TLASLeafRef right =
+            make_leaf_ref(blas_instances, blas, bvh_nodes, settings,
+                          ref.blas_instance_idx, node.local_left_first + 1);
+        if (left.area + right.area < settings.rebraid_ratio * ref.area) {
+          candidates.push(left);
+          candidates.push(right);
+          ++candidate_leaf_count;
+          continue;
+        }
+      }
+      leaves.push_back(ref);
     }
+  }
+
+  leaf_count = leaves.size();
+  HASSERT_MSG(leaf_count * 2 <= tlas_nodes.size(),
+              "TLAS::build() - tlas_nodes is too small for the leaf count");
+  HASSERT_MSG(leaf_count * 2 <= UINT16_MAX,
+              "TLAS::build() - Too many leaves for 16 bit child indices");
+
+  std::vector<i32> node_ids(leaves.size());
+  i32 node_indices = node_ids.size();
+  // Assign a TLAS leaf node to each leaf reference
+  for (u32 i = 0; i < leaves.size(); ++i) {
     node_ids[i] = node_count;
-    tlas_nodes[node_count].aabb_min = bounds.min;
-    tlas_nodes[node_count].aabb_max = bounds.max;
-    tlas_nodes[node_count].blas_instance_idx = blas_inst_id;
-    tlas_nodes[node_count++].left_right = 0; // Leaf
+    tlas_nodes[node_count].aabb_min = leaves[i].bounds.min;
+    tlas_nodes[node_count].aabb_max = leaves[i].bounds.max;
+    tlas_nodes[node_count].blas_instance_idx = leaves[i].blas_instance_idx;
+    tlas_nodes[node_count++].left_right = leaves[i].blas_node_idx;
   }
 
   // Use agglomerative clustering to build the TLAS
@@ -44,6 +156,7 @@ void TLAS::build(std::span<TLASNode> tlas_nodes,
       TLASNode &node_a = tlas_nodes[node_id_a], &node_b = tlas_nodes[node_id_b];
       TLASNode &new_node = tlas_nodes[node_count];
       new_node.left_right = node_id_a + (node_id_b << 16);
+      new_node.blas_instance_idx = INVALID_BLAS_INSTANCE;
       new_node.aabb_min = glm::min(node_a.aabb_min, node_b.aabb_min);
       new_node.aabb_max = glm::max(node_a.aabb_max, node_b.aabb_max);
       node_ids[a] = node_count++;
@@ -2,13 +2,32 @@
 #include "BVHNode.hpp"
 
 namespace hlx {
+constexpr u32 INVALID_BLAS = UINT32_MAX;
+constexpr u32 INVALID_BLAS_INSTANCE = UINT32_MAX;
+
 struct alignas(16) TLASNode {
   glm::vec3 aabb_min;
-  u32 left_right; // 2 x 16
+  u32 left_right; // 2 x 16 for interior nodes, local BLAS node for leaves
   glm::vec3 aabb_max;
-  u32 blas_instance_idx;
+  u32 blas_instance_idx; // INVALID_BLAS_INSTANCE for interior nodes
+
+  bool is_leaf() { return blas_instance_idx != INVALID_BLAS_INSTANCE; }
+};
 
-  bool is_leaf() { return left_right == 0; }
+struct TLASBuildSettings {
+  // Open the top nodes of large instances and insert their sub-roots as TLAS
+  // leaves
+  bool rebraid{false};
+  // A BLAS node is only opened if the world areas of its children sum to less
+  // than rebraid_ratio * its own world area
+  f32 rebraid_ratio{0.9f};
+  // Leaf budget when rebraiding, relative to the instance count
+  u32 max_leaves_per_instance{4};
+  // Depth of the BLAS nodes whose transformed boxes are merged into a tighter
+  // world box. The tighter box is only used if its area is below
+  // tight_bounds_ratio * the transformed root box's area
+  u32 tight_bounds_depth{2};
+  f32 tight_bounds_ratio{0.8f};
 };
 
 struct TLAS {
@@ -16,8 +35,10 @@ public:
   void build(std::span<TLASNode> tlas_nodes,
              const std::span<BLASInstance> blas_instances,
              const std::span<u32> blas_instance_indices,
-             const std::span<BLAS> blas, const std::span<BVHNode> bvh_nodes);
+             const std::span<BLAS> blas, const std::span<BVHNode> bvh_nodes,
+             const TLASBuildSettings &settings = {});
   u32 node_count;
+  u32 leaf_count;
 
 private:
   i32 find_best_match(std::span<TLASNode> tlas_nodes, std::span<i32> node_list,
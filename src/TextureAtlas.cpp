@@ -0,0 +1,109 @@
+#include "TextureAtlas.hpp"
+#include "Core/Assert.hpp"
+// Vendor
+#include <algorithm>
+#include <cstring>
+#define STBRP_STATIC
+#define STB_RECT_PACK_IMPLEMENTATION
+#include <imgui/imstb_rectpack.h>
+
+namespace hlx {
+
+u32 TextureAtlasBuilder::add(const u8 *p_pixels, u32 width, u32 height) {
+  HASSERT(width <= ATLAS_MAX_TEXTURE_SIZE && height <= ATLAS_MAX_TEXTURE_SIZE);
+  PendingTexture &texture = textures.emplace_back();
+  texture.width = width;
+  texture.height = height;
+  texture.pixels.assign(p_pixels,
+                        p_pixels + static_cast<size_t>(width) * height * 4);
+  return static_cast<u32>(textures.size() - 1);
+}
+
+void TextureAtlasBuilder::build() {
+  pages.clear();
+  entries.assign(textures.size(), {});
+
+  // Rects are packed in units of the gutter, which keeps them aligned
+  const i32 page_units = ATLAS_PAGE_SIZE / ATLAS_GUTTER;
+  std::vector<stbrp_rect> remaining(textures.size());
+  for (u32 i = 0; i < textures.size(); ++i) {
+    remaining[i] = {};
+    remaining[i].id = static_cast<i32>(i);
+    remaining[i].w = static_cast<stbrp_coord>(
+        (textures[i].width + 3 * ATLAS_GUTTER - 1) / ATLAS_GUTTER);
+    remaining[i].h = static_cast<stbrp_coord>(
+        (textures[i].height + 3 * ATLAS_GUTTER - 1) / ATLAS_GUTTER);
+  }
+
+  std::vector<stbrp_node> nodes(page_units);
+  std::vector<stbrp_rect> unpacked;
+  while (!remaining.empty()) {
+    stbrp_context context;
+    stbrp_init_target(&context, page_units, page_units, nodes.data(),
+                      static_cast<i32>(nodes.size()));
+    stbrp_pack_rects(&context, remaining.data(),
+                     static_cast<i32>(remaining.size()));
+
+    // Trim the page to the packed rects
+    u32 used_width = 0;
+    u32 used_height = 0;
+    unpacked.clear();
+    for (const stbrp_rect &rect : remaining) {
+      if (!rect.was_packed) {
+        unpacked.push_back(rect);
+        continue;
+      }
+      used_width = std::max<u32>(used_width, rect.x + rect.w);
+      used_height = std::max<u32>(used_height, rect.y + rect.h);
+    }
+    HASSERT_MSG(unpacked.size() < remaining.size(),
+                "TextureAtlasBuilder::build() - A texture does not fit a page");
+
+    const u32 page_index = static_cast<u32>(pages.size());
+    AtlasPage &page = pages.emplace_back();
+    page.width = used_width * ATLAS_GUTTER;
+    page.height = used_height * ATLAS_GUTTER;
+    page.pixels.resize(static_cast<size_t>(page.width) * page.height * 4, 0);
+
+    for (const stbrp_rect &rect : remaining) {
+      if (!rect.was_packed)
+        continue;
+      const PendingTexture &texture = textures[rect.id];
+      const u32 rect_x = rect.x * ATLAS_GUTTER;
+      const u32 rect_y = rect.y * ATLAS_GUTTER;
+      const u32 rect_width = rect.w * ATLAS_GUTTER;
+      const u32 rect_height = rect.h * ATLAS_GUTTER;
+
+      // The whole rect holds the wrapped texture, with its origin inside the
+      // gutter
+      for (u32 y = 0; y < rect_height; ++y) {
+        const u32 src_y = (y + texture.height -
+                           ATLAS_GUTTER % texture.height) %
+                          texture.height;
+        u8 *p_dst_row =
+            page.pixels.data() +
+            ((static_cast<size_t>(rect_y) + y) * page.width + rect_x) * 4;
+        const u8 *p_src_row = texture.pixels.data() +
+                              static_cast<size_t>(src_y) * texture.width * 4;
+        for (u32 x = 0; x < rect_width; ++x) {
+          const u32 src_x = (x + texture.width -
+                             ATLAS_GUTTER % texture.width) %
+                            texture.width;
+          std::memcpy(p_dst_row + x * 4, p_src_row + src_x * 4, 4);
+        }
+      }
+
+      AtlasEntry &entry = entries[rect.id];
+      entry.page = page_index;
+      entry.uv_scale_offset[0] = static_cast<f32>(texture.width) / page.width;
+      entry.uv_scale_offset[1] = static_cast<f32>(texture.height) / page.height;
+      entry.uv_scale_offset[2] =
+          static_cast<f32>(rect_x + ATLAS_GUTTER) / page.width;
+      entry.uv_scale_offset[3] =
+          static_cast<f32>(rect_y + ATLAS_GUTTER) / page.height;
+    }
+    std::swap(remaining, unpacked);
+  }
+  textures.clear();
+}
+} // namespace hlx
@@ -0,0 +1,49 @@
+#pragma once
+
+namespace hlx {
+
+// Largest texture packed into an atlas, larger ones keep their own image
+constexpr u32 ATLAS_MAX_TEXTURE_SIZE = 512;
+constexpr u32 ATLAS_PAGE_SIZE = 2048;
+// Texels around each texture, filled with its wrapped texels so that
+// repeating uvs and filtering across its edges read the texture itself
+constexpr u32 ATLAS_GUTTER = 8;
+// Rects start on multiples of the gutter, so the levels below keep every
+// texel inside a single rect
+constexpr u32 ATLAS_LEVEL_COUNT = 4;
+
+struct AtlasPage {
+  u32 width;
+  u32 height;
+  // RGBA8
+  std::vector<u8> pixels;
+};
+
+struct AtlasEntry {
+  u32 page;
+  // Maps the texture's wrapped uvs into the page, scale xy then offset xy
+  f32 uv_scale_offset[4];
+};
+
+// Packs small RGBA8 textures into atlas pages with stb_rect_pack
+struct TextureAtlasBuilder {
+public:
+  // Returns the entry index, the pixels are copied
+  u32 add(const u8 *p_pixels, u32 width, u32 height);
+  // Packs the added textures, fills pages and entries
+  void build();
+
+public:
+  std::vector<AtlasPage> pages;
+  std::vector<AtlasEntry> entries;
+
+private:
+  struct PendingTexture {
+    u32 width;
+    u32 height;
+    std::vector<u8> pixels;
+  };
+
+  std::vector<PendingTexture> textures;
+};
+} // namespace hlx
@@ -0,0 +1,373 @@
+#include "TextureCompression.hpp"
+#include "Core/Assert.hpp"
+// Vendor
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <cstring>
+#include <glm/glm.hpp>
+#include <thread>
+
+namespace hlx {
+
+constexpr u32 BLOCK_DIM = 4;
+constexpr u32 BLOCK_TEXEL_COUNT = BLOCK_DIM * BLOCK_DIM;
+// Block rows claimed by an encoding thread at a time
+constexpr u32 ENCODE_ROW_GRAIN = 4;
+// Interpolation weights of BC7's 4 bit indices, out of 64
+constexpr u32 BC7_WEIGHTS_4[16] = {0,  4,  9,  13, 17, 21, 26, 30,
+                                   34, 38, 43, 47, 51, 55, 60, 64};
+
+struct EncodeLevel {
+  const u8 *p_pixels;
+  u32 width;
+  u32 height;
+  u32 blocks_x;
+  // Offset of the level in EncodedTexture::data
+  size_t offset;
+};
+
+struct BitWriter {
+  void write(u32 value, u32 bit_count) {
+    for (u32 i = 0; i < bit_count; ++i, ++bit) {
+      if ((value >> i) & 1)
+        p_data[bit >> 3] |= static_cast<u8>(1u << (bit & 7));
+    }
+  }
+
+  u8 *p_data;
+  u32 bit{0};
+};
+
+u32 get_mip_level_count(u32 width, u32 height) {
+  u32 level_count = 1;
+  for (u32 size = std::max(width, height); size > 1; size >>= 1)
+    ++level_count;
+  return level_count;
+}
+
+// 2x2 box filter, the last row and column are repeated for odd sizes
+static void downsample(const u8 *p_src, u32 src_width, u32 src_height,
+                       u8 *p_dst, u32 dst_width, u32 dst_height) {
+  for (u32 y = 0; y < dst_height; ++y) {
+    const u32 y0 = std::min(2 * y, src_height - 1);
+    const u32 y1 = std::min(2 * y + 1, src_height - 1);
+    for (u32 x = 0; x < dst_width; ++x) {
+      const u32 x0 = std::min(2 * x, src_width - 1);
+      const u32 x1 = std::min(2 * x + 1, src_width - 1);
+      const u8 *p_00 = p_src + (y0 * src_width + x0) * 4;
+      const u8 *p_01 = p_src + (y0 * src_width + x1) * 4;
+      const u8 *p_10 = p_src + (y1 * src_width + x0) * 4;
+      const u8 *p_11 = p_src + (y1 * src_width + x1) * 4;
+      u8 *p_out = p_dst + (y * dst_width + x) * 4;
+      for (u32 c = 0; c < 4; ++c) {
+        const u32 sum = p_00[c] + p_01[c] + p_10[c] + p_11[c];
+        p_out[c] = static_cast<u8>((sum + 2) >> 2);
+      }
+    }
+  }
+}
+
+// Texels outside of the level repeat its last row and column
+static void load_block(const EncodeLevel &level, u32 block_x, u32 block_y,
+                       glm::vec4 texels[BLOCK_TEXEL_COUNT]) {
+  for (u32 y = 0; y < BLOCK_DIM; ++y) {
+    const u32 py = std::min(block_y * BLOCK_DIM + y, level.height - 1);
+    for (u32 x = 0; x < BLOCK_DIM; ++x) {
+      const u32 px = std::min(block_x * BLOCK_DIM + x, level.width - 1);
+      const u8 *p_texel = level.p_pixels + (py * level.width + px) * 4;
+      texels[y * BLOCK_DIM + x] =
+          glm::vec4(p_texel[0], p_texel[1], p_texel[2], p_texel[3]);
+    }
+  }
+}
+
+// Endpoints of the texels' extent along their principal axis, found by power
+// iteration on the covariance matrix
+static void fit_endpoints(const glm::vec4 texels[BLOCK_TEXEL_COUNT],
+                          glm::vec4 &e0, glm::vec4 &e1) {
+  glm::vec4 mean(0.f);
+  glm::vec4 min_texel = texels[0];
+  glm::vec4 max_texel = texels[0];
+  for (u32 i = 0; i < BLOCK_TEXEL_COUNT; ++i) {
+    mean += texels[i];
+    min_texel = glm::min(min_texel, texels[i]);
+    max_texel = glm::max(max_texel, texels[i]);
+  }
+  mean /= static_cast<f32>(BLOCK_TEXEL_COUNT);
+
+  glm::mat4 covariance(0.f);
+  for (u32 i = 0; i < BLOCK_TEXEL_COUNT; ++i) {
+    const glm::vec4 d = texels[i] - mean;
+    covariance += glm::outerProduct(d, d);
+  }
+
+  glm::vec4 axis = max_texel - min_texel;
+  for (u32 i = 0; i < 8; ++i) {
+    const glm::vec4 next = covariance * axis;
+    const f32 length = glm::length(next);
+    if (length < 1e-6f)
+      break;
+    axis = next / length;
+  }
+  const f32 axis_length = glm::length(axis);
+  if (axis_length < 1e-6f) {
+    e0 = e1 = mean;
+    return;
+  }
+  axis /= axis_length;
+
+  f32 min_proj = FLT_MAX;
+  f32 max_proj = -FLT_MAX;
+  for (u32 i = 0; i < BLOCK_TEXEL_COUNT; ++i) {
+    const f32 proj = glm::dot(texels[i] - mean, axis);
+    min_proj = std::min(min_proj, proj);
+    max_proj = std::max(max_proj, proj);
+  }
+  e0 = glm::clamp(mean + axis * min_proj, 0.f, 255.f);
+  e1 = glm::clamp(mean + axis * max_proj, 0.f, 255.f);
+}
+
+static f32 distance_squared(const glm::vec4 &a, const glm::vec4 &b) {
+  const glm::vec4 d = a - b;
+  return glm::dot(d, d);
+}
+
+//
+// BC1 ///////////////////////////////////////////////////////////////////////
+static u16 pack_565(const glm::vec4 &color) {
+  const u32 r = static_cast<u32>(color.r * (31.f / 255.f) + 0.5f);
+  const u32 g = static_cast<u32>(color.g * (63.f / 255.f) + 0.5f);
+  const u32 b = static_cast<u32>(color.b * (31.f / 255.f) + 0.5f);
+  return static_cast<u16>((r << 11) | (g << 5) | b);
+}
+
+static glm::vec4 unpack_565(u16 color) {
+  const u32 r = (color >> 11) & 31;
+  const u32 g = (color >> 5) & 63;
+  const u32 b = color & 31;
+  return glm::vec4((r << 3) | (r >> 2), (g << 2) | (g >> 4),
+                   (b << 3) | (b >> 2), 0.f);
+}
+
+static void encode_bc1_block(glm::vec4 texels[BLOCK_TEXEL_COUNT], u8 *p_block) {
+  // Opaque, alpha must not pull the fit
+  for (u32 i = 0; i < BLOCK_TEXEL_COUNT; ++i)
+    texels[i].a = 0.f;
+  glm::vec4 e0, e1;
+  fit_endpoints(texels, e0, e1);
+
+  // color_0 > color_1 selects the 4 color mode
+  u16 color_0 = pack_565(e1);
+  u16 color_1 = pack_565(e0);
+  if (color_0 < color_1)
+    std::swap(color_0, color_1);
+
+  u32 indices = 0;
+  if (color_0 != color_1) {
+    const glm::vec4 c0 = unpack_565(color_0);
+    const glm::vec4 c1 = unpack_565(color_1);
+    const glm::vec4 palette[4] = {c0, c1, (2.f * c0 + c1) / 3.f,
+                                  (c0 + 2.f * c1) / 3.f};
+    for (u32 i = 0; i < BLOCK_TEXEL_COUNT; ++i) {
+      u32 best_index = 0;
+      f32 best_error = FLT_MAX;
+      for (u32 p = 0; p < 4; ++p) {
+        const f32 error = distance_squared(texels[i], palette[p]);
+        if (error < best_error) {
+          best_error = error;
+          best_index = p;
+        }
+      }
+      indices |= best_index << (2 * i);
+    }
+  }
+
+  p_block[0] = static_cast<u8>(color_0);
+  p_block[1] = static_cast<u8>(color_0 >> 8);
+  p_block[2] = static_cast<u8>(color_1);
+  p_block[3] = static_cast<u8>(color_1 >> 8);
+  for (u32 i = 0; i < 4; ++i)
+    p_block[4 + i] = static_cast<u8>(indices >> (8 * i));
+}
+
+//
+// BC7 ///////////////////////////////////////////////////////////////////////
+// Quantizes an endpoint to 7 bits per channel and a p-bit shared by the
+// channels, returns the p-bit
+static u32 quantize_bc7_endpoint(const glm::vec4 &endpoint, u32 quantized[4]) {
+  u32 best_p_bit = 0;
+  f32 best_error = FLT_MAX;
+  for (u32 p_bit = 0; p_bit < 2; ++p_bit) {
+    u32 candidate[4];
+    f32 error = 0.f;
+    for (u32 c = 0; c < 4; ++c) {
+      const i32 q = std::clamp(
+          static_cast<i32>((endpoint[c] - p_bit) * 0.5f + 0.5f), 0, 127);
+      const f32 d = static_cast<f32>((q << 1) | p_bit) - endpoint[c];
+      candidate[c] = static_cast<u32>(q);
+      error += d * d;
+    }
+    if (error < best_error) {
+      best_error = error;
+      best_p_bit = p_bit;
+      std::copy(candidate, candidate + 4, quantized);
+    }
+  }
+  return best_p_bit;
+}
+
+// Mode 6, a single subset with 7.7.7.7 endpoints, p-bits and 4 bit indices
+static void encode_bc7_block(const glm::vec4 texels[BLOCK_TEXEL_COUNT],
+                             u8 *p_block) {
+  glm::vec4 e0, e1;
+  fit_endpoints(texels, e0, e1);
+
+  u32 q0[4], q1[4];
+  u32 p0 = quantize_bc7_endpoint(e0, q0);
+  u32 p1 = quantize_bc7_endpoint(e1, q1);
+
+  glm::vec4 palette[16];
+  for (u32 i = 0; i < 16; ++i) {
+    for (u32 c = 0; c < 4; ++c) {
+      const u32 a = (q0[c] << 1) | p0;
+      const u32 b = (q1[c] << 1) | p1;
+      palette[i][c] = static_cast<f32>(
+          ((64 - BC7_WEIGHTS_4[i]) * a + BC7_WEIGHTS_4[i] * b + 32) >> 6);
+    }
+  }
+
+  u32 indices[BLOCK_TEXEL_COUNT];
+  for (u32 i = 0; i < BLOCK_TEXEL_COUNT; ++i) {
+    f32 best_error = FLT_MAX;
+    for (u32 p = 0; p < 16; ++p) {
+      const f32 error = distance_squared(texels[i], palette[p]);
+      if (error < best_error) {
+        best_error = error;
+        indices[i] = p;
+      }
+    }
+  }
+
+  // The anchor index is stored without its high bit, swap the endpoints if it
+  // is set
+  if (indices[0] & 8) {
+    std::swap(q0, q1);
+    std::swap(p0, p1);
+    for (u32 i = 0; i < BLOCK_TEXEL_COUNT; ++i)
+      indices[i] = 15 - indices[i];
+  }
+
+  std::memset(p_block, 0, 16);
+  BitWriter writer{.p_data = p_block};
+  writer.write(1u << 6, 7);
+  for (u32 c = 0; c < 4; ++c) {
+    writer.write(q0[c], 7);
+    writer.write(q1[c], 7);
+  }
+  writer.write(p0, 1);
+  writer.write(p1, 1);
+  writer.write(indices[0], 3);
+  for (u32 i = 1; i < BLOCK_TEXEL_COUNT; ++i)
+    writer.write(indices[i], 4);
+}
+
+EncodedTexture encode_texture(const u8 *p_pixels, u32 width, u32 height,
+                              TextureEncoding encoding, u32 level_count) {
+  HASSERT(p_pixels && width > 0 && height > 0);
+  HASSERT(level_count > 0 && level_count <= get_mip_level_count(width, height));
+  EncodedTexture texture{
+      .width = width, .height = height, .level_count = level_count};
+
+  // Level 0 reads the source pixels directly
+  std::vector<std::vector<u8>> mips(texture.level_count - 1);
+  std::vector<EncodeLevel> levels(texture.level_count);
+  levels[0] = {.p_pixels = p_pixels, .width = width, .height = height};
+  for (u32 i = 1; i < texture.level_count; ++i) {
+    const EncodeLevel &src = levels[i - 1];
+    EncodeLevel &dst = levels[i];
+    dst.width = std::max(width >> i, 1u);
+    dst.height = std::max(height >> i, 1u);
+    mips[i - 1].resize(static_cast<size_t>(dst.width) * dst.height * 4);
+    downsample(src.p_pixels, src.width, src.height, mips[i - 1].data(),
+               dst.width, dst.height);
+    dst.p_pixels = mips[i - 1].data();
+  }
+
+  if (encoding == TextureEncoding::RGBA8) {
+    texture.format = VK_FORMAT_R8G8B8A8_UNORM;
+    for (const EncodeLevel &level : levels) {
+      texture.level_offsets.push_back(texture.data.size());
+      const size_t size = static_cast<size_t>(level.width) * level.height * 4;
+      texture.data.insert(texture.data.end(), level.p_pixels,
+                          level.p_pixels + size);
+    }
+    return texture;
+  }
+
+  const bool is_bc1 = encoding == TextureEncoding::BC1;
+  texture.format =
+      is_bc1 ? VK_FORMAT_BC1_RGB_UNORM_BLOCK : VK_FORMAT_BC7_UNORM_BLOCK;
+  const size_t block_size = is_bc1 ? 8 : 16;
+
+  // Block rows of all levels are handed out as one range. row_starts holds
+  // the first row of each level
+  std::vector<u32> row_starts(texture.level_count);
+  u32 row_count = 0;
+  size_t size = 0;
+  for (u32 i = 0; i < texture.level_count; ++i) {
+    EncodeLevel &level = levels[i];
+    level.blocks_x = (level.width + BLOCK_DIM - 1) / BLOCK_DIM;
+    level.offset = size;
+    texture.level_offsets.push_back(size);
+    const u32 blocks_y = (level.height + BLOCK_DIM - 1) / BLOCK_DIM;
+    row_starts[i] = row_count;
+    row_count += blocks_y;
+    size += level.blocks_x * blocks_y * block_size;
+  }
+  texture.data.resize(size);
+
+  std::atomic<u32> next_row{0};
+  const auto encode_rows = [&]() {
+    glm::vec4 texels[BLOCK_TEXEL_COUNT];
+    while (true) {
+      const u32 first_row = next_row.fetch_add(ENCODE_ROW_GRAIN);
+      if (first_row >= row_count)
+        return;
+      const u32 last_row = std::min(first_row + ENCODE_ROW_GRAIN, row_count);
+      for (u32 row = first_row; row < last_row; ++row) {
+        const u32 level_index = static_cast<u32>(
+            std::upper_bound(row_starts.begin(), row_starts.end(), row) -
+            row_starts.begin() - 1);
+        const EncodeLevel &level = levels[level_index];
+        const u32 block_y = row - row_starts[level_index];
+        u8 *p_block = texture.data.data() + level.offset +
+                      block_y * level.blocks_x * block_size;
+        for (u32 block_x = 0; block_x < level.blocks_x; ++block_x) {
+          load_block(level, block_x, block_y, texels);
+          if (is_bc1)
+            encode_bc1_block(texels, p_block);
+          else
+            encode_bc7_block(texels, p_block);
+          p_block += block_size;
+        }
+      }
+    }
+  };
+
+  // JobSys is compiled out and runs one job per worker, polled every 10 ms,
+  // with no way to wait for a batch. The rows are fork-joined on plain threads
+  // for the duration of the encode instead
+  const u32 thread_count = std::clamp<u32>(
+      std::thread::hardware_concurrency(), 1,
+      (row_count + ENCODE_ROW_GRAIN - 1) / ENCODE_ROW_GRAIN);
+  std::vector<std::thread> threads;
+  threads.reserve(thread_count - 1);
+  for (u32 i = 1; i < thread_count; ++i)
+    threads.emplace_back(encode_rows);
+  encode_rows();
+  for (std::thread &thread : threads)
+    thread.join();
+  return texture;
+}
+} // namespace hlx
@@ -0,0 +1,27 @@
+#pragma once
+#include <volk/volk.h>
+
+namespace hlx {
+
+enum class TextureEncoding { RGBA8, BC1, BC7 };
+
+struct EncodedTexture {
+  VkFormat format{VK_FORMAT_UNDEFINED};
+  u32 width{0};
+  u32 height{0};
+  u32 level_count{0};
+  // Every level tightly packed in rows of texel blocks, largest first
+  std::vector<u8> data;
+  // Offset of each level in data, the levels from one on form a suffix of it
+  std::vector<size_t> level_offsets;
+};
+
+// Level count of a full mip chain down to 1x1
+u32 get_mip_level_count(u32 width, u32 height);
+
+// Builds level_count levels of a box filtered mip chain of RGBA8 pixels and
+// encodes every level. BC1 drops alpha, BC7 uses mode 6 for every block.
+// Blocks are encoded on all hardware threads
+EncodedTexture encode_texture(const u8 *p_pixels, u32 width, u32 height,
+                              TextureEncoding encoding, u32 level_count);
+} // namespace hlx
@@ -1,6 +1,8 @@
 #pragma once
+#include <bit>
 // Vendor
 #include <glm/geometric.hpp>
+#include <glm/packing.hpp>
 #include <glm/vec2.hpp>
 #include <glm/vec3.hpp>
 #include <glm/vec4.hpp>
@@ -11,26 +13,66 @@ struct alignas(16) TriangleGeom {
   TriangleGeom(const glm::vec3 &v0, const glm::vec3 &v1, const glm::vec3 &v2)
       : v0(glm::vec4(v0, 1.f)), v1(glm::vec4(v1, 1.f)), v2(glm::vec4(v2, 1.f)) {
   }
+  TriangleGeom(const glm::vec4 &v0, const glm::vec4 &v1, const glm::vec4 &v2)
+      : v0(v0), v1(v1), v2(v2) {}
 
   glm::vec4 v0;
   glm::vec4 v1;
   glm::vec4 v2;
 };
 
-struct alignas(16) TriangleShading {
-  TriangleShading() = default;
-  TriangleShading(const glm::vec3 &n0, const glm::vec3 &n1, const glm::vec3 &n2,
-                  const glm::vec2 &uv0, const glm::vec2 &uv1,
-                  const glm::vec2 &uv2)
-      : n0(glm::vec4(n0, 1.f)), n1(glm::vec4(n1, 1.f)), n2(glm::vec4(n2, 1.f)),
-        uv0(uv0), uv1(uv1), uv2(uv2) {}
-
-  glm::vec4 n0;
-  glm::vec4 n1;
-  glm::vec4 n2;
-  glm::vec2 uv0;
-  glm::vec2 uv1;
-  glm::vec2 uv2;
-  glm::vec2 padding;
+// Maps a unit vector onto the [-1, 1]^2 octahedron and packs it as 2 x snorm16
+inline u32 encode_octahedral_normal(const glm::vec3 &n) {
+  f32 l1_norm = glm::abs(n.x) + glm::abs(n.y) + glm::abs(n.z);
+  if (l1_norm == 0.f)
+    return glm::packSnorm2x16(glm::vec2(0.f));
+
+  glm::vec3 p = n / l1_norm;
+  glm::vec2 e(p.x, p.y);
+  if (p.z < 0.f) {
+    // Fold the lower hemisphere over the diagonals
+    glm::vec2 sign_not_zero(e.x >= 0.f ? 1.f : -1.f, e.y >= 0.f ? 1.f : -1.f);
+    e = (1.f - glm::abs(glm::vec2(e.y, e.x))) * sign_not_zero;
+  }
+  return glm::packSnorm2x16(e);
+}
+
+// Largest UV magnitude packed as fp16. Past it the fp16 step exceeds the
+// 2^-11 of [0, 1], tiled UVs at 64 lose 1/32 of a tile. Such meshes keep fp32
+// UVs, see BLAS_WIDE_UVS
+constexpr f32 MAX_PACKED_UV = 1.f;
+
+// Per-vertex shading attributes, indexed by the same vertex index as the
+// vertex positions. Decoded in Triangle.slang
+struct VertexShading {
+  VertexShading() = default;
+  VertexShading(const glm::vec3 &normal, const glm::vec2 &uv)
+      : normal(encode_octahedral_normal(normal)), uv(glm::packHalf2x16(uv)) {}
+  // fp32 UV, u goes to the unused w of the vertex position
+  VertexShading(const glm::vec3 &normal, f32 v)
+      : normal(encode_octahedral_normal(normal)),
+        uv(std::bit_cast<u32>(v)) {}
+
+  u32 normal; // Octahedral, 2 x snorm16
+  u32 uv;     // 2 x fp16, or the fp32 v of a BLAS_WIDE_UVS blas
+};
+
+// Indices into the global vertex pool
+struct TriangleIndices {
+  u32 i0;
+  u32 i1;
+  u32 i2;
+};
+
+// View of indexed triangle storage. tri ids index into triangles, which index
+// into vertices
+struct TriangleMesh {
+  TriangleGeom triangle(u32 tri_id) const {
+    const TriangleIndices &tri = triangles[tri_id];
+    return TriangleGeom(vertices[tri.i0], vertices[tri.i1], vertices[tri.i2]);
+  }
+
+  std::span<glm::vec4> vertices;
+  std::span<TriangleIndices> triangles;
 };
 } // namespace hlx
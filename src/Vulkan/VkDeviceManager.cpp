@@ -38,6 +38,20 @@ debug_callback(VkDebugUtilsMessageSeverityFlagBitsEXT message_severity,
 }
 #endif // VULKAN_DEBUG_REPORT
 
+static bool has_device_extension(VkPhysicalDevice device, cstring name) {
+  u32 extension_count = 0;
+  vkEnumerateDeviceExtensionProperties(device, nullptr, &extension_count,
+                                       nullptr);
+  std::vector<VkExtensionProperties> extension_properties(extension_count);
+  vkEnumerateDeviceExtensionProperties(device, nullptr, &extension_count,
+                                       extension_properties.data());
+  for (const VkExtensionProperties &extension_prop : extension_properties) {
+    if (strcmp(extension_prop.extensionName, name) == 0)
+      return true;
+  }
+  return false;
+}
+
 static VkPhysicalDevice select_physical_device(
     VkInstance vk_instance,
     const std::vector<cstring> &required_extensions_names,
@@ -380,6 +394,12 @@ void VkDeviceManager::init() {
     throw Exception("No Suitable physical device found");
   }
 
+  // Optional, heap budgets are estimated from VMA's own allocations without it
+  memory_budget = has_device_extension(vk_physical_device,
+                                       VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+  if (memory_budget)
+    device_extensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+
   // Create Logical Device
   std::vector<VkDeviceQueueCreateInfo> queue_create_infos;
   constexpr float queue_priority{1.f};
@@ -432,6 +452,8 @@ void VkDeviceManager::init() {
   features_12.runtimeDescriptorArray = VK_TRUE;
   features_12.descriptorBindingSampledImageUpdateAfterBind = VK_TRUE;
   features_12.descriptorBindingPartiallyBound = VK_TRUE;
+  features_12.descriptorBindingUpdateUnusedWhilePending = VK_TRUE;
+  features_12.descriptorBindingVariableDescriptorCount = VK_TRUE;
 
   // Enable Dynamic Rendering and Synchronization 2
   VkPhysicalDeviceVulkan13Features features_13{
@@ -455,6 +477,11 @@ void VkDeviceManager::init() {
   device_features2.features.depthClamp = VK_TRUE;
   device_features2.features.shaderStorageImageMultisample = VK_TRUE;
   device_features2.features.fillModeNonSolid = VK_TRUE;
+  // Optional, textures stay uncompressed without it
+  VkPhysicalDeviceFeatures supported_features;
+  vkGetPhysicalDeviceFeatures(vk_physical_device, &supported_features);
+  texture_compression_bc = supported_features.textureCompressionBC;
+  device_features2.features.textureCompressionBC = texture_compression_bc;
   ChainFeatures(device_features2, features_11, features_12, features_13,
                 swapchain_maint1, compute_derivates);
 
@@ -525,6 +552,9 @@ void VkDeviceManager::init() {
   } else {
     vk_transfer_queue = vk_graphics_queue;
   }
+  upload_queue_family_indices = {
+      queue_family_indices.graphics_family_index.value(),
+      queue_family_indices.transfer_family_index.value()};
 
   // Create VMA Allocator
   VmaVulkanFunctions vma_vulkan_functions{};
@@ -569,6 +599,8 @@ void VkDeviceManager::init() {
   allocator_create_info.flags =
       VMA_ALLOCATOR_CREATE_EXTERNALLY_SYNCHRONIZED_BIT |
       VMA_ALLOCATOR_CREATE_BUFFER_DEVICE_ADDRESS_BIT;
+  if (memory_budget)
+    allocator_create_info.flags |= VMA_ALLOCATOR_CREATE_EXT_MEMORY_BUDGET_BIT;
 
   VK_CHECK(vmaCreateAllocator(&allocator_create_info, &vma_allocator));
 
@@ -805,7 +837,7 @@ void VkDeviceManager::reset() {
   create_swapchain();
 }
 
-void VkDeviceManager::begin_frame() {
+void VkDeviceManager::begin_frame(bool present_frame) {
   if (vsync_changed) {
     reset();
   }
@@ -816,6 +848,16 @@ void VkDeviceManager::begin_frame() {
   VK_CHECK(
       vkResetFences(vk_device, 1, &frame_in_flight_fences.at(current_frame)));
 
+  frame_presents = present_frame;
+  if (!frame_presents) {
+    VkCommandBuffer cmd = vk_command_buffers.at(current_frame);
+    vkResetCommandBuffer(cmd, 0);
+    const VkCommandBufferBeginInfo begin_info{
+        VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO};
+    VK_CHECK(vkBeginCommandBuffer(cmd, &begin_info));
+    return;
+  }
+
   // Acquire the next swapchain image
   const VkResult result =
       vkAcquireNextImageKHR(vk_device, swapchain.vk_handle, UINT64_MAX,
@@ -858,6 +900,22 @@ void VkDeviceManager::begin_frame() {
 
 void VkDeviceManager::end_frame() {
   VkCommandBuffer cmd = vk_command_buffers.at(current_frame);
+  if (!frame_presents) {
+    VK_CHECK(vkEndCommandBuffer(cmd));
+    VkCommandBufferSubmitInfo command_submit_info{
+        VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO};
+    command_submit_info.commandBuffer = cmd;
+    VkSubmitInfo2 submit_info{VK_STRUCTURE_TYPE_SUBMIT_INFO_2};
+    submit_info.commandBufferInfoCount = 1;
+    submit_info.pCommandBufferInfos = &command_submit_info;
+    submit_info.waitSemaphoreInfoCount =
+        static_cast<u32>(submit_wait_infos.size());
+    submit_info.pWaitSemaphoreInfos = submit_wait_infos.data();
+    VK_CHECK(vkQueueSubmit2(vk_graphics_queue, 1, &submit_info,
+                            frame_in_flight_fences.at(current_frame)));
+    submit_wait_infos.clear();
+    return;
+  }
 
   // Transition swapchain to present mode
   VkImageMemoryBarrier2 image_barrier{VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2};
@@ -888,13 +946,13 @@ void VkDeviceManager::end_frame() {
       VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO};
   command_submit_info.commandBuffer = cmd;
 
-  const VkSemaphoreSubmitInfo wait_info{
+  submit_wait_infos.push_back(VkSemaphoreSubmitInfo{
       .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
       .pNext = nullptr,
       .semaphore = image_available_semaphores.at(current_frame),
       .value = 0,
       .stageMask = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
-      .deviceIndex = 0};
+      .deviceIndex = 0});
 
   const std::array<VkSemaphoreSubmitInfo, 1> signal_infos{VkSemaphoreSubmitInfo{
       .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
@@ -907,8 +965,9 @@ void VkDeviceManager::end_frame() {
   VkSubmitInfo2 submit_info{VK_STRUCTURE_TYPE_SUBMIT_INFO_2};
   submit_info.commandBufferInfoCount = 1;
   submit_info.pCommandBufferInfos = &command_submit_info;
-  submit_info.waitSemaphoreInfoCount = 1;
-  submit_info.pWaitSemaphoreInfos = &wait_info;
+  submit_info.waitSemaphoreInfoCount =
+      static_cast<u32>(submit_wait_infos.size());
+  submit_info.pWaitSemaphoreInfos = submit_wait_infos.data();
   submit_info.signalSemaphoreInfoCount = signal_infos.size();
   submit_info.pSignalSemaphoreInfos = signal_infos.data();
 
@@ -917,9 +976,45 @@ void VkDeviceManager::end_frame() {
   VkResult res = vkQueueSubmit2(vk_graphics_queue, 1, &submit_info,
                                 frame_in_flight_fences.at(current_frame));
   VK_CHECK(res);
+  submit_wait_infos.clear();
+}
+
+void VkDeviceManager::set_upload_sharing(
+    VkBufferCreateInfo &buffer_info) const {
+  if (upload_queue_family_indices[0] == upload_queue_family_indices[1]) {
+    buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    return;
+  }
+  buffer_info.sharingMode = VK_SHARING_MODE_CONCURRENT;
+  buffer_info.queueFamilyIndexCount = upload_queue_family_indices.size();
+  buffer_info.pQueueFamilyIndices = upload_queue_family_indices.data();
+}
+
+void VkDeviceManager::add_submit_wait(VkSemaphore vk_semaphore, u64 value,
+                                      VkPipelineStageFlags2 stage_mask) {
+  for (VkSemaphoreSubmitInfo &wait_info : submit_wait_infos) {
+    if (wait_info.semaphore == vk_semaphore) {
+      wait_info.value = std::max(wait_info.value, value);
+      wait_info.stageMask |= stage_mask;
+      return;
+    }
+  }
+  submit_wait_infos.push_back(VkSemaphoreSubmitInfo{
+      .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+      .pNext = nullptr,
+      .semaphore = vk_semaphore,
+      .value = value,
+      .stageMask = stage_mask,
+      .deviceIndex = 0});
 }
 
 void VkDeviceManager::present() {
+  if (!frame_presents) {
+    current_frame = (current_frame + 1) % MAX_FRAMES_IN_FLIGHT;
+    ++frame_count;
+    return;
+  }
+
   const VkPresentModeKHR new_mode =
       swapchain.vk_present_modes.at(vsync_enabled);
 
@@ -39,7 +39,9 @@ public:
   void init();
   void shutdown();
   void reset();
-  void begin_frame();
+  // A frame that does not present skips the swapchain, only its command
+  // buffer is submitted
+  void begin_frame(bool present_frame = true);
   void end_frame();
   void present();
   void create_swapchain();
@@ -47,6 +49,15 @@ public:
 
   void set_vsync(bool enable);
 
+  // Buffers the transfer queue writes and the graphics queue reads are shared
+  // by both families, instead of transferring their ownership every frame
+  void set_upload_sharing(VkBufferCreateInfo &buffer_info) const;
+
+  // Makes the next frame submission wait for a timeline semaphore value. Only
+  // the highest value is kept per semaphore
+  void add_submit_wait(VkSemaphore vk_semaphore, u64 value,
+                       VkPipelineStageFlags2 stage_mask);
+
   VkImage get_current_backbuffer() const noexcept {
     return swapchain.images.at(swapchain.current_image_index);
   }
@@ -82,6 +93,8 @@ public:
   VulkanSwapchain swapchain;
   VmaAllocator vma_allocator{VK_NULL_HANDLE};
   QueueFamilyIndices queue_family_indices;
+  // Graphics and transfer family indices
+  std::array<u32, 2> upload_queue_family_indices;
   VkQueue vk_graphics_queue{VK_NULL_HANDLE};
   VkQueue vk_transfer_queue{VK_NULL_HANDLE};
   VkQueue vk_compute_queue{VK_NULL_HANDLE};
@@ -94,11 +107,17 @@ public:
       VK_NULL_HANDLE};
   std::vector<VkSemaphore> render_finished_semaphores;
   std::array<VkSemaphore, MAX_FRAMES_IN_FLIGHT> image_available_semaphores;
+  // Extra waits for the next frame submission, cleared once it is submitted
+  std::vector<VkSemaphoreSubmitInfo> submit_wait_infos;
 
   u32 back_buffer_width{1280};
   u32 back_buffer_height{720};
   bool vsync_enabled{true};
   bool vsync_changed{false};
   bool swapchain_maintenance{false};
+  bool frame_presents{true};
+  bool texture_compression_bc{false};
+  // VK_EXT_memory_budget, vmaGetHeapBudgets() reports the driver's budgets
+  bool memory_budget{false};
 };
 } // namespace hlx
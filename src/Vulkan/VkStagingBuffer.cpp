@@ -4,6 +4,9 @@
 #include "VkDeviceManager.h"
 #include "VkErr.h"
 #include "VkResourceManager.hpp"
+#include "VkUtils.hpp"
+#include <algorithm>
+#include <iterator>
 
 namespace hlx {
 
@@ -12,6 +15,13 @@ void VkStagingBuffer::shutdown() {
     return;
   }
 
+  streams.clear();
+  retiring_streams.clear();
+  pending_acquires.clear();
+  pending_copies.clear();
+  end();
+  wait_idle();
+  vkDestroySemaphore(p_device->vk_device, vk_timeline_semaphore, nullptr);
   vkDestroyCommandPool(p_device->vk_device, vk_command_pool, nullptr);
 
   p_resource_manager->queue_destroy({buffer_handle, 0});
@@ -20,12 +30,20 @@ void VkStagingBuffer::shutdown() {
   p_resource_manager = nullptr;
   vk_command_pool = VK_NULL_HANDLE;
   vk_command_buffer = VK_NULL_HANDLE;
+  vk_timeline_semaphore = VK_NULL_HANDLE;
+  segments = {};
+  current_segment = 0;
+  segment_used = 0;
+  submitted_value = 0;
   is_recording = false;
 }
 
 void VkStagingBuffer::begin() {
   if (is_recording)
     return;
+  // The segment's memory is about to be overwritten
+  wait_for_value(segments[current_segment].retire_value);
+
   VkCommandBufferBeginInfo begin_info{
       VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO};
   begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
@@ -43,6 +61,22 @@ void VkStagingBuffer::end() {
   is_recording = false;
 }
 
+void VkStagingBuffer::wait_for_value(u64 value) {
+  u64 completed_value = 0;
+  VK_CHECK(vkGetSemaphoreCounterValue(p_device->vk_device,
+                                      vk_timeline_semaphore, &completed_value));
+  if (completed_value >= value)
+    return;
+
+  VkSemaphoreWaitInfo wait_info{VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO};
+  wait_info.semaphoreCount = 1;
+  wait_info.pSemaphores = &vk_timeline_semaphore;
+  wait_info.pValues = &value;
+  VK_CHECK(vkWaitSemaphores(p_device->vk_device, &wait_info, UINT64_MAX));
+}
+
+void VkStagingBuffer::wait_idle() { wait_for_value(submitted_value); }
+
 void VkStagingBuffer::init(VkDeviceManager *p_device,
                            VkResourceManager *p_manager, u32 queue_family_index,
                            VkQueue vk_queue, size_t size) {
@@ -56,9 +90,13 @@ void VkStagingBuffer::init(VkDeviceManager *p_device,
   this->p_device = p_device;
   this->p_resource_manager = p_manager;
   this->vk_queue = vk_queue;
+  this->queue_family_index = queue_family_index;
+
+  this->segment_size = size;
+  this->stream_bytes_per_frame = size;
 
   VkBufferCreateInfo buffer_info{VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
-  buffer_info.size = size;
+  buffer_info.size = size * STAGING_SEGMENT_COUNT;
   buffer_info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
   buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
 
@@ -82,8 +120,26 @@ void VkStagingBuffer::init(VkDeviceManager *p_device,
   cb_alloc_info.commandPool = vk_command_pool;
   cb_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
   cb_alloc_info.commandBufferCount = 1;
-  VK_CHECK(vkAllocateCommandBuffers(p_device->vk_device, &cb_alloc_info,
-                                    &vk_command_buffer));
+  for (Segment &segment : segments) {
+    VK_CHECK(vkAllocateCommandBuffers(p_device->vk_device, &cb_alloc_info,
+                                      &segment.vk_command_buffer));
+  }
+  current_segment = 0;
+  segment_used = 0;
+  vk_command_buffer = segments[current_segment].vk_command_buffer;
+
+  VkSemaphoreTypeCreateInfo semaphore_type_info{
+      VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO};
+  semaphore_type_info.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+  semaphore_type_info.initialValue = 0;
+  VkSemaphoreCreateInfo semaphore_info{VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO};
+  semaphore_info.pNext = &semaphore_type_info;
+  VK_CHECK(vkCreateSemaphore(p_device->vk_device, &semaphore_info, nullptr,
+                             &vk_timeline_semaphore));
+  p_device->set_resource_name<VkSemaphore>(VK_OBJECT_TYPE_SEMAPHORE,
+                                           vk_timeline_semaphore,
+                                           "StagingTimelineSemaphore");
+  submitted_value = 0;
 }
 
 void VkStagingBuffer::stage(const void *p_data, BufferHandle dst_buffer_handle,
@@ -93,10 +149,17 @@ void VkStagingBuffer::stage(const void *p_data, BufferHandle dst_buffer_handle,
 
   begin();
 
+  // Data that is still waiting to be copied is rewritten in place
+  if (u8 *p_pending = find_pending_bytes(dst_buffer_handle, dst_offset, size)) {
+    std::memcpy(p_pending, p_data, size);
+    segment_needs_wait = true;
+    return;
+  }
+
   VulkanBuffer *buffer = p_resource_manager->access_buffer(buffer_handle);
-  // Data to transfer cannot fit inside the staging buffer
-  if ((buffer->current_size + size) > buffer->vk_device_size) {
-    const size_t remaining_size = buffer->vk_device_size - buffer->current_size;
+  // Data to transfer cannot fit inside the current segment
+  if ((segment_used + size) > segment_size) {
+    const size_t remaining_size = segment_size - segment_used;
     stage(p_data, dst_buffer_handle, dst_offset, remaining_size);
     flush();
     dst_offset += remaining_size;
@@ -111,65 +174,386 @@ void VkStagingBuffer::stage(const void *p_data, BufferHandle dst_buffer_handle,
       HASSERT_MSG(false, "VkStagingBuffer::stage() - Destination buffer size "
                          "is less than the size of the data to copy");
     }
-    std::memcpy(static_cast<u8 *>(buffer->p_data) + buffer->current_size,
-                p_data, size);
+    std::memcpy(static_cast<u8 *>(buffer->p_data) + write_offset(), p_data,
+                size);
+    queue_copy(dst_buffer_handle, write_offset(), dst_offset, size);
+    segment_needs_wait = true;
 
-    VkBufferCopy2 region{VK_STRUCTURE_TYPE_BUFFER_COPY_2};
-    region.srcOffset = buffer->current_size;
-    region.dstOffset = dst_offset;
-    region.size = size;
+    segment_used += size;
+    dst_buffer->current_size =
+        std::max(dst_buffer->current_size, (dst_offset + size));
+  }
+}
 
-    VkCopyBufferInfo2 buffer_info{VK_STRUCTURE_TYPE_COPY_BUFFER_INFO_2};
-    buffer_info.srcBuffer = buffer->vk_handle;
-    buffer_info.dstBuffer = dst_buffer->vk_handle;
-    buffer_info.regionCount = 1;
-    buffer_info.pRegions = &region;
+VkStagingBuffer::PendingCopies &
+VkStagingBuffer::get_pending_copies(BufferHandle dst_buffer) {
+  for (PendingCopies &pending : pending_copies) {
+    if (pending.dst_buffer.index == dst_buffer.index &&
+        pending.dst_buffer.generation == dst_buffer.generation)
+      return pending;
+  }
+  pending_copies.push_back({.dst_buffer = dst_buffer});
+  return pending_copies.back();
+}
 
-    vkCmdCopyBuffer2(vk_command_buffer, &buffer_info);
+u8 *VkStagingBuffer::find_pending_bytes(BufferHandle dst_buffer,
+                                        size_t dst_offset, size_t size) {
+  PendingCopies &pending = get_pending_copies(dst_buffer);
+  auto it = pending.regions_by_offset.upper_bound(dst_offset);
+  if (it == pending.regions_by_offset.begin())
+    return nullptr;
+  const VkBufferCopy2 &region = pending.regions[std::prev(it)->second];
+  if (dst_offset + size > region.dstOffset + region.size)
+    return nullptr;
+  VulkanBuffer *buffer = p_resource_manager->access_buffer(buffer_handle);
+  return static_cast<u8 *>(buffer->p_data) + region.srcOffset +
+         (dst_offset - region.dstOffset);
+}
 
-    buffer->current_size += size;
-    dst_buffer->current_size =
-        std::max(dst_buffer->current_size, (dst_offset + size));
+void VkStagingBuffer::queue_copy(BufferHandle dst_buffer, size_t src_offset,
+                                 size_t dst_offset, size_t size) {
+  PendingCopies &pending = get_pending_copies(dst_buffer);
+
+  // Regions of one copy command must not overlap, so a partially overwritten
+  // range is recorded before the new one is queued
+  auto next = pending.regions_by_offset.lower_bound(dst_offset);
+  bool overlaps = next != pending.regions_by_offset.end() &&
+                  next->first < dst_offset + size;
+  if (next != pending.regions_by_offset.begin()) {
+    const VkBufferCopy2 &prev_region =
+        pending.regions[std::prev(next)->second];
+    overlaps |= prev_region.dstOffset + prev_region.size > dst_offset;
+  }
+  if (overlaps)
+    record_pending_copies(pending);
+
+  // Extend the last region if both ranges continue it
+  if (!pending.regions.empty()) {
+    VkBufferCopy2 &last = pending.regions.back();
+    if (last.srcOffset + last.size == src_offset &&
+        last.dstOffset + last.size == dst_offset) {
+      last.size += size;
+      return;
+    }
+  }
+
+  VkBufferCopy2 region{VK_STRUCTURE_TYPE_BUFFER_COPY_2};
+  region.srcOffset = src_offset;
+  region.dstOffset = dst_offset;
+  region.size = size;
+  pending.regions_by_offset[dst_offset] =
+      static_cast<u32>(pending.regions.size());
+  pending.regions.push_back(region);
+}
+
+void VkStagingBuffer::record_pending_copies(PendingCopies &pending) {
+  if (pending.regions.empty())
+    return;
+
+  // An earlier copy of this segment may have written the same bytes
+  if (pending.is_recorded) {
+    VkMemoryBarrier2 memory_barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER_2};
+    memory_barrier.srcStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+    memory_barrier.srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+    memory_barrier.dstStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+    memory_barrier.dstAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+
+    VkDependencyInfo dependency_info{VK_STRUCTURE_TYPE_DEPENDENCY_INFO};
+    dependency_info.memoryBarrierCount = 1;
+    dependency_info.pMemoryBarriers = &memory_barrier;
+    vkCmdPipelineBarrier2(vk_command_buffer, &dependency_info);
+  }
+
+  // Merge ranges that are contiguous in both buffers
+  std::sort(pending.regions.begin(), pending.regions.end(),
+            [](const VkBufferCopy2 &a, const VkBufferCopy2 &b) {
+              return a.dstOffset < b.dstOffset;
+            });
+  u32 region_count = 0;
+  for (const VkBufferCopy2 &region : pending.regions) {
+    if (region_count) {
+      VkBufferCopy2 &last = pending.regions[region_count - 1];
+      if (last.srcOffset + last.size == region.srcOffset &&
+          last.dstOffset + last.size == region.dstOffset) {
+        last.size += region.size;
+        continue;
+      }
+    }
+    pending.regions[region_count++] = region;
+  }
+
+  VulkanBuffer *buffer = p_resource_manager->access_buffer(buffer_handle);
+  VulkanBuffer *dst_buffer =
+      p_resource_manager->access_buffer(pending.dst_buffer);
+  VkCopyBufferInfo2 buffer_info{VK_STRUCTURE_TYPE_COPY_BUFFER_INFO_2};
+  buffer_info.srcBuffer = buffer->vk_handle;
+  buffer_info.dstBuffer = dst_buffer->vk_handle;
+  buffer_info.regionCount = region_count;
+  buffer_info.pRegions = pending.regions.data();
+  vkCmdCopyBuffer2(vk_command_buffer, &buffer_info);
+
+  pending.regions.clear();
+  pending.regions_by_offset.clear();
+  pending.is_recorded = true;
+}
+
+void VkStagingBuffer::record_pending_copies() {
+  for (PendingCopies &pending : pending_copies) {
+    record_pending_copies(pending);
   }
 }
 
 void VkStagingBuffer::stage(const void *p_data,
                             ImageViewHandle image_view_handle, size_t size,
                             size_t alignment) {
+  segment_used = align_up(segment_used, alignment);
+
+  Stream stream{.id = 0,
+                .read =
+                    [p_data](size_t src_offset, size_t read_size,
+                             void *p_dst) {
+                      std::memcpy(p_dst,
+                                  static_cast<const u8 *>(p_data) + src_offset,
+                                  read_size);
+                    },
+                .dst_buffer = {},
+                .dst_image_view = image_view_handle,
+                .dst_offset = 0,
+                .size = size,
+                .uploaded_size = 0,
+                .on_progress = {}};
+  while (stream.uploaded_size < stream.size) {
+    record_stream_chunk(stream, stream.size);
+    segment_needs_wait = true;
+  }
+}
+
+u64 VkStagingBuffer::stream(StreamReadFn read, BufferHandle dst_buffer,
+                            size_t dst_offset, size_t size,
+                            StreamProgressFn on_progress) {
+  const u64 id = next_stream_id++;
+  if (size == 0) {
+    if (on_progress)
+      on_progress(0, 0);
+    return id;
+  }
+  streams.push_back({.id = id,
+                     .read = std::move(read),
+                     .dst_buffer = dst_buffer,
+                     .dst_image_view = {},
+                     .dst_offset = dst_offset,
+                     .size = size,
+                     .uploaded_size = 0,
+                     .on_progress = std::move(on_progress)});
+  return id;
+}
+
+u64 VkStagingBuffer::stream(StreamReadFn read, ImageViewHandle image_view,
+                            size_t size, StreamProgressFn on_progress) {
+  HASSERT(size > 0);
+  const u64 id = next_stream_id++;
+  streams.push_back({.id = id,
+                     .read = std::move(read),
+                     .dst_buffer = {},
+                     .dst_image_view = image_view,
+                     .dst_offset = 0,
+                     .size = size,
+                     .uploaded_size = 0,
+                     .on_progress = std::move(on_progress)});
+  return id;
+}
+
+void VkStagingBuffer::cancel_stream(u64 stream_id) {
+  std::erase_if(streams, [stream_id](const Stream &stream) {
+    return stream.id == stream_id;
+  });
+  std::erase_if(retiring_streams, [stream_id](const RetiringStream &stream) {
+    return stream.id == stream_id;
+  });
+  std::erase_if(pending_acquires, [stream_id](const PendingAcquire &acquire) {
+    return acquire.stream_id == stream_id;
+  });
+}
+
+void VkStagingBuffer::retarget_streams(BufferHandle old_buffer,
+                                       BufferHandle new_buffer) {
+  for (Stream &stream : streams) {
+    if (stream.dst_buffer.index == old_buffer.index &&
+        stream.dst_buffer.generation == old_buffer.generation)
+      stream.dst_buffer = new_buffer;
+  }
+}
+
+void VkStagingBuffer::update() {
+  // Report the streams whose last chunk has completed on the gpu
+  u64 completed_value = 0;
+  VK_CHECK(vkGetSemaphoreCounterValue(p_device->vk_device,
+                                      vk_timeline_semaphore, &completed_value));
+  std::vector<RetiringStream> retired_streams;
+  std::erase_if(retiring_streams, [&](RetiringStream &stream) {
+    if (stream.retire_value > completed_value)
+      return false;
+    retired_streams.push_back(std::move(stream));
+    return true;
+  });
+  // The callbacks may queue or cancel streams
+  for (RetiringStream &stream : retired_streams) {
+    stream.on_progress(stream.size, stream.size);
+  }
+
+  size_t budget = stream_bytes_per_frame;
+  while (budget > 0 && !streams.empty()) {
+    Stream &stream = streams.front();
+    const size_t chunk_size = record_stream_chunk(stream, budget);
+    budget -= std::min(chunk_size, budget);
+
+    const size_t uploaded_size = stream.uploaded_size;
+    const size_t total_size = stream.size;
+    if (uploaded_size == total_size) {
+      // Completion is reported once the current segment has retired
+      if (stream.on_progress) {
+        retiring_streams.push_back({.id = stream.id,
+                                    .retire_value = submitted_value + 1,
+                                    .size = total_size,
+                                    .on_progress =
+                                        std::move(stream.on_progress)});
+      }
+      streams.pop_front();
+    } else if (stream.on_progress) {
+      StreamProgressFn on_progress = stream.on_progress;
+      on_progress(uploaded_size, total_size);
+    }
+  }
+}
+
+void VkStagingBuffer::record_acquire_barriers(VkCommandBuffer vk_cmd) {
+  if (pending_acquires.empty())
+    return;
+
+  // Releases in segments the frame already waits for, or that have completed
+  u64 completed_value = 0;
+  VK_CHECK(vkGetSemaphoreCounterValue(p_device->vk_device,
+                                      vk_timeline_semaphore, &completed_value));
+  const u64 ready_value = std::max(completed_value, frame_wait_value);
+
+  std::vector<VkImageMemoryBarrier2> image_barriers;
+  u64 wait_value = 0;
+  std::erase_if(pending_acquires, [&](const PendingAcquire &acquire) {
+    if (acquire.release_value > ready_value)
+      return false;
+    image_barriers.push_back(acquire.image_barrier);
+    wait_value = std::max(wait_value, acquire.release_value);
+    return true;
+  });
+  if (image_barriers.empty())
+    return;
+
+  VkDependencyInfo dependency_info{VK_STRUCTURE_TYPE_DEPENDENCY_INFO};
+  dependency_info.imageMemoryBarrierCount =
+      static_cast<u32>(image_barriers.size());
+  dependency_info.pImageMemoryBarriers = image_barriers.data();
+  vkCmdPipelineBarrier2(vk_cmd, &dependency_info);
+
+  // The acquire has to execute after the release
+  p_device->add_submit_wait(vk_timeline_semaphore, wait_value,
+                            VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT);
+}
+
+size_t VkStagingBuffer::get_streaming_bytes_remaining() const {
+  size_t remaining_size = 0;
+  for (const Stream &stream : streams) {
+    remaining_size += stream.size - stream.uploaded_size;
+  }
+  return remaining_size;
+}
+
+size_t VkStagingBuffer::record_stream_chunk(Stream &stream, size_t max_size) {
   begin();
 
   VulkanBuffer *buffer = p_resource_manager->access_buffer(buffer_handle);
-  // Align Up
-  buffer->current_size = align_up(buffer->current_size, alignment);
+  const size_t remaining_size = stream.size - stream.uploaded_size;
 
-  if ((buffer->current_size + size) > buffer->vk_device_size) {
-    if (size > buffer->vk_device_size) {
-      throw std::out_of_range("VkStagingBuffer::Stage - Data size (" +
-                              std::to_string(size) +
-                              ") exceeds buffer buffer->vk_device_size (" +
-                              std::to_string(buffer->vk_device_size) + ")");
-    } else {
+  if (!is_handle_valid(stream.dst_image_view)) {
+    if (segment_used == segment_size) {
       flush();
-      stage(p_data, image_view_handle, size);
-      return;
+      begin();
     }
-  }
+    const size_t chunk_size =
+        std::min({remaining_size, max_size, segment_size - segment_used});
 
-  std::memcpy(static_cast<u8 *>(buffer->p_data) + buffer->current_size, p_data,
-              size);
+    VulkanBuffer *dst_buffer =
+        p_resource_manager->access_buffer(stream.dst_buffer);
+    HASSERT_MSG(dst_buffer->vk_device_size >= stream.dst_offset + stream.size,
+                "VkStagingBuffer::record_stream_chunk() - Destination buffer "
+                "size is less than the size of the data to copy");
+    stream.read(stream.uploaded_size, chunk_size,
+                static_cast<u8 *>(buffer->p_data) + write_offset());
+    const size_t dst_offset = stream.dst_offset + stream.uploaded_size;
+    queue_copy(stream.dst_buffer, write_offset(), dst_offset, chunk_size);
+
+    segment_used += chunk_size;
+    stream.uploaded_size += chunk_size;
+    dst_buffer->current_size =
+        std::max(dst_buffer->current_size,
+                 static_cast<VkDeviceSize>(dst_offset + chunk_size));
+    return chunk_size;
+  }
 
-  // Transition image to transfer dst
   VulkanImageView *image_view =
-      p_resource_manager->access_image_view(image_view_handle);
+      p_resource_manager->access_image_view(stream.dst_image_view);
   VulkanImage *image =
       p_resource_manager->access_image(image_view->image_handle);
+  const FormatBlockInfo block = get_format_block_info(image->vk_format);
+
+  // The stream holds the view's levels tightly packed, largest first. Find
+  // the level of the next row of texel blocks
+  u32 level = image_view->base_level;
+  size_t level_offset = 0;
+  u32 level_width, level_height, block_row_count;
+  size_t row_size;
+  while (true) {
+    HASSERT_MSG(level < image_view->base_level + image_view->level_count,
+                "VkStagingBuffer::record_stream_chunk() - Stream size exceeds "
+                "the size of the image view's levels");
+    level_width = std::max(image->width() >> level, 1u);
+    level_height = std::max(image->height() >> level, 1u);
+    row_size = static_cast<size_t>((level_width + block.width - 1) /
+                                   block.width) *
+               block.size;
+    block_row_count = (level_height + block.height - 1) / block.height;
+    const size_t level_size = row_size * block_row_count;
+    if (stream.uploaded_size < level_offset + level_size)
+      break;
+    level_offset += level_size;
+    ++level;
+  }
+  if (row_size > segment_size) {
+    throw std::out_of_range("VkStagingBuffer::Stage - Row size (" +
+                            std::to_string(row_size) +
+                            ") exceeds the segment size (" +
+                            std::to_string(segment_size) + ")");
+  }
+
+  // Buffer to image copies need a source offset aligned to 4 bytes and to
+  // the texel block size
+  segment_used = align_up(segment_used, std::max<size_t>(block.size, 4));
+  if (segment_used + row_size > segment_size) {
+    flush();
+    begin();
+  }
+
+  const u32 first_row =
+      static_cast<u32>((stream.uploaded_size - level_offset) / row_size);
+  const u32 row_count = static_cast<u32>(
+      std::min({static_cast<size_t>(block_row_count - first_row),
+                std::max<size_t>(max_size / row_size, 1),
+                (segment_size - segment_used) / row_size}));
+  const size_t chunk_size = row_count * row_size;
+
+  stream.read(stream.uploaded_size, chunk_size,
+              static_cast<u8 *>(buffer->p_data) + write_offset());
+
   VkImageMemoryBarrier2 image_barrier{VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2};
-  image_barrier.srcStageMask = VK_PIPELINE_STAGE_2_NONE;
-  image_barrier.srcAccessMask = VK_ACCESS_2_NONE;
-  image_barrier.dstStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
-  image_barrier.dstAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
-  image_barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-  image_barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
   image_barrier.image = image->vk_handle;
   image_barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
   image_barrier.subresourceRange.baseMipLevel = image_view->base_level;
@@ -182,16 +566,30 @@ void VkStagingBuffer::stage(const void *p_data,
   dependency_info.imageMemoryBarrierCount = 1;
   dependency_info.pImageMemoryBarriers = &image_barrier;
 
-  vkCmdPipelineBarrier2(vk_command_buffer, &dependency_info);
+  // Transition all levels to transfer dst before the first band. Later bands
+  // write disjoint rows and need no barrier between them
+  if (stream.uploaded_size == 0) {
+    image_barrier.srcStageMask = VK_PIPELINE_STAGE_2_NONE;
+    image_barrier.srcAccessMask = VK_ACCESS_2_NONE;
+    image_barrier.dstStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+    image_barrier.dstAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+    image_barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    image_barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    vkCmdPipelineBarrier2(vk_command_buffer, &dependency_info);
+  }
 
   VkBufferImageCopy2 region{VK_STRUCTURE_TYPE_BUFFER_IMAGE_COPY_2};
-  region.bufferOffset = buffer->current_size;
+  region.bufferOffset = write_offset();
   region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-  region.imageSubresource.mipLevel = 0;
+  region.imageSubresource.mipLevel = level;
   region.imageSubresource.baseArrayLayer = 0;
   region.imageSubresource.layerCount = 1;
-  region.imageOffset = {0, 0, 0};
-  region.imageExtent = {image->width(), image->height(), 1};
+  // Extents of block compressed levels may end in a partial block
+  const u32 first_texel_row = first_row * block.height;
+  region.imageOffset = {0, static_cast<i32>(first_texel_row), 0};
+  region.imageExtent = {
+      level_width,
+      std::min(row_count * block.height, level_height - first_texel_row), 1};
 
   VkCopyBufferToImageInfo2 buffer_image_info{
       VK_STRUCTURE_TYPE_COPY_BUFFER_TO_IMAGE_INFO_2};
@@ -202,31 +600,54 @@ void VkStagingBuffer::stage(const void *p_data,
   buffer_image_info.pRegions = &region;
   vkCmdCopyBufferToImage2(vk_command_buffer, &buffer_image_info);
 
-  // Transition image to shader read only
-  image_barrier.srcStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
-  image_barrier.srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
-  image_barrier.dstStageMask = VK_PIPELINE_STAGE_2_NONE;
-  image_barrier.dstAccessMask = VK_ACCESS_2_NONE;
-  image_barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-  image_barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-  vkCmdPipelineBarrier2(vk_command_buffer, &dependency_info);
+  // Transition image to shader read only after the last band of the last
+  // level
+  if (stream.uploaded_size + chunk_size == stream.size) {
+    image_barrier.srcStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+    image_barrier.srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+    image_barrier.dstStageMask = VK_PIPELINE_STAGE_2_NONE;
+    image_barrier.dstAccessMask = VK_ACCESS_2_NONE;
+    image_barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    image_barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+    // Release the image to the graphics queue, the matching acquire is
+    // recorded by record_acquire_barriers()
+    const u32 graphics_family_index =
+        p_device->queue_family_indices.graphics_family_index.value();
+    if (queue_family_index != graphics_family_index) {
+      image_barrier.srcQueueFamilyIndex = queue_family_index;
+      image_barrier.dstQueueFamilyIndex = graphics_family_index;
+
+      VkImageMemoryBarrier2 acquire_barrier = image_barrier;
+      acquire_barrier.srcStageMask = VK_PIPELINE_STAGE_2_NONE;
+      acquire_barrier.srcAccessMask = VK_ACCESS_2_NONE;
+      acquire_barrier.dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT |
+                                     VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT;
+      acquire_barrier.dstAccessMask = VK_ACCESS_2_SHADER_SAMPLED_READ_BIT;
+      pending_acquires.push_back({.stream_id = stream.id,
+                                  .release_value = submitted_value + 1,
+                                  .image_barrier = acquire_barrier});
+    }
+    vkCmdPipelineBarrier2(vk_command_buffer, &dependency_info);
+  }
 
-  buffer->current_size += size;
+  segment_used += chunk_size;
+  stream.uploaded_size += chunk_size;
+  return chunk_size;
 }
 
 void VkStagingBuffer::copy_data(const void *p_data, size_t size,
                                 size_t alignment) {
   VulkanBuffer *buffer = p_resource_manager->access_buffer(buffer_handle);
   // Align Up
-  buffer->current_size =
-      (buffer->current_size + alignment - 1) & ~(alignment - 1);
+  segment_used = align_up(segment_used, alignment);
 
-  if ((buffer->current_size + size) > buffer->vk_device_size) {
-    if (size > buffer->vk_device_size) {
+  if ((segment_used + size) > segment_size) {
+    if (size > segment_size) {
       throw std::out_of_range("VkStagingBuffer::Stage - Data size (" +
                               std::to_string(size) +
-                              ") exceeds buffer buffer->vk_device_size (" +
-                              std::to_string(buffer->vk_device_size) + ")");
+                              ") exceeds the segment size (" +
+                              std::to_string(segment_size) + ")");
     } else {
       flush();
     }
@@ -234,27 +655,109 @@ void VkStagingBuffer::copy_data(const void *p_data, size_t size,
 
   begin();
 
-  std::memcpy(static_cast<u8 *>(buffer->p_data) + buffer->current_size, p_data,
+  std::memcpy(static_cast<u8 *>(buffer->p_data) + write_offset(), p_data,
               size);
+  segment_needs_wait = true;
+
+  segment_used += size;
+}
+
+void VkStagingBuffer::copy_buffer(BufferHandle src_buffer_handle,
+                                  size_t src_offset,
+                                  BufferHandle dst_buffer_handle,
+                                  size_t dst_offset, size_t size) {
+  if (size == 0)
+    return;
+
+  begin();
+
+  VulkanBuffer *src_buffer =
+      p_resource_manager->access_buffer(src_buffer_handle);
+  VulkanBuffer *dst_buffer =
+      p_resource_manager->access_buffer(dst_buffer_handle);
+  HASSERT_MSG(src_buffer->vk_device_size >= src_offset + size &&
+                  dst_buffer->vk_device_size >= dst_offset + size,
+              "VkStagingBuffer::copy_buffer() - Copy size exceeds the size of "
+              "a buffer");
+
+  segment_needs_wait = true;
+
+  // Earlier staged copies into src_buffer must land before it is read
+  record_pending_copies();
+  VkMemoryBarrier2 memory_barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER_2};
+  memory_barrier.srcStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+  memory_barrier.srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+  memory_barrier.dstStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+  memory_barrier.dstAccessMask =
+      VK_ACCESS_2_TRANSFER_READ_BIT | VK_ACCESS_2_TRANSFER_WRITE_BIT;
+
+  VkDependencyInfo dependency_info{VK_STRUCTURE_TYPE_DEPENDENCY_INFO};
+  dependency_info.memoryBarrierCount = 1;
+  dependency_info.pMemoryBarriers = &memory_barrier;
+  vkCmdPipelineBarrier2(vk_command_buffer, &dependency_info);
+
+  VkBufferCopy2 region{VK_STRUCTURE_TYPE_BUFFER_COPY_2};
+  region.srcOffset = src_offset;
+  region.dstOffset = dst_offset;
+  region.size = size;
+
+  VkCopyBufferInfo2 buffer_info{VK_STRUCTURE_TYPE_COPY_BUFFER_INFO_2};
+  buffer_info.srcBuffer = src_buffer->vk_handle;
+  buffer_info.dstBuffer = dst_buffer->vk_handle;
+  buffer_info.regionCount = 1;
+  buffer_info.pRegions = &region;
+  vkCmdCopyBuffer2(vk_command_buffer, &buffer_info);
 
-  buffer->current_size += size;
+  // Later staged copies may overwrite parts of the copied range
+  vkCmdPipelineBarrier2(vk_command_buffer, &dependency_info);
+
+  dst_buffer->current_size = std::max(
+      dst_buffer->current_size, static_cast<VkDeviceSize>(dst_offset + size));
 }
 
 void VkStagingBuffer::flush() {
+  if (!is_recording)
+    return;
+
+  record_pending_copies();
+  pending_copies.clear();
   end();
 
+  Segment &segment = segments[current_segment];
+  segment.retire_value = ++submitted_value;
+
   VkCommandBufferSubmitInfo command_submit_info{
       VK_STRUCTURE_TYPE_COMMAND_BUFFER_SUBMIT_INFO};
-  command_submit_info.commandBuffer = vk_command_buffer;
+  command_submit_info.commandBuffer = segment.vk_command_buffer;
+
+  const VkSemaphoreSubmitInfo signal_info{
+      .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
+      .pNext = nullptr,
+      .semaphore = vk_timeline_semaphore,
+      .value = segment.retire_value,
+      .stageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+      .deviceIndex = 0};
 
   VkSubmitInfo2 submit_info{VK_STRUCTURE_TYPE_SUBMIT_INFO_2};
   submit_info.commandBufferInfoCount = 1;
   submit_info.pCommandBufferInfos = &command_submit_info;
+  submit_info.signalSemaphoreInfoCount = 1;
+  submit_info.pSignalSemaphoreInfos = &signal_info;
+
+  VK_CHECK(vkQueueSubmit2(vk_queue, 1, &submit_info, VK_NULL_HANDLE));
+
+  // Anything reading staged data is recorded into the frame's command buffer.
+  // Segments that only carry stream chunks run alongside the frame, streams
+  // report completion once their segment has retired
+  if (segment_needs_wait) {
+    p_device->add_submit_wait(vk_timeline_semaphore, submitted_value,
+                              VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT);
+    frame_wait_value = submitted_value;
+  }
+  segment_needs_wait = false;
 
-  vkQueueSubmit2(vk_queue, 1, &submit_info, VK_NULL_HANDLE);
-  vkQueueWaitIdle(vk_queue);
-
-  VulkanBuffer *buffer = p_resource_manager->access_buffer(buffer_handle);
-  buffer->current_size = 0;
+  current_segment = (current_segment + 1) % STAGING_SEGMENT_COUNT;
+  segment_used = 0;
+  vk_command_buffer = segments[current_segment].vk_command_buffer;
 }
 } // namespace hlx
@@ -1,40 +1,176 @@
 #pragma once
 
 #include "VkResources.hpp"
+#include <deque>
+#include <functional>
+#include <map>
 
 namespace hlx {
 
 struct VkDeviceManager;
 struct VkResourceManager;
 
+// Number of staging segments that can be in flight on the gpu at once
+constexpr u32 STAGING_SEGMENT_COUNT = 3;
+
+// Ring of staging segments. Each flush submits the current segment without
+// waiting and moves on to the next one. A segment is retired once the timeline
+// semaphore reaches the value its submission signals, and the cpu only blocks
+// when it wraps around to a segment that is still in flight
 struct VkStagingBuffer {
 public:
+  // Writes size bytes of the source, starting at src_offset, to p_dst
+  using StreamReadFn =
+      std::function<void(size_t src_offset, size_t size, void *p_dst)>;
+  // Called after each recorded chunk of a stream, and with uploaded_bytes ==
+  // total_bytes once the last chunk has completed on the gpu
+  using StreamProgressFn =
+      std::function<void(size_t uploaded_bytes, size_t total_bytes)>;
+
+  // size is the size of a single segment, which bounds the largest image that
+  // can be staged
   void init(VkDeviceManager *p_device, VkResourceManager *p_manager,
             u32 queue_family_index, VkQueue vk_queue, size_t size);
   void shutdown();
 
+  // Submits the recorded copies. The device's next frame submission waits for
+  // them unless the segment only holds stream chunks. Does not block the cpu
   void flush();
+  // Blocks until every submitted copy has completed
+  void wait_idle();
+  // Buffer copies are batched per destination buffer and recorded as one
+  // multi-region copy on flush(), or earlier if a staged range partially
+  // overlaps a pending one. Restaging a pending range rewrites it in place
   void stage(const void *p_data, BufferHandle dst_buffer, size_t dst_offset,
              size_t size);
   // NOTE: This function assumes the texture has been recently made and
-  // is in UNDEFINED layout. It also assumes that it is a SAMPLED texture
+  // is in UNDEFINED layout. It also assumes that it is a SAMPLED texture.
+  // The data holds every level of the view tightly packed, largest first, in
+  // rows of texel blocks. Images larger than a segment are copied in bands of
+  // rows
   void stage(const void *p_data, ImageViewHandle image_view, size_t size,
              size_t alignment = 1);
 
+  // Queues an upload that update() records in chunks over the following
+  // frames. read is called lazily, so the source only has to stay valid until
+  // the last chunk has been recorded. Returns an id for cancel_stream()
+  u64 stream(StreamReadFn read, BufferHandle dst_buffer, size_t dst_offset,
+             size_t size, StreamProgressFn on_progress = {});
+  // Same layout assumptions as stage(). The image stays in TRANSFER_DST
+  // layout until the last band of rows has been recorded
+  u64 stream(StreamReadFn read, ImageViewHandle image_view, size_t size,
+             StreamProgressFn on_progress = {});
+  // Drops the unrecorded part of a stream, no-op for finished streams
+  void cancel_stream(u64 stream_id);
+  // Redirects queued streams after a buffer has been replaced
+  void retarget_streams(BufferHandle old_buffer, BufferHandle new_buffer);
+  // Reports streams that have completed on the gpu, then records up to
+  // stream_bytes_per_frame bytes of the queued streams
+  void update();
+  // Records the graphics queue half of the ownership transfers of uploaded
+  // images, for the releases the frame can safely wait for. Needed when the
+  // transfer queue belongs to another family
+  void record_acquire_barriers(VkCommandBuffer vk_cmd);
+  size_t get_streaming_bytes_remaining() const;
+
   // Just copy data to the buffer
   void copy_data(const void *p_data, size_t size, size_t alignment = 1);
 
+  // GPU-side copy between two device buffers, or two disjoint ranges of the
+  // same buffer. Ordered after earlier and before later staged copies
+  void copy_buffer(BufferHandle src_buffer, size_t src_offset,
+                   BufferHandle dst_buffer, size_t dst_offset, size_t size);
+
 public:
   VkDeviceManager *p_device{nullptr};
   VkResourceManager *p_resource_manager{nullptr};
   BufferHandle buffer_handle;
   VkCommandPool vk_command_pool{VK_NULL_HANDLE};
+  // Command buffer of the current segment
   VkCommandBuffer vk_command_buffer{VK_NULL_HANDLE};
   VkQueue vk_queue{VK_NULL_HANDLE};
+  u32 queue_family_index{0};
+  VkSemaphore vk_timeline_semaphore{VK_NULL_HANDLE};
+  // Size of a single segment, the most that one submission can carry
+  size_t segment_size{0};
+  size_t stream_bytes_per_frame{0};
+  // Timeline value signaled by the most recent submission
+  u64 submitted_value{0};
   bool is_recording{false};
 
 private:
+  struct Segment {
+    VkCommandBuffer vk_command_buffer{VK_NULL_HANDLE};
+    // Timeline value after which the segment can be reused
+    u64 retire_value{0};
+  };
+
+  struct Stream {
+    u64 id;
+    StreamReadFn read;
+    BufferHandle dst_buffer;
+    ImageViewHandle dst_image_view;
+    size_t dst_offset;
+    size_t size;
+    size_t uploaded_size;
+    StreamProgressFn on_progress;
+  };
+
+  struct RetiringStream {
+    u64 id;
+    u64 retire_value;
+    size_t size;
+    StreamProgressFn on_progress;
+  };
+
+  struct PendingAcquire {
+    u64 stream_id;
+    // Timeline value of the segment holding the release
+    u64 release_value;
+    VkImageMemoryBarrier2 image_barrier;
+  };
+
+  struct PendingCopies {
+    BufferHandle dst_buffer;
+    std::vector<VkBufferCopy2> regions;
+    // Region index by destination offset, the regions never overlap
+    std::map<VkDeviceSize, u32> regions_by_offset;
+    // A copy into the buffer has already been recorded in this segment
+    bool is_recorded{false};
+  };
+
   void begin();
   void end();
+  PendingCopies &get_pending_copies(BufferHandle dst_buffer);
+  // Staging memory of a pending copy that covers the whole range, if any
+  u8 *find_pending_bytes(BufferHandle dst_buffer, size_t dst_offset,
+                         size_t size);
+  void queue_copy(BufferHandle dst_buffer, size_t src_offset,
+                  size_t dst_offset, size_t size);
+  void record_pending_copies(PendingCopies &pending);
+  void record_pending_copies();
+  // Records at most max_size bytes of the stream into the current segment,
+  // moving on to the next segment if the current one is full. Image chunks are
+  // whole rows of texel blocks of a single level and always contain at least
+  // one row
+  size_t record_stream_chunk(Stream &stream, size_t max_size);
+  void wait_for_value(u64 value);
+  // Offset of the next free byte of the current segment in the buffer
+  size_t write_offset() const {
+    return current_segment * segment_size + segment_used;
+  }
+
+  std::array<Segment, STAGING_SEGMENT_COUNT> segments;
+  u32 current_segment{0};
+  size_t segment_used{0};
+  // The current segment holds data the next frame reads
+  bool segment_needs_wait{false};
+  // Highest value a frame submission has been made to wait for
+  u64 frame_wait_value{0};
+  std::vector<PendingCopies> pending_copies;
+  std::deque<Stream> streams;
+  std::vector<RetiringStream> retiring_streams;
+  std::vector<PendingAcquire> pending_acquires;
+  u64 next_stream_id{1};
 };
 } // namespace hlx
@@ -1,6 +1,33 @@
 #include "VkUtils.hpp"
+#include "Core/Assert.hpp"
 
 namespace hlx {
+FormatBlockInfo get_format_block_info(VkFormat format) {
+  switch (format) {
+  case VK_FORMAT_R8G8B8A8_UNORM:
+  case VK_FORMAT_R8G8B8A8_SRGB:
+  case VK_FORMAT_B8G8R8A8_UNORM:
+  case VK_FORMAT_B8G8R8A8_SRGB:
+    return {4, 1, 1};
+  case VK_FORMAT_R16G16B16A16_SFLOAT:
+    return {8, 1, 1};
+  case VK_FORMAT_R32G32B32A32_SFLOAT:
+    return {16, 1, 1};
+  case VK_FORMAT_BC1_RGB_UNORM_BLOCK:
+  case VK_FORMAT_BC1_RGB_SRGB_BLOCK:
+  case VK_FORMAT_BC1_RGBA_UNORM_BLOCK:
+  case VK_FORMAT_BC1_RGBA_SRGB_BLOCK:
+    return {8, 4, 4};
+  case VK_FORMAT_BC7_UNORM_BLOCK:
+  case VK_FORMAT_BC7_SRGB_BLOCK:
+    return {16, 4, 4};
+  default:
+    HASSERT_MSGS(false, "get_format_block_info() - Unhandled format: {}",
+                 static_cast<i32>(format));
+    return {4, 1, 1};
+  }
+}
+
 void push_debug_label(VkCommandBuffer cmd, std::string_view name) {
 #ifdef VULKAN_DEBUG_NAMES
   const std::array<float, 4> color = {1.f, 1.f, 1.f, 1.f};
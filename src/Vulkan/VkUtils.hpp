@@ -2,6 +2,15 @@
 #include <volk/volk.h>
 
 namespace hlx {
+// Size and texel extent of a format's texel block, 1x1 for uncompressed
+// formats
+struct FormatBlockInfo {
+  u32 size;
+  u32 width;
+  u32 height;
+};
+FormatBlockInfo get_format_block_info(VkFormat format);
+
 void push_debug_label(VkCommandBuffer cmd, std::string_view name);
 void push_debug_label(VkCommandBuffer cmd, std::string_view name,
                       const std::array<float, 4> &color);